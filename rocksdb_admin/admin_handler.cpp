@@ -191,8 +191,10 @@ folly::Future<std::unique_ptr<rocksdb::DB>> GetRocksdbFuture(
 
 
 std::unique_ptr<::admin::ApplicationDBManager> CreateDBBasedOnConfig(
-    const admin::RocksDBOptionsGeneratorType& rocksdb_options) {
+    const admin::RocksDBOptionsGeneratorType& rocksdb_options,
+    admin::CheckpointHandlerType on_checkpoint_downloaded) {
   auto db_manager = std::make_unique<::admin::ApplicationDBManager>();
+  db_manager->setCheckpointHandler(std::move(on_checkpoint_downloaded));
   std::string content;
   CHECK(folly::readFile(FLAGS_shard_config_path.c_str(), content));
 
@@ -348,8 +350,17 @@ AdminHandler::AdminHandler(
   , meta_db_(OpenMetaDB())
   , allow_overlapping_keys_segments_()
   , num_current_s3_sst_downloadings_(0) {
+  // Slaves fallen behind the WAL of their upstream bootstrap from a
+  // checkpoint of it, which we swap in for the db
+  auto on_checkpoint_downloaded = [this] (const std::string& db_name,
+                                          const std::string& checkpoint_dir) {
+    replaceDBWithCheckpoint(db_name, checkpoint_dir);
+  };
   if (db_manager_ == nullptr) {
-    db_manager_ = CreateDBBasedOnConfig(rocksdb_options_);
+    db_manager_ = CreateDBBasedOnConfig(rocksdb_options_,
+                                        std::move(on_checkpoint_downloaded));
+  } else {
+    db_manager_->setCheckpointHandler(std::move(on_checkpoint_downloaded));
   }
   folly::splitTo<std::string>(
       ",", FLAGS_allow_overlapping_keys_segments,
@@ -388,6 +399,79 @@ std::unique_ptr<rocksdb::DB> AdminHandler::removeDB(
   return db;
 }
 
+void AdminHandler::replaceDBWithCheckpoint(const std::string& db_name,
+                                           const std::string& checkpoint_dir) {
+  db_admin_lock_.Lock(db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(db_name); };
+
+  boost::system::error_code error;
+  auto db = getDB(db_name, nullptr);
+  if (db == nullptr || !db->IsSlave() || db->upstream_addr() == nullptr) {
+    // the db has been closed or is no longer a Slave meanwhile
+    LOG(ERROR) << "Dropping checkpoint " << checkpoint_dir << " of "
+               << db_name;
+    boost::filesystem::remove_all(checkpoint_dir, error);
+    return;
+  }
+  auto upstream_addr =
+    std::make_unique<folly::SocketAddress>(*db->upstream_addr());
+  db.reset();
+
+  // Move the checkpoint next to the db first, so that the db is kept if it
+  // has been downloaded to another file system and can't be moved
+  auto db_path = FLAGS_rocksdb_dir + db_name;
+  auto new_db_path = db_path + "_checkpoint";
+  boost::filesystem::remove_all(new_db_path, error);
+  boost::filesystem::rename(checkpoint_dir, new_db_path, error);
+  if (error) {
+    LOG(ERROR) << "Failed to move " << checkpoint_dir << " to " << new_db_path
+               << ": " << error.message();
+    boost::filesystem::remove_all(checkpoint_dir, error);
+    return;
+  }
+
+  LOG(INFO) << "Replacing " << db_name << " with checkpoint "
+            << checkpoint_dir;
+  AdminException e;
+  auto old_db = removeDB(db_name, &e);
+  if (old_db == nullptr) {
+    LOG(ERROR) << "Failed to remove " << db_name << ": " << e.message;
+    boost::filesystem::remove_all(new_db_path, error);
+    return;
+  }
+  old_db.reset();
+
+  auto segment = admin::DbNameToSegment(db_name);
+  auto status = rocksdb::DestroyDB(db_path, rocksdb_options_(segment));
+  if (!status.ok()) {
+    // keep the old db, which bootstraps again
+    LOG(ERROR) << "Failed to clear " << db_name << ": " << status.ToString();
+    boost::filesystem::remove_all(new_db_path, error);
+  } else {
+    boost::filesystem::remove_all(db_path, error);
+    boost::filesystem::rename(new_db_path, db_path, error);
+    if (error) {
+      LOG(ERROR) << "Failed to move " << new_db_path << " to " << db_path
+                 << ": " << error.message();
+    }
+  }
+
+  rocksdb::DB* rocksdb_db;
+  status = rocksdb::DB::Open(rocksdb_options_(segment), db_path, &rocksdb_db);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to open " << db_name << ": " << status.ToString();
+    return;
+  }
+
+  std::string err_msg;
+  if (!db_manager_->addDB(db_name,
+                          std::unique_ptr<rocksdb::DB>(rocksdb_db),
+                          replicator::DBRole::SLAVE,
+                          std::move(upstream_addr), &err_msg)) {
+    LOG(ERROR) << "Failed to add " << db_name << " back: " << err_msg;
+  }
+}
+
 DBMetaData AdminHandler::getMetaData(const std::string& db_name) {
   DBMetaData meta;
   meta.db_name = db_name;
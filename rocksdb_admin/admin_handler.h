@@ -151,6 +151,11 @@ class AdminHandler : virtual public AdminSvIf {
   std::unique_ptr<rocksdb::DB> removeDB(const std::string& db_name,
                                         AdminException* ex);
 
+  // Replace the Slave db_name with the checkpoint of its upstream downloaded
+  // to checkpoint_dir, and add it back with the same upstream.
+  void replaceDBWithCheckpoint(const std::string& db_name,
+                               const std::string& checkpoint_dir);
+
   DBMetaData getMetaData(const std::string& db_name);
   bool clearMetaData(const std::string& db_name);
   bool writeMetaData(const std::string& db_name,
@@ -17,14 +17,36 @@
 
 #include <string>
 
+#include "common/network_util.h"
 #include "common/stats/stats.h"
 #include "common/timer.h"
+#include "rocksdb_admin/shard_config_upstream_resolver.h"
 
 DEFINE_bool(disable_rocksplicator_db_stats, false,
             "Disable the stats for rocksplicator db");
 
+DEFINE_bool(resolve_upstream_from_shard_config, false,
+            "If true, Slaves replicate from the Master of their shards in "
+            "the shard config, and follow it as the config changes. They "
+            "fail over to the most caught-up peer while the Master is "
+            "unreachable.");
+
+DECLARE_string(shard_config_path);
+DECLARE_int32(port);
+DECLARE_int32(rocksdb_replicator_port);
+
 namespace {
 
+// Shared by all Slaves. It is never destroyed, so that it outlives them.
+std::shared_ptr<replicator::UpstreamResolver> getUpstreamResolver() {
+  static auto resolver = new std::shared_ptr<replicator::UpstreamResolver>(
+    std::make_shared<admin::ShardConfigUpstreamResolver>(
+      FLAGS_shard_config_path,
+      folly::SocketAddress(common::getLocalIPAddress(), FLAGS_port),
+      FLAGS_rocksdb_replicator_port));
+  return *resolver;
+}
+
 const std::string kRocksdbNewIterator = "rocksdb_new_iterator";
 const std::string kRocksdbNewIteratorMs = "rocksdb_new_iterator_ms";
 const std::string kRocksdbGet = "rocksdb_get";
@@ -45,16 +67,26 @@ ApplicationDB::ApplicationDB(
     const std::string& db_name,
     std::shared_ptr<rocksdb::DB> db,
     replicator::DBRole role,
-    std::unique_ptr<folly::SocketAddress> upstream_addr)
+    std::unique_ptr<folly::SocketAddress> upstream_addr,
+    CheckpointHandlerType on_checkpoint_downloaded)
     : db_name_(db_name)
     , db_(std::move(db))
     , role_(role)
     , upstream_addr_(std::move(upstream_addr))
     , replicated_db_(nullptr) {
   if (!IsSlave() || upstream_addr_) {
+    replicator::ReplicatedDBOptions options;
+    if (IsSlave() && FLAGS_resolve_upstream_from_shard_config &&
+        !FLAGS_shard_config_path.empty()) {
+      options.upstream_resolver = getUpstreamResolver();
+    }
+    if (IsSlave()) {
+      options.on_checkpoint_downloaded = std::move(on_checkpoint_downloaded);
+    }
+
     auto ret = replicator::RocksDBReplicator::instance()->addDB(db_name_,
       db_, role_, upstream_addr_ ? *upstream_addr_ : folly::SocketAddress(),
-      &replicated_db_);
+      &replicated_db_, options);
     if (ret != replicator::ReturnCode::OK) {
       throw ret;
     }
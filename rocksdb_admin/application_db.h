@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 
 #include "folly/SocketAddress.h"
@@ -25,6 +26,13 @@
 
 namespace admin {
 
+// Called with the db name and the directory of a checkpoint of upstream, which
+// a Slave fallen behind the WAL of its upstream has downloaded. It is expected
+// to replace the db with the checkpoint.
+using CheckpointHandlerType =
+  std::function<void(const std::string& db_name,
+                     const std::string& checkpoint_dir)>;
+
 // This class is the wrapper of Rocksdb::DB, it adds the replication logic
 // along with basic data operations(read/write)
 class ApplicationDB {
@@ -34,10 +42,12 @@ class ApplicationDB {
   // db:            (IN) shared pointer of rocksdb instance
   // role:          (IN) replication role of this db
   // upstream_addr: (IN) upstream address if applicable
+  // on_checkpoint_downloaded: (IN) checkpoint handler for Slaves, if any
   ApplicationDB(const std::string& db_name,
                 std::shared_ptr<rocksdb::DB> db,
                 replicator::DBRole role,
-                std::unique_ptr<folly::SocketAddress> upstream_addr);
+                std::unique_ptr<folly::SocketAddress> upstream_addr,
+                CheckpointHandlerType on_checkpoint_downloaded = nullptr);
 
   // Create a rocksdb iterator based on the give options.
   // options: (IN) Read options
@@ -28,7 +28,8 @@ const int kRemoveDBRefWaitMilliSec = 200;
 
 ApplicationDBManager::ApplicationDBManager()
     : dbs_()
-    , dbs_lock_() {}
+    , dbs_lock_()
+    , on_checkpoint_downloaded_() {}
 
 bool ApplicationDBManager::addDB(const std::string& db_name,
                                  std::unique_ptr<rocksdb::DB> db,
@@ -52,12 +53,19 @@ bool ApplicationDBManager::addDB(const std::string& db_name,
   auto rocksdb_ptr = std::shared_ptr<rocksdb::DB>(db.release(),
     [](rocksdb::DB* db){});
   auto application_db_ptr = std::make_shared<ApplicationDB>(db_name,
-    std::move(rocksdb_ptr), role, std::move(up_addr));
+    std::move(rocksdb_ptr), role, std::move(up_addr),
+    on_checkpoint_downloaded_);
 
   dbs_.emplace(db_name, std::move(application_db_ptr));
   return true;
 }
 
+void ApplicationDBManager::setCheckpointHandler(
+    CheckpointHandlerType on_checkpoint_downloaded) {
+  std::unique_lock<std::shared_mutex> lock(dbs_lock_);
+  on_checkpoint_downloaded_ = std::move(on_checkpoint_downloaded);
+}
+
 const std::shared_ptr<ApplicationDB> ApplicationDBManager::getDB(
     const std::string& db_name,
     std::string* error_message) {
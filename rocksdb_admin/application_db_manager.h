@@ -57,6 +57,12 @@ class ApplicationDBManager {
              std::unique_ptr<folly::SocketAddress> upstream_addr,
              std::string* error_message);
 
+  // Set the handler Slaves added from now on call once they have downloaded
+  // a checkpoint of their upstream. Slaves without one keep retrying to pull
+  // from upstream if it has purged its WAL.
+  // on_checkpoint_downloaded: (IN) The checkpoint handler
+  void setCheckpointHandler(CheckpointHandlerType on_checkpoint_downloaded);
+
   // Get ApplicationDB instance of the given name
   // Returned db is not supposed to be long held by client
   // db_name:        (IN) Name of the ApplicationDB instance to be returned
@@ -87,6 +93,8 @@ class ApplicationDBManager {
  private:
   std::unordered_map<std::string, std::shared_ptr<ApplicationDB>> dbs_;
   mutable std::shared_mutex dbs_lock_;
+  // Protected by dbs_lock_
+  CheckpointHandlerType on_checkpoint_downloaded_;
 
   void waitOnApplicationDBRef(const std::shared_ptr<ApplicationDB>& db);
 };
@@ -0,0 +1,103 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "rocksdb_admin/shard_config_upstream_resolver.h"
+
+#include <string>
+#include <vector>
+
+#include "common/file_watcher.h"
+#include "rocksdb_admin/utils.h"
+
+namespace admin {
+
+ShardConfigUpstreamResolver::ShardConfigUpstreamResolver(
+    const std::string& config_path,
+    const folly::SocketAddress& local_addr,
+    uint16_t replicator_port)
+    : config_path_(config_path)
+    , local_addr_(local_addr)
+    , replicator_port_(replicator_port)
+    , cluster_layout_()
+    , version_(0)
+    , watching_(false) {
+  watching_ = common::FileWatcher::Instance()->AddFile(
+    config_path_,
+    [this] (std::string content) {
+      std::shared_ptr<const common::detail::ClusterLayout> new_layout(
+        common::parseConfig(std::move(content), ""));
+      if (new_layout == nullptr) {
+        LOG(ERROR) << "Failed to parse the shard config " << config_path_;
+        return;
+      }
+
+      std::atomic_store_explicit(&cluster_layout_, std::move(new_layout),
+                                 std::memory_order_release);
+      ++version_;
+    });
+
+  if (!watching_) {
+    LOG(ERROR) << "Failed to watch " << config_path_;
+  }
+}
+
+ShardConfigUpstreamResolver::~ShardConfigUpstreamResolver() {
+  if (watching_ && !common::FileWatcher::Instance()->RemoveFile(config_path_)) {
+    LOG(ERROR) << "Failed to stop watching " << config_path_;
+  }
+}
+
+uint64_t ShardConfigUpstreamResolver::version() {
+  return version_.load();
+}
+
+bool ShardConfigUpstreamResolver::resolve(
+    const std::string& db_name,
+    folly::SocketAddress* master,
+    std::vector<folly::SocketAddress>* peers) {
+  const auto layout = std::atomic_load_explicit(&cluster_layout_,
+                                                std::memory_order_acquire);
+  if (layout == nullptr) {
+    return false;
+  }
+
+  auto itor = layout->segments.find(DbNameToSegment(db_name));
+  const int shard_id = ExtractShardId(db_name);
+  if (itor == layout->segments.end() || shard_id < 0 ||
+      static_cast<size_t>(shard_id) >= itor->second.shard_to_hosts.size()) {
+    return false;
+  }
+
+  *master = folly::SocketAddress();
+  peers->clear();
+  for (const auto& host : itor->second.shard_to_hosts[shard_id]) {
+    if (host.first->addr == local_addr_) {
+      continue;
+    }
+
+    auto addr = host.first->addr;
+    addr.setPort(replicator_port_);
+    if (host.second == common::detail::Role::MASTER &&
+        !master->isInitialized()) {
+      *master = std::move(addr);
+    } else {
+      peers->push_back(std::move(addr));
+    }
+  }
+
+  return true;
+}
+
+}  // namespace admin
@@ -0,0 +1,65 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/thrift_router.h"
+#include "folly/SocketAddress.h"
+#include "rocksdb_replicator/upstream_resolver.h"
+
+namespace admin {
+
+// Resolves the upstream of Slaves from the shard config, which is reloaded
+// whenever it changes. The Master of a db is the host marked as its Master
+// in the config, and its peers are the other hosts of the same shard.
+class ShardConfigUpstreamResolver : public replicator::UpstreamResolver {
+ public:
+  // config_path:     (IN) shard config in the format of common::parseConfig()
+  // local_addr:      (IN) address of the local host in the config, which is
+  //                       never returned
+  // replicator_port: (IN) the port Replicators listen on on every host
+  ShardConfigUpstreamResolver(const std::string& config_path,
+                              const folly::SocketAddress& local_addr,
+                              uint16_t replicator_port);
+
+  ~ShardConfigUpstreamResolver();
+
+  uint64_t version() override;
+
+  bool resolve(const std::string& db_name,
+               folly::SocketAddress* master,
+               std::vector<folly::SocketAddress>* peers) override;
+
+  // no copy or move
+  ShardConfigUpstreamResolver(const ShardConfigUpstreamResolver&) = delete;
+  ShardConfigUpstreamResolver& operator=(
+    const ShardConfigUpstreamResolver&) = delete;
+
+ private:
+  const std::string config_path_;
+  const folly::SocketAddress local_addr_;
+  const uint16_t replicator_port_;
+  std::shared_ptr<const common::detail::ClusterLayout> cluster_layout_;
+  // bumped every time a new config is loaded
+  std::atomic<uint64_t> version_;
+  bool watching_;
+};
+
+}  // namespace admin
@@ -0,0 +1,89 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_admin/shard_config_upstream_resolver.h"
+
+using admin::ShardConfigUpstreamResolver;
+using folly::SocketAddress;
+using std::string;
+using std::vector;
+
+namespace {
+
+const string kConfigPath = "/tmp/shard_config_upstream_resolver_test";
+
+void writeConfig(const string& content) {
+  std::ofstream os(kConfigPath);
+  os << content;
+}
+
+}  // namespace
+
+TEST(ShardConfigUpstreamResolverTest, Basics) {
+  writeConfig(
+    "{"
+    "  \"seg\": {"
+    "  \"num_shards\": 2,"
+    "  \"127.0.0.1:8090\": [\"00000:M\", \"00001:S\"],"
+    "  \"127.0.0.1:8091\": [\"00000:S\", \"00001:M\"],"
+    "  \"127.0.0.1:8092\": [\"00000:S\", \"00001:S\"]"
+    "   }"
+    "}");
+  ShardConfigUpstreamResolver resolver(kConfigPath,
+                                       SocketAddress("127.0.0.1", 8092),
+                                       9091);
+  const auto version = resolver.version();
+  EXPECT_GT(version, 0);
+
+  SocketAddress master;
+  vector<SocketAddress> peers;
+  EXPECT_TRUE(resolver.resolve("seg00000", &master, &peers));
+  EXPECT_EQ(master, SocketAddress("127.0.0.1", 9091));
+  EXPECT_EQ(peers, vector<SocketAddress>{SocketAddress("127.0.0.1", 9091)});
+  EXPECT_FALSE(resolver.resolve("seg00002", &master, &peers));
+  EXPECT_FALSE(resolver.resolve("unknown00000", &master, &peers));
+
+  // 8091 takes over shard 0, and the local host becomes the Master of shard 1
+  writeConfig(
+    "{"
+    "  \"seg\": {"
+    "  \"num_shards\": 2,"
+    "  \"127.0.0.1:8091\": [\"00000:M\", \"00001:S\"],"
+    "  \"127.0.0.1:8092\": [\"00000:S\", \"00001:M\"]"
+    "   }"
+    "}");
+  while (resolver.version() == version) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  EXPECT_TRUE(resolver.resolve("seg00000", &master, &peers));
+  EXPECT_EQ(master, SocketAddress("127.0.0.1", 9091));
+  EXPECT_TRUE(peers.empty());
+  EXPECT_TRUE(resolver.resolve("seg00001", &master, &peers));
+  EXPECT_FALSE(master.isInitialized());
+  EXPECT_EQ(peers, vector<SocketAddress>{SocketAddress("127.0.0.1", 9091)});
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,89 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace replicator { namespace detail {
+
+/*
+ * BatchSizeController decides how many updates and bytes a Slave asks for in
+ * one pull request.
+ *
+ * The limits are the base limits times a scale in [1, max_scale]. The scale
+ * doubles every time a response shows the Slave is lagging, i.e. the response
+ * was full or its last update is older than catch_up_lag_ms, and halves once
+ * the Slave has caught up. So a Slave catching up after an outage quickly
+ * moves to large batches, while a caught up Slave keeps the base limits.
+ *
+ * @note BatchSizeController is not thread safe.
+ */
+class BatchSizeController {
+ public:
+  BatchSizeController(const int32_t base_updates,
+                      const int64_t base_bytes,
+                      const uint64_t catch_up_lag_ms,
+                      const int32_t max_scale)
+    : base_updates_(base_updates)
+    , base_bytes_(base_bytes)
+    , catch_up_lag_ms_(catch_up_lag_ms)
+    , max_scale_(std::max(max_scale, 1))
+    , scale_(1) {}
+
+  /*
+   * The max number of updates to ask for. 0 means no limit.
+   */
+  int32_t maxUpdates() const {
+    return base_updates_ * scale_;
+  }
+
+  /*
+   * The max number of bytes to ask for. 0 means no limit.
+   */
+  int64_t maxBytes() const {
+    return base_bytes_ * scale_;
+  }
+
+  /*
+   * Feed back a response with num_updates updates of num_bytes bytes in total.
+   * lag_ms is how long ago its last update was written to the Master.
+   */
+  void onResponse(const int32_t num_updates,
+                  const int64_t num_bytes,
+                  const uint64_t lag_ms) {
+    bool full = (maxUpdates() > 0 && num_updates >= maxUpdates()) ||
+                (maxBytes() > 0 && num_bytes >= maxBytes());
+    if (full || lag_ms > catch_up_lag_ms_) {
+      scale_ = std::min(scale_ * 2, max_scale_);
+    } else {
+      scale_ = std::max(scale_ / 2, 1);
+    }
+  }
+
+  int32_t scale() const {
+    return scale_;
+  }
+
+ private:
+  const int32_t base_updates_;
+  const int64_t base_bytes_;
+  const uint64_t catch_up_lag_ms_;
+  const int32_t max_scale_;
+  int32_t scale_;
+};
+
+}  // namespace detail
+}  // namespace replicator
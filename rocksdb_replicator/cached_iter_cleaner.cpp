@@ -58,6 +58,7 @@ void RocksDBReplicator::CachedIterCleaner::scheduleCleanup() {
             }
 
             db->cleanIdleCachedIters();
+            db->cleanExpiredCheckpoint();
             ++itor;
           }
         }
@@ -0,0 +1,589 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// Bootstrapping Slaves which have fallen behind the WAL of their upstream.
+// Upstream creates a checkpoint of the db and streams its files to the Slave,
+// which hands the downloaded checkpoint to the application through
+// ReplicatedDBOptions::on_checkpoint_downloaded.
+//
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "folly/Conv.h"
+#include "folly/MoveWrapper.h"
+#include "folly/futures/Future.h"
+#include "folly/io/IOBuf.h"
+#include "rocksdb/env.h"
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb_replicator/rate_limiter.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+
+DEFINE_string(replicator_checkpoint_dir, "",
+              "The directory to create checkpoints for Slaves to bootstrap "
+              "from, under which each db has its own sub directory. If empty, "
+              "checkpoints of a db are created next to it.");
+
+DEFINE_int32(replicator_checkpoint_ttl_sec, 3600,
+             "How long a checkpoint is kept for Slaves to download. Slaves "
+             "asking for a checkpoint in the meantime share the same one.");
+
+DEFINE_uint64(replicator_checkpoint_rate_bytes_per_sec, 64 * 1024 * 1024,
+              "Max rate of sending checkpoint files to Slaves, shared by all "
+              "dbs. 0 means no limit");
+
+DEFINE_int32(replicator_checkpoint_chunk_bytes, 4 * 1024 * 1024,
+             "Max size of checkpoint file data transferred in one call");
+
+DEFINE_string(replicator_checkpoint_download_dir, "",
+              "The directory Slaves download checkpoints to, under which each "
+              "db has its own sub directory. If empty, checkpoints are "
+              "downloaded next to the db.");
+
+namespace {
+
+// The file in a download directory recording which checkpoint is being
+// downloaded to it, so that a Slave can resume an interrupted download.
+const char kCheckpointIdFile[] = "REPLICATOR_CHECKPOINT_ID";
+
+uint64_t GetCurrentTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Reserve bandwidth for sending bytes of checkpoint files.
+// Return how long to wait before sending them.
+uint64_t reserveCheckpointBandwidthMs(uint64_t bytes) {
+  static replicator::detail::RateLimiter limiter;
+  return limiter.reserveMs(bytes,
+                           FLAGS_replicator_checkpoint_rate_bytes_per_sec);
+}
+
+// Checkpoints only have regular files directly under their directories.
+void deleteDir(rocksdb::Env* env, const std::string& dir) {
+  std::vector<std::string> children;
+  if (!env->GetChildren(dir, &children).ok()) {
+    return;
+  }
+
+  for (const auto& child : children) {
+    if (child == "." || child == "..") {
+      continue;
+    }
+    env->DeleteFile(dir + "/" + child);
+  }
+  env->DeleteDir(dir);
+}
+
+bool isValidFileName(const std::string& name) {
+  return !name.empty() && name != "." && name != ".." &&
+    name != kCheckpointIdFile && name.find('/') == std::string::npos;
+}
+
+replicator::ReplicateException makeCheckpointException(
+    replicator::ErrorCode code, std::string msg) {
+  replicator::ReplicateException e;
+  e.msg = std::move(msg);
+  e.code = code;
+  return e;
+}
+
+}  // namespace
+
+namespace replicator {
+
+std::string RocksDBReplicator::ReplicatedDB::checkpointBaseDir() const {
+  if (FLAGS_replicator_checkpoint_dir.empty()) {
+    return db_->GetName() + "_replicator_checkpoints";
+  }
+
+  return FLAGS_replicator_checkpoint_dir + "/" + db_name_;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::getCheckpoint(
+    GetCheckpointResponse* response) {
+  std::lock_guard<std::mutex> g(checkpoint_mutex_);
+  if (checkpoint_id_.empty()) {
+    auto env = db_->GetEnv();
+    auto base_dir = checkpointBaseDir();
+    // checkpoints left by previous processes
+    std::vector<std::string> children;
+    if (env->GetChildren(base_dir, &children).ok()) {
+      for (const auto& child : children) {
+        if (child != "." && child != "..") {
+          deleteDir(env, base_dir + "/" + child);
+        }
+      }
+    }
+    if (!FLAGS_replicator_checkpoint_dir.empty()) {
+      env->CreateDirIfMissing(FLAGS_replicator_checkpoint_dir);
+    }
+    auto status = env->CreateDirIfMissing(base_dir);
+    if (!status.ok()) {
+      return status;
+    }
+
+    auto now = GetCurrentTimeMs();
+    auto id = folly::to<std::string>(now);
+    auto dir = base_dir + "/" + id;
+    rocksdb::Checkpoint* checkpoint;
+    status = rocksdb::Checkpoint::Create(db_.get(), &checkpoint);
+    if (!status.ok()) {
+      return status;
+    }
+    std::unique_ptr<rocksdb::Checkpoint> checkpoint_guard(checkpoint);
+    status = checkpoint->CreateCheckpoint(dir);
+    if (!status.ok()) {
+      deleteDir(env, dir);
+      return status;
+    }
+
+    std::vector<CheckpointFile> files;
+    children.clear();
+    status = env->GetChildren(dir, &children);
+    for (const auto& child : children) {
+      if (!status.ok()) {
+        break;
+      }
+      if (child == "." || child == "..") {
+        continue;
+      }
+      uint64_t size;
+      status = env->GetFileSize(dir + "/" + child, &size);
+      CheckpointFile file;
+      file.name = child;
+      file.size = static_cast<int64_t>(size);
+      files.push_back(std::move(file));
+    }
+    if (!status.ok()) {
+      deleteDir(env, dir);
+      return status;
+    }
+
+    LOG(INFO) << "Created checkpoint " << dir << " for " << db_name_;
+    checkpoint_id_ = std::move(id);
+    checkpoint_created_ms_ = now;
+    checkpoint_files_ = std::move(files);
+  }
+
+  response->checkpoint_id = checkpoint_id_;
+  response->files = checkpoint_files_;
+  return rocksdb::Status::OK();
+}
+
+void RocksDBReplicator::ReplicatedDB::cleanExpiredCheckpoint() {
+  std::lock_guard<std::mutex> g(checkpoint_mutex_);
+  if (checkpoint_id_.empty() ||
+      GetCurrentTimeMs() < checkpoint_created_ms_ +
+        static_cast<uint64_t>(FLAGS_replicator_checkpoint_ttl_sec) * 1000) {
+    return;
+  }
+
+  auto dir = checkpointBaseDir() + "/" + checkpoint_id_;
+  LOG(INFO) << "Removing expired checkpoint " << dir << " of " << db_name_;
+  deleteDir(db_->GetEnv(), dir);
+  checkpoint_id_.clear();
+  checkpoint_files_.clear();
+}
+
+void RocksDBReplicator::ReplicatedDB::handleGetCheckpointRequest(
+    std::unique_ptr<GetCheckpointCallbackType> callback,
+    std::unique_ptr<GetCheckpointRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  // Creating a checkpoint may flush the db, which is too slow for the IO
+  // thread.
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  executor_->add(
+    [weak_db = std::move(weak_db),
+     request = folly::makeMoveWrapper(std::move(request)),
+     callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        (*callback).release()->exceptionInThread(makeCheckpointException(
+          ErrorCode::SOURCE_NOT_FOUND,
+          (*request)->db_name + " has been removed"));
+        return;
+      }
+
+      GetCheckpointResponse response;
+      auto status = db->getCheckpoint(&response);
+      if (!status.ok()) {
+        LOG(ERROR) << "Failed to create checkpoint for " << db->db_name_
+                   << ": " << status.ToString();
+        incCounter(kReplicatorCheckpointErrors, 1, db->db_name_);
+        (*callback).release()->exceptionInThread(
+          toReplicateException(status));
+        return;
+      }
+
+      (*callback).release()->resultInThread(std::move(response));
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReadCheckpointFileRequest(
+    std::unique_ptr<ReadCheckpointFileCallbackType> callback,
+    std::unique_ptr<ReadCheckpointFileRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  int64_t file_size = -1;
+  {
+    std::lock_guard<std::mutex> g(checkpoint_mutex_);
+    if (request->checkpoint_id == checkpoint_id_) {
+      for (const auto& file : checkpoint_files_) {
+        if (file.name == request->file_name) {
+          file_size = file.size;
+          break;
+        }
+      }
+    }
+  }
+
+  if (file_size < 0 || request->offset < 0) {
+    callback.release()->exceptionInThread(makeCheckpointException(
+      ErrorCode::OTHER, "Unknown checkpoint file " + request->checkpoint_id +
+      "/" + request->file_name + " of " + db_name_));
+    return;
+  }
+
+  if (request->max_bytes <= 0 ||
+      request->max_bytes > FLAGS_replicator_checkpoint_chunk_bytes) {
+    request->max_bytes = FLAGS_replicator_checkpoint_chunk_bytes;
+  }
+  auto bytes = std::min<int64_t>(request->max_bytes,
+                                 std::max<int64_t>(file_size - request->offset,
+                                                   0));
+  auto delay_ms = reserveCheckpointBandwidthMs(bytes);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto read = [weak_db = std::move(weak_db),
+               request = folly::makeMoveWrapper(std::move(request)),
+               callback = folly::makeMoveWrapper(std::move(callback))]
+              () mutable {
+    auto db = weak_db.lock();
+    if (db == nullptr) {
+      (*callback).release()->exceptionInThread(makeCheckpointException(
+        ErrorCode::SOURCE_NOT_FOUND,
+        (*request)->db_name + " has been removed"));
+      return;
+    }
+
+    db->readCheckpointFile(std::move(*callback), std::move(*request));
+  };
+
+  if (delay_ms == 0) {
+    executor_->add(std::move(read));
+    return;
+  }
+
+#if __GNUC__ >= 8
+  auto timer = folly::futures::sleepUnsafe(std::chrono::milliseconds(delay_ms));
+#else
+  auto timer = folly::futures::sleep(std::chrono::milliseconds(delay_ms));
+#endif
+  std::move(timer).via(executor_).then(
+    [read = std::move(read)] (folly::Try<folly::Unit>&& t) mutable {
+      read();
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::readCheckpointFile(
+    std::unique_ptr<ReadCheckpointFileCallbackType> callback,
+    std::unique_ptr<ReadCheckpointFileRequest> request) {
+  int64_t file_size = -1;
+  {
+    // the checkpoint may have expired while we were waiting
+    std::lock_guard<std::mutex> g(checkpoint_mutex_);
+    if (request->checkpoint_id == checkpoint_id_) {
+      for (const auto& file : checkpoint_files_) {
+        if (file.name == request->file_name) {
+          file_size = file.size;
+          break;
+        }
+      }
+    }
+  }
+
+  if (file_size < 0) {
+    callback.release()->exceptionInThread(makeCheckpointException(
+      ErrorCode::OTHER, "Checkpoint " + request->checkpoint_id + " of " +
+      db_name_ + " has expired"));
+    return;
+  }
+
+  auto path = checkpointBaseDir() + "/" + request->checkpoint_id + "/" +
+    request->file_name;
+  auto bytes = static_cast<size_t>(std::max<int64_t>(
+    std::min<int64_t>(request->max_bytes, file_size - request->offset), 0));
+  auto buf = folly::IOBuf::create(bytes);
+  std::unique_ptr<rocksdb::RandomAccessFile> file;
+  auto status = db_->GetEnv()->NewRandomAccessFile(path, &file,
+                                                   rocksdb::EnvOptions());
+  if (status.ok() && bytes > 0) {
+    auto scratch = reinterpret_cast<char*>(buf->writableData());
+    rocksdb::Slice result;
+    status = file->Read(request->offset, bytes, &result, scratch);
+    if (status.ok()) {
+      if (result.data() != scratch) {
+        memcpy(scratch, result.data(), result.size());
+      }
+      buf->append(result.size());
+    }
+  }
+
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to read " << path << ": " << status.ToString();
+    incCounter(kReplicatorCheckpointErrors, 1, db_name_);
+    callback.release()->exceptionInThread(toReplicateException(status));
+    return;
+  }
+
+  incCounter(kReplicatorCheckpointOutBytes, buf->length(), db_name_);
+  ReadCheckpointFileResponse response;
+  response.data = std::move(*buf);
+  callback.release()->resultInThread(std::move(response));
+}
+
+void RocksDBReplicator::ReplicatedDB::bootstrapFromUpstream() {
+  CHECK(role_ == DBRole::SLAVE);
+  // With pipelined pulls, more than one response may tell us to bootstrap.
+  if (bootstrapping_.exchange(true)) {
+    return;
+  }
+
+  LOG(INFO) << db_name_ << " has fallen behind the WAL of "
+            << upstreamAddr().describe() << ", bootstrap from a checkpoint";
+  GetCheckpointRequest req;
+  req.db_name = db_name_;
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto options = rpc_options_;
+  upstreamClient()->future_getCheckpoint(options, req).via(executor_)
+    .then([weak_db = std::move(weak_db)]
+          (folly::Try<GetCheckpointResponse>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        db->handleGetCheckpointResponse(std::move(t));
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::bootstrapFailed() {
+  incCounter(kReplicatorCheckpointErrors, 1, db_name_);
+  bootstrapping_.store(false);
+  // The next pull request fails again, and starts over from where we stopped.
+  delayNextPull();
+}
+
+void RocksDBReplicator::ReplicatedDB::handleGetCheckpointResponse(
+    folly::Try<GetCheckpointResponse>&& t) {
+  if (t.hasException()) {
+    LOG(ERROR) << "Failed to get a checkpoint of " << db_name_ << ": "
+               << t.exception().what();
+    bootstrapFailed();
+    return;
+  }
+
+  auto& response = t.value();
+  for (const auto& file : response.files) {
+    if (!isValidFileName(file.name) || file.size < 0) {
+      LOG(ERROR) << "Invalid checkpoint file " << file.name << " of "
+                 << db_name_;
+      bootstrapFailed();
+      return;
+    }
+  }
+
+  auto env = db_->GetEnv();
+  std::string dir;
+  if (FLAGS_replicator_checkpoint_download_dir.empty()) {
+    dir = db_->GetName() + "_bootstrap";
+  } else {
+    env->CreateDirIfMissing(FLAGS_replicator_checkpoint_download_dir);
+    dir = FLAGS_replicator_checkpoint_download_dir + "/" + db_name_;
+  }
+
+  // Keep what has been downloaded only if it is from the same checkpoint.
+  auto id_file = dir + "/" + kCheckpointIdFile;
+  std::string id;
+  if (!rocksdb::ReadFileToString(env, id_file, &id).ok() ||
+      id != response.checkpoint_id) {
+    deleteDir(env, dir);
+    auto status = env->CreateDirIfMissing(dir);
+    if (status.ok()) {
+      status = rocksdb::WriteStringToFile(env, response.checkpoint_id, id_file,
+                                          true /* should_sync */);
+    }
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to prepare " << dir << ": " << status.ToString();
+      bootstrapFailed();
+      return;
+    }
+  }
+
+  auto download = std::make_shared<CheckpointDownload>();
+  download->checkpoint_id = std::move(response.checkpoint_id);
+  download->files = std::move(response.files);
+  download->file_index = 0;
+  download->offset = 0;
+  download->dir = std::move(dir);
+  downloadCheckpoint(std::move(download));
+}
+
+void RocksDBReplicator::ReplicatedDB::downloadCheckpoint(
+    std::shared_ptr<CheckpointDownload> download) {
+  auto env = db_->GetEnv();
+  while (download->file == nullptr) {
+    if (download->file_index == download->files.size()) {
+      checkpointDownloaded(std::move(download));
+      return;
+    }
+
+    const auto& file = download->files[download->file_index];
+    auto path = download->dir + "/" + file.name;
+    uint64_t size = 0;
+    auto exists = env->GetFileSize(path, &size).ok();
+    if (exists && static_cast<int64_t>(size) == file.size) {
+      ++download->file_index;
+      continue;
+    }
+
+    rocksdb::Status status;
+    if (exists && static_cast<int64_t>(size) < file.size) {
+      status = env->ReopenWritableFile(path, &download->file,
+                                       rocksdb::EnvOptions());
+    } else {
+      size = 0;
+      status = env->NewWritableFile(path, &download->file,
+                                    rocksdb::EnvOptions());
+    }
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to open " << path << ": " << status.ToString();
+      download->file.reset();
+      bootstrapFailed();
+      return;
+    }
+    download->offset = static_cast<int64_t>(size);
+  }
+
+  ReadCheckpointFileRequest req;
+  req.db_name = db_name_;
+  req.checkpoint_id = download->checkpoint_id;
+  req.file_name = download->files[download->file_index].name;
+  req.offset = download->offset;
+  req.max_bytes = FLAGS_replicator_checkpoint_chunk_bytes;
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto options = rpc_options_;
+  upstreamClient()->future_readCheckpointFile(options, req).via(executor_)
+    .then([weak_db = std::move(weak_db), download = std::move(download)]
+          (folly::Try<ReadCheckpointFileResponse>&& t) mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        db->handleReadCheckpointFileResponse(std::move(download),
+                                             std::move(t));
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReadCheckpointFileResponse(
+    std::shared_ptr<CheckpointDownload> download,
+    folly::Try<ReadCheckpointFileResponse>&& t) {
+  const auto& file = download->files[download->file_index];
+  if (t.hasException()) {
+    LOG(ERROR) << "Failed to read checkpoint file " << file.name << " of "
+               << db_name_ << ": " << t.exception().what();
+    bootstrapFailed();
+    return;
+  }
+
+  const auto& data = t.value().data;
+  auto length = data.computeChainDataLength();
+  if (length == 0) {
+    LOG(ERROR) << "Checkpoint file " << file.name << " of " << db_name_
+               << " ends before its size " << file.size;
+    bootstrapFailed();
+    return;
+  }
+
+  for (const auto& range : data) {
+    auto status = download->file->Append(
+      rocksdb::Slice(reinterpret_cast<const char*>(range.data()),
+                     range.size()));
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to write checkpoint file " << file.name << " of "
+                 << db_name_ << ": " << status.ToString();
+      bootstrapFailed();
+      return;
+    }
+  }
+  incCounter(kReplicatorCheckpointInBytes, length, db_name_);
+
+  download->offset += length;
+  if (download->offset >= file.size) {
+    auto status = download->file->Sync();
+    if (status.ok()) {
+      status = download->file->Close();
+    }
+    download->file.reset();
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to sync checkpoint file " << file.name << " of "
+                 << db_name_ << ": " << status.ToString();
+      bootstrapFailed();
+      return;
+    }
+    ++download->file_index;
+  }
+
+  downloadCheckpoint(std::move(download));
+}
+
+void RocksDBReplicator::ReplicatedDB::checkpointDownloaded(
+    std::shared_ptr<CheckpointDownload> download) {
+  db_->GetEnv()->DeleteFile(download->dir + "/" + kCheckpointIdFile);
+  LOG(INFO) << "Downloaded checkpoint " << download->checkpoint_id << " of "
+            << db_name_ << " to " << download->dir;
+
+  // The application may remove the db in the hook, which waits for all
+  // references to the db to go away. So the hook doesn't hold one.
+  // bootstrapping_ stays true until the hook returns, so that we don't pull
+  // from where the checkpoint has left us behind meanwhile. If the db is
+  // still around after that, the application has decided to keep it.
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  executor_->add([hook = options_.on_checkpoint_downloaded,
+                  db_name = db_name_, dir = download->dir,
+                  weak_db = std::move(weak_db)] {
+      hook(db_name, dir);
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        return;
+      }
+
+      db->bootstrapping_.store(false);
+      db->pullFromUpstream();
+    });
+}
+
+}  // namespace replicator
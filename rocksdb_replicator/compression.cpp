@@ -0,0 +1,157 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "rocksdb_replicator/compression.h"
+
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if __GNUC__ >= 8
+#include "folly/compression/Compression.h"
+#else
+#include "folly/io/Compression.h"
+#endif
+#include "folly/io/Cursor.h"
+#include "glog/logging.h"
+
+namespace replicator { namespace detail {
+
+namespace {
+
+// Codecs are not thread safe, and are expensive to create. So we keep one per
+// thread for each type.
+folly::io::Codec* getCodec(CompressionType type) {
+  thread_local std::unique_ptr<folly::io::Codec> lz4;
+  thread_local std::unique_ptr<folly::io::Codec> zstd;
+
+  switch (type) {
+  case CompressionType::LZ4:
+    if (lz4 == nullptr) {
+      lz4 = folly::io::getCodec(folly::io::CodecType::LZ4);
+    }
+    return lz4.get();
+  case CompressionType::ZSTD:
+    if (zstd == nullptr) {
+      zstd = folly::io::getCodec(folly::io::CodecType::ZSTD);
+    }
+    return zstd.get();
+  default:
+    return nullptr;
+  }
+}
+
+}  // namespace
+
+bool parseCompressionType(const std::string& name, CompressionType* type) {
+  if (name == "none") {
+    *type = CompressionType::NONE;
+  } else if (name == "lz4") {
+    *type = CompressionType::LZ4;
+  } else if (name == "zstd") {
+    *type = CompressionType::ZSTD;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool compressUpdates(CompressionType type,
+                     uint64_t min_bytes,
+                     std::vector<Update>* updates,
+                     CompressedUpdates* compressed) {
+  auto codec = getCodec(type);
+  if (codec == nullptr || updates->empty()) {
+    return false;
+  }
+
+  // chain raw_data of all updates together without copying them
+  auto chain = folly::IOBuf::create(0);
+  std::vector<int32_t> sizes;
+  sizes.reserve(updates->size());
+  uint64_t total_bytes = 0;
+  for (const auto& update : *updates) {
+    auto size = update.raw_data.computeChainDataLength();
+    sizes.push_back(static_cast<int32_t>(size));
+    total_bytes += size;
+    chain->prependChain(update.raw_data.clone());
+  }
+
+  if (total_bytes < min_bytes) {
+    return false;
+  }
+
+  std::unique_ptr<folly::IOBuf> data;
+  try {
+    data = codec->compress(chain.get());
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "Failed to compress updates: " << ex.what();
+    return false;
+  }
+
+  if (data->computeChainDataLength() >= total_bytes) {
+    return false;
+  }
+
+  compressed->compression = type;
+  compressed->data = std::move(*data);
+  compressed->raw_data_sizes = std::move(sizes);
+  for (auto& update : *updates) {
+    update.raw_data = folly::IOBuf();
+  }
+
+  return true;
+}
+
+bool decompressUpdates(const CompressedUpdates& compressed,
+                       std::vector<Update>* updates) {
+  auto codec = getCodec(compressed.compression);
+  if (codec == nullptr ||
+      compressed.raw_data_sizes.size() != updates->size()) {
+    return false;
+  }
+
+  uint64_t total_bytes = 0;
+  for (const auto size : compressed.raw_data_sizes) {
+    if (size < 0) {
+      return false;
+    }
+    total_bytes += size;
+  }
+
+  std::unique_ptr<folly::IOBuf> data;
+  try {
+    data = codec->uncompress(&compressed.data, total_bytes);
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "Failed to decompress updates: " << ex.what();
+    return false;
+  }
+
+  if (data->computeChainDataLength() != total_bytes) {
+    return false;
+  }
+
+  // split the decompressed data without copying it
+  folly::io::Cursor cursor(data.get());
+  for (size_t i = 0; i < updates->size(); ++i) {
+    cursor.clone((*updates)[i].raw_data, compressed.raw_data_sizes[i]);
+  }
+
+  return true;
+}
+
+}  // namespace detail
+}  // namespace replicator
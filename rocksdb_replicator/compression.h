@@ -0,0 +1,49 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "rocksdb_replicator/thrift/gen-cpp2/replicator_types.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * Parse the name of a codec, which is one of "none", "lz4" and "zstd".
+ * Return false if name is unknown.
+ */
+bool parseCompressionType(const std::string& name, CompressionType* type);
+
+/*
+ * Concatenate and compress raw_data of updates into compressed with the codec
+ * type, and clear raw_data of updates.
+ * Return false and leave updates untouched if type is NONE, or the total size
+ * of raw_data is smaller than min_bytes, or compression doesn't save anything.
+ */
+bool compressUpdates(CompressionType type,
+                     uint64_t min_bytes,
+                     std::vector<Update>* updates,
+                     CompressedUpdates* compressed);
+
+/*
+ * Restore raw_data of updates from compressed.
+ * Return false if compressed is corrupted or doesn't match updates.
+ */
+bool decompressUpdates(const CompressedUpdates& compressed,
+                       std::vector<Update>* updates);
+
+}  // namespace detail
+}  // namespace replicator
@@ -22,8 +22,14 @@
 #include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
+#if __GNUC__ >= 8
+#include "folly/synchronization/Rcu.h"
+#else
 #include "folly/RWSpinLock.h"
+#endif
 
 namespace replicator { namespace detail {
 
@@ -31,16 +37,30 @@ namespace replicator { namespace detail {
  * A thread safe concurrent map optimized for reads.
  * It is useful for secnarios where modifications are rare, and high read
  * concurrency is required.
+ *
+ * Readers look up an immutable snapshot of the map inside an RCU read side
+ * critical section, which only touches thread local state. Writers build a
+ * new snapshot, publish it and wait for readers of the old one to finish
+ * before destroying it. So values removed from the map are destroyed by the
+ * time remove() returns.
  */
 template <typename K, typename V, typename H = std::hash<K>>
 class FastReadMap {
  public:
+  using Map = std::unordered_map<K, V, H>;
+
   FastReadMap()
-      : map_(std::make_shared<std::unordered_map<K, V>>())
+      : map_(new Map())
+#if __GNUC__ < 8
       , map_rwlock_()
+#endif
       , write_lock_() {
   }
 
+  ~FastReadMap() {
+    delete map_.load();
+  }
+
   // no copy or move
   FastReadMap(const FastReadMap&) = delete;
   FastReadMap& operator=(const FastReadMap&) = delete;
@@ -51,15 +71,10 @@ class FastReadMap {
    * Otherwise, value is untouched, and false is returned.
    */
   bool get(const K& key, V* value) {
-    std::shared_ptr<std::unordered_map<K, V>> local_map;
-
-    {
-      folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
-      local_map = map_;
-    }
-
-    auto itor = local_map->find(key);
-    if (itor == local_map->end()) {
+    ReadGuard g(this);
+    const auto map = map_.load(std::memory_order_acquire);
+    auto itor = map->find(key);
+    if (itor == map->end()) {
       return false;
     }
 
@@ -67,25 +82,44 @@ class FastReadMap {
     return true;
   }
 
+  /*
+   * Get a snapshot of the whole map, which is not affected by later
+   * modifications.
+   */
+  std::shared_ptr<const Map> getAll() {
+    ReadGuard g(this);
+    return std::make_shared<const Map>(*map_.load(std::memory_order_acquire));
+  }
+
   /*
    * Add the (key, value) pair to the map.
    * If key is already in the map, it is a non-op, and false is returned.
    */
   bool add(const K& key, const V& value) {
+    return addAll({std::make_pair(key, value)}) == 1;
+  }
+
+  /*
+   * Add all (key, value) pairs to the map with a single copy of it.
+   * Pairs with keys already in the map are skipped.
+   * Return the number of pairs added.
+   */
+  size_t addAll(const std::vector<std::pair<K, V>>& entries) {
     std::lock_guard<std::mutex> g(write_lock_);
 
-    auto new_map = std::make_shared<std::unordered_map<K, V>>(*map_);
-    if (!(new_map->insert(std::make_pair(key, value)).second)) {
-      // the key is already in the map
-      return false;
+    std::unique_ptr<Map> new_map(new Map(*map_.load()));
+    size_t n_added = 0;
+    for (const auto& entry : entries) {
+      if (new_map->insert(entry).second) {
+        ++n_added;
+      }
     }
 
-    {
-      folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
+    if (n_added > 0) {
+      publish(std::move(new_map));
     }
 
-    return true;
+    return n_added;
   }
 
   /*
@@ -93,27 +127,48 @@ class FastReadMap {
    * Return false if key is not found in the map.
    */
   bool remove(const K& key, V* value = nullptr) {
-    std::lock_guard<std::mutex> g(write_lock_);
-
-    auto new_map = std::make_shared<std::unordered_map<K, V>>(*map_);
-    auto itor = new_map->find(key);
-    if (itor == new_map->end()) {
-      // the key is not in the map
+    std::vector<V> values;
+    if (removeAll({key}, value ? &values : nullptr) == 0) {
       return false;
     }
 
     if (value) {
-      *value = std::move(itor->second);
+      *value = std::move(values.front());
     }
 
-    new_map->erase(itor);
+    return true;
+  }
+
+  /*
+   * Remove all keys from the map with a single copy of it.
+   * Keys not in the map are skipped. If values is not nullptr, values of the
+   * removed keys are appended to it.
+   * Return the number of keys removed.
+   */
+  size_t removeAll(const std::vector<K>& keys, std::vector<V>* values = nullptr) {
+    std::lock_guard<std::mutex> g(write_lock_);
 
-    {
-      folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
+    std::unique_ptr<Map> new_map(new Map(*map_.load()));
+    size_t n_removed = 0;
+    for (const auto& key : keys) {
+      auto itor = new_map->find(key);
+      if (itor == new_map->end()) {
+        // the key is not in the map
+        continue;
+      }
+
+      if (values) {
+        values->push_back(std::move(itor->second));
+      }
+      new_map->erase(itor);
+      ++n_removed;
     }
 
-    return true;
+    if (n_removed > 0) {
+      publish(std::move(new_map));
+    }
+
+    return n_removed;
   }
 
   /*
@@ -121,19 +176,39 @@ class FastReadMap {
    */
   void clear() {
     std::lock_guard<std::mutex> g(write_lock_);
-
-    auto new_map = std::make_shared<std::unordered_map<K, V>>();
-    {
-      folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
-      map_.swap(new_map);
-    }
+    publish(std::unique_ptr<Map>(new Map()));
   }
 
  private:
-  // TODO(bol) use std::atomoc<std::shared_ptr<>> once later version of gcc
-  // supports it
-  std::shared_ptr<std::unordered_map<K, V>> map_;
+#if __GNUC__ >= 8
+  struct ReadGuard {
+    explicit ReadGuard(FastReadMap*) {}
+    folly::rcu_reader reader;
+  };
+#else
+  // older folly doesn't have RCU, fall back to a read write lock
+  struct ReadGuard {
+    explicit ReadGuard(FastReadMap* map) : holder(map->map_rwlock_) {}
+    folly::RWSpinLock::ReadHolder holder;
+  };
+#endif
+
+  // Replace the map with new_map, and destroy the old one once no reader is
+  // using it. The caller needs to hold write_lock_.
+  void publish(std::unique_ptr<Map> new_map) {
+    std::unique_ptr<Map> old_map(
+      map_.exchange(new_map.release(), std::memory_order_acq_rel));
+#if __GNUC__ >= 8
+    folly::synchronize_rcu();
+#else
+    folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
+#endif
+  }
+
+  std::atomic<Map*> map_;
+#if __GNUC__ < 8
   folly::RWSpinLock map_rwlock_;
+#endif
 
   // lock for synchronizing write ops
   std::mutex write_lock_;
@@ -19,14 +19,32 @@
 #include "rocksdb_replicator/max_number_box.h"
 
 #include <algorithm>
+#include <chrono>
+#include <vector>
 
 #include "folly/Likely.h"
+#include "folly/MoveWrapper.h"
+#include "rocksdb_replicator/timer_wheel.h"
 
 namespace replicator { namespace detail {
 
+const size_t MaxNumberBox::kMinAsyncWaitersToPurge;
+
+MaxNumberBox::~MaxNumberBox() {
+  // it's client's responsibility to ensure there is no pending calls when the
+  // destructor is called.
+  CHECK(waiters_.empty());
+
+  for (auto& w : async_waiters_) {
+    if (w.second->should_i_fulfill()) {
+      w.second->promise.setValue(false);
+    }
+  }
+}
+
 void MaxNumberBox::post(const uint64_t num) {
   std::vector<Waiter*> waiters_to_notify;
-  std::vector<Waiter*> waiters_to_wait;
+  std::vector<std::shared_ptr<AsyncWaiter>> async_waiters_to_notify;
 
   {
     std::unique_lock<std::mutex> lk(mtx_);
@@ -36,18 +54,26 @@ void MaxNumberBox::post(const uint64_t num) {
 
     max_number_ = num;
 
-    if (waiters_.empty()) {
-      return;
+    // Only the satisfied prefix of the waiters is visited. Timed out async
+    // waiters in it are dropped as well.
+    auto async_end = async_waiters_.upper_bound(max_number_);
+    for (auto itor = async_waiters_.begin(); itor != async_end; ++itor) {
+      async_waiters_to_notify.push_back(std::move(itor->second));
     }
+    async_waiters_.erase(async_waiters_.begin(), async_end);
 
-    std::partition_copy(waiters_.begin(), waiters_.end(),
-                        std::back_inserter(waiters_to_notify),
-                        std::back_inserter(waiters_to_wait),
-                        [this] (Waiter* w) {
-                          return w->num_to_wait <= this->max_number_;
-                        });
+    auto end = waiters_.upper_bound(max_number_);
+    for (auto itor = waiters_.begin(); itor != end; ++itor) {
+      waiters_to_notify.push_back(itor->second);
+    }
+    waiters_.erase(waiters_.begin(), end);
+  }
 
-    waiters_.swap(waiters_to_wait);
+  // Fulfill promises without holding mtx_, as their callbacks run inline.
+  for (auto& w : async_waiters_to_notify) {
+    if (w->should_i_fulfill()) {
+      w->promise.setValue(true);
+    }
   }
 
   // We don't want to hold mtx_ when calling notify_one(). Because that could
@@ -72,8 +98,7 @@ bool MaxNumberBox::wait(const uint64_t num, const uint64_t timeout_ms) {
     return true;
   }
 
-  me.num_to_wait = num;
-  waiters_.push_back(&me);
+  auto itor = waiters_.emplace(num, &me);
 
   if (timeout_ms == 0) {
     me.cv.wait(lk, [this, num] { return num <= this->max_number_; });
@@ -89,18 +114,60 @@ bool MaxNumberBox::wait(const uint64_t num, const uint64_t timeout_ms) {
 
   // We are timeouted if we are here.
   // If it is timeout. wait_for() will acquire the lock and recheck pred. So
-  // it is safe to assert that we must still be in waiters_, and that
-  // num > max_number_.
-  // waiters_ usually has a few to at most a few hundreds elements. So we use
-  // std::vector instead of list to make code simpler and achieve better cache
-  // locality. Also timeout shouldn't be on the performance critical path.
-  auto new_end = std::remove(waiters_.begin(), waiters_.end(), &me);
+  // it is safe to assert that num > max_number_, in which case post() hasn't
+  // removed us from waiters_, and itor is still valid.
   // TODO (bol) change it to DCHECK/assert() once it's stable.
-  CHECK(num > max_number_ && std::distance(new_end, waiters_.end()) == 1);
-  waiters_.erase(new_end, waiters_.end());
+  CHECK(num > max_number_);
+  waiters_.erase(itor);
   return false;
 }
 
+folly::Future<bool> MaxNumberBox::waitAsync(const uint64_t num,
+                                            const uint64_t timeout_ms,
+                                            folly::Executor* executor) {
+  auto waiter = std::make_shared<AsyncWaiter>();
+  auto future = waiter->promise.getFuture();
+
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    if (UNLIKELY(num <= max_number_)) {
+      return folly::makeFuture(true);
+    }
+
+    if (async_waiters_.size() >= async_waiters_to_purge_) {
+      for (auto itor = async_waiters_.begin(); itor != async_waiters_.end();) {
+        if (itor->second->has_done.load()) {
+          itor = async_waiters_.erase(itor);
+        } else {
+          ++itor;
+        }
+      }
+      async_waiters_to_purge_ = std::max(kMinAsyncWaitersToPurge,
+                                         async_waiters_.size() * 2);
+    }
+
+    async_waiters_.emplace(num, waiter);
+  }
+
+  if (timeout_ms > 0) {
+    CHECK(executor);
+    // The timer doesn't touch *this, so it is fine for it to fire after *this
+    // is destroyed. It is dropped once the waiter is gone.
+    // The promise is fulfilled in executor, as its callbacks run inline and
+    // would otherwise hold up the timer thread shared by the whole process.
+    auto raw_waiter = waiter.get();
+    TimerWheel::get()->schedule(timeout_ms, waiter, [raw_waiter, executor] {
+        if (raw_waiter->should_i_fulfill()) {
+          auto promise = folly::makeMoveWrapper(std::move(raw_waiter->promise));
+          executor->add([promise] () mutable {
+              promise->setValue(false);
+            });
+        }
+      });
+  }
+
+  return future;
+}
+
 }  // namespace detail
 }  // namespace replicator
-
@@ -18,10 +18,14 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <vector>
 
+#include "folly/Executor.h"
+#include "folly/futures/Future.h"
 #include "glog/logging.h"
 
 namespace replicator { namespace detail {
@@ -31,7 +35,8 @@ namespace replicator { namespace detail {
  * through its post() API.
  *
  * It also provides a wait() API, which will block caller until the max number
- * is no less than the number parameter, or timeout_ms has passed.
+ * is no less than the number parameter, or timeout_ms has passed. waitAsync()
+ * does the same without blocking the caller.
  *
  * @note All public interface of MaxNumberBox are thread safe.
  */
@@ -43,13 +48,11 @@ class MaxNumberBox {
   MaxNumberBox(const uint64_t init_num = 0)
     : mtx_()
     , max_number_(init_num)
-    , waiters_() {}
+    , waiters_()
+    , async_waiters_()
+    , async_waiters_to_purge_(kMinAsyncWaitersToPurge) {}
 
-  ~MaxNumberBox() {
-    // it's client's responsibility to ensure there is no pending calls when the
-    // destructor is called.
-    CHECK(waiters_.empty());
-  }
+  ~MaxNumberBox();
 
   // no copy or move
   MaxNumberBox(const MaxNumberBox&) = delete;
@@ -68,18 +71,50 @@ class MaxNumberBox {
    */
   bool wait(const uint64_t num, const uint64_t timeout_ms);
 
+  /*
+   * Same as wait(), but return a future instead of blocking the caller.
+   * The future is fulfilled with true by the thread calling post() with a
+   * number no less than num, or with false in executor after timeout_ms.
+   * executor may be nullptr if timeout_ms is 0, and must outlive the timeout
+   * otherwise.
+   * Pending futures are fulfilled with false when *this is destroyed.
+   */
+  folly::Future<bool> waitAsync(const uint64_t num, const uint64_t timeout_ms,
+                                folly::Executor* executor);
+
  private:
   struct Waiter {
-    uint64_t num_to_wait;
     std::condition_variable cv;
   };
 
-  // mtx_ protects max_number_ and waiters_
+  struct AsyncWaiter {
+    AsyncWaiter()
+      : promise()
+      , has_done(false) {}
+
+    // Return true if the caller should fulfill promise.
+    bool should_i_fulfill() {
+      return !has_done.exchange(true);
+    }
+
+    folly::Promise<bool> promise;
+    std::atomic<bool> has_done;
+  };
+
+  // Timed out async waiters are left in async_waiters_ until a post() passes
+  // their numbers, or until async_waiters_ grows to async_waiters_to_purge_.
+  static const size_t kMinAsyncWaitersToPurge = 64;
+
+  // mtx_ protects max_number_ and waiters
   // We didn't investigate using other mutex types. Our gut feeling is that the
   // mutex type itself won't be the bottleneck.
   std::mutex mtx_;
   uint64_t max_number_;
-  std::vector<Waiter*> waiters_;
+  // Waiters keyed by the numbers they wait for. post() only visits those
+  // satisfied by the new max number, however many are still waiting.
+  std::multimap<uint64_t, Waiter*> waiters_;
+  std::multimap<uint64_t, std::shared_ptr<AsyncWaiter>> async_waiters_;
+  size_t async_waiters_to_purge_;
 };
 
 }  // namespace detail
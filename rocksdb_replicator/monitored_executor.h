@@ -0,0 +1,84 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "folly/Executor.h"
+#include "folly/MoveWrapper.h"
+#include "rocksdb_replicator/replicator_stats.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * MonitoredExecutor forwards tasks to another executor. It logs the number of
+ * tasks queued ahead of each task to queue_depth_metric, and how long the task
+ * has waited before running to queue_ms_metric.
+ * Tasks are forwarded with priority, so that tasks of different classes may
+ * share a thread pool with multiple priorities, each class through its own
+ * MonitoredExecutor.
+ */
+class MonitoredExecutor : public folly::Executor {
+ public:
+  // executor must outlive *this
+  MonitoredExecutor(folly::Executor* executor,
+                    std::string queue_depth_metric,
+                    std::string queue_ms_metric,
+                    int8_t priority = folly::Executor::MID_PRI)
+    : executor_(executor)
+    , queue_depth_metric_(std::move(queue_depth_metric))
+    , queue_ms_metric_(std::move(queue_ms_metric))
+    , priority_(priority)
+    , queue_depth_(0) {}
+
+  // no copy or move
+  MonitoredExecutor(const MonitoredExecutor&) = delete;
+  MonitoredExecutor& operator=(const MonitoredExecutor&) = delete;
+
+  void add(folly::Func func) override {
+    logMetric(queue_depth_metric_, queue_depth_.fetch_add(1));
+    auto enqueued = std::chrono::steady_clock::now();
+    auto task = [this, enqueued,
+                 func = folly::makeMoveWrapper(std::move(func))] () mutable {
+      queue_depth_.fetch_sub(1);
+      auto waited = std::chrono::steady_clock::now() - enqueued;
+      logMetric(queue_ms_metric_,
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                  waited).count());
+      (*func)();
+    };
+
+    // not every executor supports priorities
+    if (priority_ == folly::Executor::MID_PRI) {
+      executor_->add(std::move(task));
+    } else {
+      executor_->addWithPriority(std::move(task), priority_);
+    }
+  }
+
+ private:
+  folly::Executor* const executor_;
+  const std::string queue_depth_metric_;
+  const std::string queue_ms_metric_;
+  const int8_t priority_;
+  std::atomic<int64_t> queue_depth_;
+};
+
+}  // namespace detail
+}  // namespace replicator
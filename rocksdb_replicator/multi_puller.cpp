@@ -0,0 +1,179 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include "folly/MoveWrapper.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+#include "thrift/lib/cpp/TApplicationException.h"
+
+DECLARE_int32(replicator_max_server_wait_time_ms);
+DECLARE_int32(replicator_client_server_timeout_difference_ms);
+
+namespace replicator {
+
+RocksDBReplicator::MultiPuller::MultiPuller(
+    folly::Executor* executor,
+    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool)
+    : executor_(executor)
+    , client_pool_(client_pool)
+    , rpc_options_()
+    , upstreams_mutex_()
+    , upstreams_() {
+  rpc_options_.setTimeout(
+      std::chrono::milliseconds(
+          FLAGS_replicator_max_server_wait_time_ms
+          + FLAGS_replicator_client_server_timeout_difference_ms));
+}
+
+bool RocksDBReplicator::MultiPuller::pull(
+    const folly::SocketAddress& upstream_addr,
+    std::weak_ptr<ReplicatedDB> db,
+    ReplicateRequest request) {
+  {
+    std::lock_guard<std::mutex> g(upstreams_mutex_);
+    auto& upstream = upstreams_[upstream_addr];
+    if (upstream.unsupported) {
+      return false;
+    }
+
+    upstream.pending_requests.push_back(
+      PendingRequest{std::move(db), std::move(request)});
+    if (upstream.flush_scheduled) {
+      return true;
+    }
+    upstream.flush_scheduled = true;
+  }
+
+  // Dbs usually get their responses from the same call, and pull again at
+  // about the same time. Flushing from the executor lets them share a call.
+  executor_->add([this, upstream_addr] { flush(upstream_addr); });
+  return true;
+}
+
+void RocksDBReplicator::MultiPuller::flush(
+    const folly::SocketAddress& upstream_addr) {
+  std::vector<PendingRequest> requests;
+  {
+    std::lock_guard<std::mutex> g(upstreams_mutex_);
+    auto& upstream = upstreams_[upstream_addr];
+    requests.swap(upstream.pending_requests);
+    upstream.flush_scheduled = false;
+  }
+
+  if (requests.empty()) {
+    return;
+  }
+
+  MultiReplicateRequest req;
+  req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
+  req.requests.reserve(requests.size());
+  for (const auto& pending : requests) {
+    req.requests.push_back(pending.request);
+  }
+
+  auto options = rpc_options_;
+  auto client = client_pool_->getClient(upstream_addr);
+  client->future_replicateMulti(options, req).via(executor_)
+    .then([this, upstream_addr, requests = std::move(requests)]
+          (folly::Try<MultiReplicateResponse>&& t) mutable {
+        handleResponse(upstream_addr, std::move(requests), std::move(t));
+      });
+}
+
+void RocksDBReplicator::MultiPuller::handleResponse(
+    const folly::SocketAddress& upstream_addr,
+    std::vector<PendingRequest> requests,
+    folly::Try<MultiReplicateResponse>&& t) {
+  if (t.hasException()) {
+    try {
+#if __GNUC__ >= 8
+      t.exception().throw_exception();
+#else
+      t.exception().throwException();
+#endif
+    } catch (const apache::thrift::TApplicationException& ex) {
+      if (ex.getType() ==
+          apache::thrift::TApplicationException::UNKNOWN_METHOD) {
+        LOG(WARNING) << upstream_addr.describe() << " doesn't support "
+                     << "replicateMulti, fall back to replicate";
+        {
+          std::lock_guard<std::mutex> g(upstreams_mutex_);
+          upstreams_[upstream_addr].unsupported = true;
+        }
+
+        // The requests haven't been served, send them again on their own.
+        // pull() turns them down from now on, so they go through replicate.
+        for (auto& pending : requests) {
+          auto db = pending.db.lock();
+          if (db == nullptr) {
+            continue;
+          }
+
+          auto seq_no =
+            static_cast<rocksdb::SequenceNumber>(pending.request.seq_no);
+          executor_->add([db = std::move(db), seq_no] {
+              db->pullAgain(seq_no);
+            });
+        }
+        return;
+      }
+    } catch (...) {
+    }
+  }
+
+  // Each db handles its result on its own task, so that applying updates of
+  // one db doesn't hold back the others.
+  for (auto& pending : requests) {
+    auto db = pending.db.lock();
+    if (db == nullptr) {
+      continue;
+    }
+
+    const auto& db_name = pending.request.db_name;
+    folly::Try<ReplicateResponse> result;
+    if (t.hasException()) {
+      result = folly::Try<ReplicateResponse>(t.exception());
+    } else {
+      auto& response = t.value();
+      auto itor = response.responses.find(db_name);
+      if (itor != response.responses.end()) {
+        result = folly::Try<ReplicateResponse>(std::move(itor->second));
+      } else {
+        auto error = response.errors.find(db_name);
+        if (error != response.errors.end()) {
+          result = folly::Try<ReplicateResponse>(
+            folly::make_exception_wrapper<ReplicateException>(
+              std::move(error->second)));
+        } else {
+          // no update yet
+          result = folly::Try<ReplicateResponse>(ReplicateResponse());
+        }
+      }
+    }
+
+    auto seq_no = static_cast<rocksdb::SequenceNumber>(pending.request.seq_no);
+    executor_->add([db = std::move(db), seq_no,
+                    result = folly::makeMoveWrapper(std::move(result))]
+                   () mutable {
+        db->handleReplicateResponse(seq_no, std::move(*result));
+      });
+  }
+}
+
+}  // namespace replicator
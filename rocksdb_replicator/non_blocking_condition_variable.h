@@ -21,10 +21,9 @@
 #include <atomic>
 #include <functional>
 #include <memory>
-#include <mutex>
 
 #include "folly/Executor.h"
-#include "folly/futures/Future.h"
+#include "rocksdb_replicator/timer_wheel.h"
 
 namespace replicator { namespace detail {
 
@@ -36,6 +35,10 @@ namespace replicator { namespace detail {
  * many of threads. NonBlockingConditionVariable allows tasks to be run on
  * a executor passing in through its constructor. So the # of threads can be
  * much smaller than the # of tasks.
+ *
+ * Pending tasks are kept in a lock free stack, which notifyAll() takes as a
+ * whole with a single exchange, and doesn't touch at all if it is empty.
+ * Timeouts are handled by the process wide TimerWheel.
  */
 class NonBlockingConditionVariable {
  private:
@@ -43,8 +46,9 @@ class NonBlockingConditionVariable {
     template <typename Func>
     explicit Task(Func&& f)
         : func(std::move(f))
-        , next()
-        , has_done(false) {
+        , has_done(false)
+        , next(nullptr)
+        , self() {
     }
 
     bool should_i_run() {
@@ -52,8 +56,10 @@ class NonBlockingConditionVariable {
     }
 
     std::function<void()> func;
-    std::shared_ptr<Task> next;
     std::atomic<bool> has_done;
+    Task* next;
+    // keeps the task alive while it is in the pending task list
+    std::shared_ptr<Task> self;
   };
 
  public:
@@ -62,8 +68,7 @@ class NonBlockingConditionVariable {
   // This shouldn't be that inconvenient, because we expect executor
   // is long living.
   explicit NonBlockingConditionVariable(folly::Executor* executor)
-      : tasks_()
-      , tasks_mutex_()
+      : tasks_(nullptr)
       , executor_(executor) {
   }
 
@@ -91,34 +96,29 @@ class NonBlockingConditionVariable {
     auto task = std::make_shared<Task>(std::move(f));
 
     // add task to the pending task list
-    {
-      // TODO(bol) use CAS operation of std::atomic<std::shared_ptr<>> when
-      // move to gcc 5.1
-      std::lock_guard<std::mutex> g(tasks_mutex_);
-      task->next = std::move(tasks_);
-      tasks_ = task;
+    task->self = task;
+    task->next = tasks_.load();
+    while (!tasks_.compare_exchange_weak(task->next, task.get())) {
     }
 
-    // we need to recheck the the condition in case missing a notification
+    // we need to recheck the the condition in case missing a notification.
+    // Pairs with the fence in notifyAll(), so that either it sees task in
+    // the list, or we see the condition it notifies about.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
     if (p() && task->should_i_run()) {
       executor_->add(std::move(task->func));
       return;
     }
 
     if (timeout_ms > 0) {
-      // Put a weak_ptr instead of shared_ptr in the timeout lambda. Otherwise,
-      // we may accumulate some unnecessary tasks if they have run before the
-      // timeout.
-      std::weak_ptr<Task> weak_task(task);
-#if __GNUC__ >= 8
-      auto future = folly::futures::sleepUnsafe(std::chrono::milliseconds(timeout_ms));
-#else
-      auto future = folly::futures::sleep(std::chrono::milliseconds(timeout_ms));
-#endif
-      std::move(future).then([weak_task = std::move(weak_task), executor = executor_] (folly::Try<folly::Unit>&& t) {
-          auto task = weak_task.lock();
-          if (task && task->should_i_run()) {
-            executor->add(std::move(task->func));
+      // The timer only holds a weak reference to task. So it is dropped once
+      // task has run and been removed from the pending task list, instead of
+      // keeping task alive until the timeout.
+      auto raw_task = task.get();
+      TimerWheel::get()->schedule(
+        timeout_ms, task, [raw_task, executor = executor_] {
+          if (raw_task->should_i_run()) {
+            executor->add(std::move(raw_task->func));
           }
         });
     }
@@ -127,39 +127,41 @@ class NonBlockingConditionVariable {
   // put all pending tasks to be run in the executor.
   //
   void notifyAll() {
-    std::shared_ptr<Task> local_tasks;
-
-    {
-      // TODO(bol) use atomic_exchange() once we move to gcc 5.1
-      std::lock_guard<std::mutex> g(tasks_mutex_);
-      tasks_.swap(local_tasks);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // Writers call this after every update, most of the time with nobody
+    // waiting. Don't write to the shared list head in that case.
+    if (tasks_.load(std::memory_order_relaxed) == nullptr) {
+      return;
     }
 
-    runATaskList(std::move(local_tasks));
+    runATaskList(tasks_.exchange(nullptr));
   }
 
   ~NonBlockingConditionVariable() {
     // no need to do any synchronizations, because we are in the destructor,
     // and thus no others are working on *this. Otherwise, there is a bug in
     // the client side code.
-    runATaskList(std::move(tasks_));
+    runATaskList(tasks_.exchange(nullptr));
   }
 
  private:
-  void runATaskList(std::shared_ptr<Task> tasks) {
+  void runATaskList(Task* tasks) {
     while (tasks) {
       if (tasks->should_i_run()) {
         executor_->add(std::move(tasks->func));
       }
 
-      tasks = std::move(tasks->next);
+      auto next = tasks->next;
+      // the task is destroyed at the end of this iteration unless it is
+      // referenced elsewhere
+      auto self = std::move(tasks->self);
+      tasks = next;
     }
   }
 
-  // TODO(bol) replacing them with std::atomic<std::shared_ptr<>> once we
-  // upgrade to gcc 5.1
-  std::shared_ptr<Task> tasks_;
-  std::mutex tasks_mutex_;
+  // The pending task list, linked by Task::next. Tasks are only ever pushed
+  // individually and popped all together, so there is no ABA problem.
+  std::atomic<Task*> tasks_;
 
   folly::Executor* const executor_;
 };
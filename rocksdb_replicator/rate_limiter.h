@@ -0,0 +1,66 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace replicator { namespace detail {
+
+/*
+ * A leaky bucket limiting the rate bytes are sent at. Senders reserve their
+ * bytes before sending them, and are told how long to wait so that all bytes
+ * reserved so far are sent no faster than the rate.
+ * The rate is given on every call, so that it may be changed at runtime,
+ * e.g. by a flag.
+ */
+class RateLimiter {
+ public:
+  RateLimiter()
+    : mtx_()
+    , next_send_us_(0) {}
+
+  // no copy or move
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  /*
+   * Reserve bandwidth for sending bytes at rate_bytes_per_sec, 0 means no
+   * limit. Return how long to wait before sending them in ms.
+   */
+  uint64_t reserveMs(uint64_t bytes, uint64_t rate_bytes_per_sec) {
+    if (rate_bytes_per_sec == 0) {
+      return 0;
+    }
+
+    const uint64_t now_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> g(mtx_);
+    const auto start_us = std::max(now_us, next_send_us_);
+    next_send_us_ = start_us + bytes * 1000 * 1000 / rate_bytes_per_sec;
+    return (start_us - now_us) / 1000;
+  }
+
+ private:
+  std::mutex mtx_;
+  // when the bytes reserved so far will have been sent
+  uint64_t next_send_us_;
+};
+
+}  // namespace detail
+}  // namespace replicator
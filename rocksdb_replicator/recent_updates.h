@@ -0,0 +1,140 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "folly/io/IOBuf.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * RecentUpdates keeps the most recent updates read from the WAL of a db in
+ * memory, so that they are decoded once no matter how many Slaves read them.
+ *
+ * Updates are appended in the order of their sequence numbers. The oldest
+ * ones are dropped once the total size exceeds max_bytes. Raw data is shared
+ * with readers through IOBuf clones instead of being copied.
+ *
+ * @note All public interface of RecentUpdates are thread safe.
+ */
+class RecentUpdates {
+ public:
+  struct Entry {
+    // the sequence number of the first record in raw_data
+    uint64_t seq_no;
+    // the number of sequence numbers raw_data covers
+    uint32_t count;
+    int64_t timestamp;
+    folly::IOBuf raw_data;
+  };
+
+  /*
+   * max_bytes is the max total size of raw_data kept. 0 disables *this.
+   */
+  explicit RecentUpdates(const uint64_t max_bytes)
+    : mtx_()
+    , entries_()
+    , bytes_(0)
+    , max_bytes_(max_bytes) {}
+
+  // no copy or move
+  RecentUpdates(const RecentUpdates&) = delete;
+  RecentUpdates& operator=(const RecentUpdates&) = delete;
+
+  /*
+   * Append an update starting from seq_no. It is ignored unless it directly
+   * follows the last update appended, or is newer than all of them, in which
+   * case older updates are dropped.
+   */
+  void append(const uint64_t seq_no, const uint32_t count,
+              const int64_t timestamp, const folly::IOBuf& raw_data) {
+    // an update without any record doesn't take a sequence number
+    if (max_bytes_ == 0 || count == 0) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> g(mtx_);
+    if (!entries_.empty()) {
+      const auto& last = entries_.back();
+      const auto next_seq_no = last.seq_no + last.count;
+      if (seq_no < next_seq_no) {
+        return;
+      }
+
+      if (seq_no > next_seq_no) {
+        entries_.clear();
+        bytes_ = 0;
+      }
+    }
+
+    entries_.push_back(Entry{seq_no, count, timestamp,
+                             raw_data.cloneAsValue()});
+    bytes_ += raw_data.computeChainDataLength();
+    while (bytes_ > max_bytes_ && entries_.size() > 1) {
+      bytes_ -= entries_.front().raw_data.computeChainDataLength();
+      entries_.pop_front();
+    }
+  }
+
+  /*
+   * Read updates starting from seq_no, with the same limits as
+   * ReplicateRequest. next_seq_no is set to the sequence number following the
+   * last update read.
+   *
+   * @return false if no update starts from seq_no.
+   */
+  bool read(const uint64_t seq_no, const int32_t max_updates,
+            const int64_t max_bytes, std::vector<Entry>* entries,
+            uint64_t* next_seq_no) const {
+    std::lock_guard<std::mutex> g(mtx_);
+    auto itor = std::lower_bound(entries_.begin(), entries_.end(), seq_no,
+                                 [] (const Entry& e, const uint64_t n) {
+                                   return e.seq_no < n;
+                                 });
+    if (itor == entries_.end() || itor->seq_no != seq_no) {
+      return false;
+    }
+
+    *next_seq_no = seq_no;
+    uint64_t read_bytes = 0;
+    for (int32_t i = 0;
+         (max_updates <= 0 || i < max_updates) &&
+         (max_bytes <= 0 || read_bytes < static_cast<uint64_t>(max_bytes)) &&
+         itor != entries_.end();
+         ++i, ++itor) {
+      entries->push_back(Entry{itor->seq_no, itor->count, itor->timestamp,
+                               itor->raw_data.cloneAsValue()});
+      read_bytes += itor->raw_data.computeChainDataLength();
+      *next_seq_no += itor->count;
+    }
+
+    return true;
+  }
+
+ private:
+  // mtx_ protects entries_ and bytes_
+  mutable std::mutex mtx_;
+  std::deque<Entry> entries_;
+  uint64_t bytes_;
+  const uint64_t max_bytes_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -18,11 +18,19 @@
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <functional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "folly/MoveWrapper.h"
+#include "rocksdb_replicator/compression.h"
+#include "folly/io/Cursor.h"
+#include "thrift/lib/cpp/TApplicationException.h"
+#include "thrift/lib/cpp/transport/TTransportException.h"
 #include "rocksdb_replicator/replicator_stats.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
 
@@ -35,9 +43,38 @@ DEFINE_int32(replicator_client_server_timeout_difference_ms, 10 * 1000,
 DEFINE_int32(replicator_max_updates_per_response, 50,
              "Max number of RocksDB updates a response can contain");
 
+DEFINE_int64(replicator_max_bytes_per_response, 4 * 1024 * 1024,
+             "Max total size of RocksDB updates a response can contain, 0 "
+             "means no limit");
+
+DEFINE_uint64(replicator_catch_up_lag_ms, 5 * 1000,
+              "A Slave is considered lagging if the last update it received "
+              "was written to the Master more than this amount of time ago");
+
+DEFINE_int32(replicator_catch_up_max_scale, 8,
+             "A lagging Slave keeps doubling the number of updates and bytes "
+             "it asks for in a pull request, up to this many times of "
+             "replicator_max_updates_per_response and "
+             "replicator_max_bytes_per_response. It halves them once caught "
+             "up. 1 disables this.");
+
+DEFINE_uint64(replicator_recent_updates_max_bytes, 1024 * 1024,
+              "Max total size of the most recent updates each db keeps in "
+              "memory after reading them from its WAL. Slaves reading them "
+              "are served from memory instead of reading the WAL again. 0 "
+              "disables it");
+
 DEFINE_int32(replicator_pull_delay_on_error_ms, 5 * 1000,
              "How long to wait before sending the next pull request on error");
 
+DEFINE_int32(replicator_upstream_probe_timeout_ms, 500,
+             "How long to wait for peers to tell how far they are when "
+             "failing over from an unreachable upstream");
+
+DEFINE_int32(replicator_upstream_retry_master_ms, 10 * 1000,
+             "How long after failing over to a peer to try going back to the "
+             "Master");
+
 DEFINE_int32(replicator_replication_mode, 0,
              "Replication mode. "
              "0: ack client once committed to Master; "
@@ -49,6 +86,53 @@ DEFINE_uint64(replicator_timeout_ms, 5 * 1000,
               "How long to wait for Slave before timeout a client write, 0 means"
               " waiting forever");
 
+DEFINE_int32(replicator_pull_window_size, 1,
+             "Max number of pull requests a Slave keeps outstanding, counting "
+             "responses received but not yet applied. With a value larger "
+             "than 1, a Slave behind upstream asks for the next ranges of "
+             "updates before the earlier ones arrive, and applies them in "
+             "order. Each range is expected to be as large as the last "
+             "response.");
+
+DEFINE_bool(replicator_push_mode, false,
+            "If true, Slaves subscribe to upstream and have updates pushed to "
+            "them as soon as they are committed, instead of polling upstream. "
+            "replicator_pull_window_size is used as the number of push calls "
+            "upstream may have outstanding. Slaves fall back to polling if "
+            "upstream doesn't support it.");
+
+DEFINE_string(replicator_compression, "none",
+              "The codec Slaves ask upstream to compress updates with, one of "
+              "none, lz4 and zstd.");
+
+DEFINE_int32(replicator_compression_min_bytes, 1024,
+             "Updates in a response are only compressed if their total size "
+             "is no less than this.");
+
+DEFINE_uint64(replicator_catch_up_min_lag_seq_no, 100000,
+              "Replicate requests for updates this far behind the latest "
+              "sequence number of the db are served as catch-up requests, at "
+              "a lower priority than the others and within the catch-up rate "
+              "limits. 0 disables it.");
+
+DEFINE_uint64(replicator_catch_up_db_rate_bytes_per_sec, 32 * 1024 * 1024,
+              "Max rate of updates sent to catch-up requests of each db, 0 "
+              "means no limit");
+
+DEFINE_uint64(replicator_catch_up_rate_bytes_per_sec, 128 * 1024 * 1024,
+              "Max rate of updates sent to catch-up requests of all dbs, 0 "
+              "means no limit");
+
+DEFINE_uint64(replicator_slave_expire_ms, 60 * 1000,
+              "Slaves not heard from for this long are no longer considered "
+              "when throttling writes or counting acks toward "
+              "ack_quorum. It needs to be longer than "
+              "replicator_max_server_wait_time_ms.");
+
+DEFINE_int32(replicator_throttle_max_delay_ms, 100,
+             "Max delay of a write when Slaves lag behind beyond the budget "
+             "set in ReplicatedDBOptions");
+
 DECLARE_int32(replicator_idle_iter_timeout_ms);
 
 
@@ -59,6 +143,331 @@ uint64_t GetCurrentTimeMs() {
     std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+// Write times are sampled at most once per this interval
+const uint64_t kWriteTimeSampleIntervalMs = 10;
+
+size_t pullWindowSize() {
+  return static_cast<size_t>(std::max(FLAGS_replicator_pull_window_size, 1));
+}
+
+// A serialized WriteBatch starts with an 8-byte sequence number followed by a
+// 4-byte count, both in little endian.
+uint32_t getWriteBatchCount(const folly::IOBuf& raw_data) {
+  folly::io::Cursor cursor(&raw_data);
+  cursor.skip(sizeof(uint64_t));
+  return cursor.readLE<uint32_t>();
+}
+
+// Wrap the data of a WriteBatch in an IOBuf, which takes the ownership of the
+// WriteBatch and frees it when the IOBuf is destroyed. This saves copying the
+// batch when serving it.
+folly::IOBuf wrapWriteBatch(std::unique_ptr<rocksdb::WriteBatch> batch) {
+  const auto& rep = batch->Data();
+  auto data = const_cast<char*>(rep.data());
+  auto size = rep.size();
+  return folly::IOBuf(folly::IOBuf::TAKE_OWNERSHIP, data, size,
+                      [] (void* /* buf */, void* user_data) {
+                        delete static_cast<rocksdb::WriteBatch*>(user_data);
+                      },
+                      batch.release());
+}
+
+const size_t kWriteBatchHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+
+// The sequence number RocksDB stamps a WriteBatch with, which is the one of
+// its first record, 0 if it hasn't been written.
+rocksdb::SequenceNumber getWriteBatchSeqNo(const rocksdb::WriteBatch& batch) {
+  const auto& rep = batch.Data();
+  if (rep.size() < kWriteBatchHeaderSize) {
+    return 0;
+  }
+
+  auto buf = folly::IOBuf::wrapBufferAsValue(rep.data(), rep.size());
+  folly::io::Cursor cursor(&buf);
+  return cursor.readLE<uint64_t>();
+}
+
+// The sequence number of the first record of a serialized WriteBatch
+uint64_t getWriteBatchSeqNo(const folly::IOBuf& raw_data) {
+  folly::io::Cursor cursor(&raw_data);
+  return cursor.readLE<uint64_t>();
+}
+
+// Tags of WriteBatch records, see db/dbformat.h of RocksDB
+enum WriteBatchTag : uint8_t {
+  kTagDeletion = 0x0,
+  kTagValue = 0x1,
+  kTagMerge = 0x2,
+  kTagLogData = 0x3,
+  kTagColumnFamilyDeletion = 0x4,
+  kTagColumnFamilyValue = 0x5,
+  kTagColumnFamilyMerge = 0x6,
+  kTagSingleDeletion = 0x7,
+  kTagColumnFamilySingleDeletion = 0x8,
+  kTagColumnFamilyRangeDeletion = 0xE,
+  kTagRangeDeletion = 0xF,
+  kTagColumnFamilyBlobIndex = 0x10,
+  kTagBlobIndex = 0x11,
+};
+
+bool readVarint32(const std::string& rep, size_t* pos, uint32_t* value) {
+  *value = 0;
+  for (uint32_t shift = 0; shift <= 28 && *pos < rep.size(); shift += 7) {
+    const auto byte = static_cast<uint8_t>(rep[(*pos)++]);
+    *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool skipLengthPrefixed(const std::string& rep, size_t* pos) {
+  uint32_t length;
+  if (!readVarint32(rep, pos, &length) || rep.size() - *pos < length) {
+    return false;
+  }
+
+  *pos += length;
+  return true;
+}
+
+// Skip the record of rep at *pos. has_seq_no is set if the record takes a
+// sequence number. Return false if the record is malformed, or of a type
+// which is not expected in a replicated WAL, e.g. those of transactions.
+bool skipWriteBatchRecord(const std::string& rep, size_t* pos,
+                          bool* has_seq_no) {
+  if (*pos >= rep.size()) {
+    return false;
+  }
+
+  const auto tag = static_cast<uint8_t>(rep[(*pos)++]);
+  uint32_t column_family;
+  switch (tag) {
+    case kTagColumnFamilyDeletion:
+    case kTagColumnFamilySingleDeletion:
+      if (!readVarint32(rep, pos, &column_family)) {
+        return false;
+      }
+      // fall through
+    case kTagDeletion:
+    case kTagSingleDeletion:
+      *has_seq_no = true;
+      return skipLengthPrefixed(rep, pos);
+    case kTagColumnFamilyValue:
+    case kTagColumnFamilyMerge:
+    case kTagColumnFamilyRangeDeletion:
+    case kTagColumnFamilyBlobIndex:
+      if (!readVarint32(rep, pos, &column_family)) {
+        return false;
+      }
+      // fall through
+    case kTagValue:
+    case kTagMerge:
+    case kTagRangeDeletion:
+    case kTagBlobIndex:
+      *has_seq_no = true;
+      return skipLengthPrefixed(rep, pos) && skipLengthPrefixed(rep, pos);
+    case kTagLogData:
+      *has_seq_no = false;
+      return skipLengthPrefixed(rep, pos);
+    default:
+      return false;
+  }
+}
+
+// Drop the records of batch before seq_no, where batch starts from
+// batch_seq_no, e.g. when a downstream asks for updates from the middle of a
+// batch a Slave has merged from several upstream batches.
+// Return nullptr if batch can't be parsed.
+std::unique_ptr<rocksdb::WriteBatch> trimWriteBatch(
+    const rocksdb::WriteBatch& batch,
+    rocksdb::SequenceNumber batch_seq_no,
+    rocksdb::SequenceNumber seq_no) {
+  const auto& rep = batch.Data();
+  const uint32_t count = batch.Count();
+  if (seq_no < batch_seq_no || seq_no - batch_seq_no > count) {
+    return nullptr;
+  }
+
+  size_t pos = kWriteBatchHeaderSize;
+  uint32_t skipped = 0;
+  while (batch_seq_no + skipped < seq_no) {
+    bool has_seq_no = false;
+    if (!skipWriteBatchRecord(rep, &pos, &has_seq_no)) {
+      return nullptr;
+    }
+
+    skipped += has_seq_no ? 1 : 0;
+  }
+
+  // the header holds the sequence number and the count in little endian
+  std::string trimmed(kWriteBatchHeaderSize, '\0');
+  const uint32_t new_count = count - skipped;
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    trimmed[i] = static_cast<char>((seq_no >> (8 * i)) & 0xff);
+  }
+  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+    trimmed[sizeof(uint64_t) + i] =
+      static_cast<char>((new_count >> (8 * i)) & 0xff);
+  }
+  trimmed.append(rep, pos, std::string::npos);
+  return std::unique_ptr<rocksdb::WriteBatch>(
+    new rocksdb::WriteBatch(std::move(trimmed)));
+}
+
+// Append raw_data except its first skip bytes to rep.
+void appendIOBuf(const folly::IOBuf& raw_data, size_t skip, std::string* rep) {
+  for (const auto& range : raw_data) {
+    if (skip >= range.size()) {
+      skip -= range.size();
+      continue;
+    }
+
+    rep->append(reinterpret_cast<const char*>(range.data()) + skip,
+                range.size() - skip);
+    skip = 0;
+  }
+}
+
+// ReplicatedDB::Write() appends the timestamp of a batch as its last record,
+// a LogData record of 8 bytes, which is what LogExtractor of older
+// Replicators looks for as well. The record always takes the last 10 bytes
+// of the batch, but a user record may end with the same bytes, so they are
+// only trusted if a record starts there. Finding that out only takes
+// skipping from one record to the next, which is much cheaper than decoding
+// the batch with LogExtractor.
+const size_t kTimestampRecordSize = 2 + sizeof(uint64_t);
+
+void appendTimestamp(uint64_t ms, rocksdb::WriteBatch* batch) {
+  batch->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
+                                   sizeof(ms)));
+}
+
+// Read the timestamp from the last record of rep, whose first record starts
+// at begin. Return false if the last record is not a timestamp.
+bool readTrailingTimestamp(const std::string& rep, size_t begin,
+                           uint64_t* ms) {
+  if (rep.size() < begin + kTimestampRecordSize) {
+    return false;
+  }
+
+  const size_t last = rep.size() - kTimestampRecordSize;
+  if (static_cast<uint8_t>(rep[last]) != kTagLogData ||
+      static_cast<uint8_t>(rep[last + 1]) != sizeof(uint64_t)) {
+    return false;
+  }
+
+  size_t pos = begin;
+  while (pos < last) {
+    bool has_seq_no;
+    if (!skipWriteBatchRecord(rep, &pos, &has_seq_no)) {
+      return false;
+    }
+  }
+
+  if (pos != last) {
+    // the bytes belong to a user record
+    return false;
+  }
+
+  memcpy(ms, rep.data() + last + 2, sizeof(*ms));
+  return true;
+}
+
+// Get the timestamp of a batch read from the WAL. It is normally the last
+// record of the batch. Only batches not written by ReplicatedDB::Write(),
+// e.g. those written to the db before it was added to the Replicator, are
+// decoded in full to look for it.
+bool getWriteBatchTimestamp(const rocksdb::WriteBatch& batch, uint64_t* ms) {
+  if (readTrailingTimestamp(batch.Data(), kWriteBatchHeaderSize, ms)) {
+    return true;
+  }
+
+  incCounter(kReplicatorTimestampScans, 1);
+  LogExtractor extractor;
+  if (!batch.Iterate(&extractor).ok()) {
+    return false;
+  }
+
+  *ms = extractor.ms;
+  return true;
+}
+
+// Build the rep of a single WriteBatch holding all updates received from
+// upstream, with a single copy of their raw data. Records of each update are
+// appended in order, so the merged batch covers the same continuous range of
+// sequence numbers as the updates do.
+// The timestamp of an update normally is its last record already, which
+// downstream Slaves read it from. It is only appended if it is missing, so a
+// chain of Slaves doesn't add one more record per update on every hop.
+std::string buildWriteBatchRep(const std::vector<replicator::Update>& updates) {
+  size_t total_bytes = 0;
+  for (const auto& update : updates) {
+    total_bytes += update.raw_data.computeChainDataLength() +
+      kTimestampRecordSize;
+  }
+
+  std::string rep;
+  rep.reserve(total_bytes);
+  uint32_t count = 0;
+  for (size_t i = 0; i < updates.size(); ++i) {
+    const auto& update = updates[i];
+    // where the records of the update start in rep
+    const size_t begin = i == 0 ? kWriteBatchHeaderSize : rep.size();
+    appendIOBuf(update.raw_data, i == 0 ? 0 : kWriteBatchHeaderSize, &rep);
+    count += getWriteBatchCount(update.raw_data);
+
+    uint64_t ms;
+    if (update.timestamp != 0 &&
+        (!readTrailingTimestamp(rep, begin, &ms) ||
+         ms != static_cast<uint64_t>(update.timestamp))) {
+      // Let RocksDB encode the LogData record for us
+      rocksdb::WriteBatch log_data;
+      appendTimestamp(update.timestamp, &log_data);
+      rep.append(log_data.Data(), kWriteBatchHeaderSize, std::string::npos);
+    }
+  }
+
+  // update the count in the header, which is in little endian
+  for (size_t i = 0; i < sizeof(count); ++i) {
+    rep[sizeof(uint64_t) + i] = static_cast<char>((count >> (8 * i)) & 0xff);
+  }
+
+  return rep;
+}
+
+// The size of updates in response as sent over the wire.
+uint64_t getResponseBytes(const replicator::ReplicateResponse& response) {
+  if (response.__isset.compressed_updates) {
+    return response.compressed_updates.data.computeChainDataLength();
+  }
+
+  uint64_t bytes = 0;
+  for (const auto& update : response.updates) {
+    bytes += update.raw_data.computeChainDataLength();
+  }
+  return bytes;
+}
+
+// Shared by catch-up requests of all dbs in the process
+replicator::detail::RateLimiter* globalCatchUpRateLimiter() {
+  static replicator::detail::RateLimiter limiter;
+  return &limiter;
+}
+
+// The message of the status readUpdates() returns if the WAL has been purged
+const char kWALPurged[] = "WAL purged";
+
+replicator::ReplicateException makeReplicateException(
+    replicator::ErrorCode code, std::string msg) {
+  replicator::ReplicateException e;
+  e.msg = std::move(msg);
+  e.code = code;
+  return e;
+}
+
 }  // namespace
 
 namespace replicator {
@@ -66,271 +475,1892 @@ rocksdb::Status RocksDBReplicator::ReplicatedDB::Write(
     const rocksdb::WriteOptions& options,
     rocksdb::WriteBatch* updates,
     rocksdb::SequenceNumber* seq_no) {
+  // Slaves can't be written to, no matter how far behind their own Slaves
+  // are
   if (role_ == DBRole::SLAVE) {
     throw ReturnCode::WRITE_TO_SLAVE;
   }
 
-  incCounter(kReplicatorWriteBytes, updates->GetDataSize(), db_name_);
-
-  auto ms = GetCurrentTimeMs();
-  updates->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
-                                     sizeof(ms)));
-  auto start = GetCurrentTimeMs();
-  auto status = db_->Write(options, updates);
-  auto end = GetCurrentTimeMs();
-  logMetric(kReplicatorWriteMs, start < end ? end - start : 0, db_name_);
+  throttleWrite(true /* can_delay */);
+  rocksdb::SequenceNumber cur_seq_no;
+  auto status = writeToDB(options, updates, &cur_seq_no);
   if (status.ok()) {
-    cond_var_.notifyAll();
-
-    // TODO(bol): change it once RocksDB guarantees the sequence number is in
-    // the write batch.
-    auto cur_seq_no = db_->GetLatestSequenceNumber();
     if (seq_no) {
       *seq_no = cur_seq_no;
     }
 
-    switch (FLAGS_replicator_replication_mode) {
-    case 1:
-    case 2:
+    if (waitForSlaves()) {
       // TODO(bol): This potentially could block all worker threads. We may
-      // consider having a dedicated set of worker threads for admin requests,
-      // and/or provide async write API when this turns out to be a problem.
+      // consider having a dedicated set of worker threads for admin requests.
+      // Use WriteAsync() if this turns out to be a problem.
       if (!max_seq_no_acked_.wait(cur_seq_no, FLAGS_replicator_timeout_ms)) {
         throw ReturnCode::WAIT_SLAVE_TIMEOUT;
       }
-      break;
-    default:
-      CHECK(FLAGS_replicator_replication_mode == 0)
-        << "Invalid replicaton mode " << FLAGS_replicator_replication_mode;
     }
   }
 
   return status;
 }
 
+folly::Future<ReturnCode> RocksDBReplicator::ReplicatedDB::WriteAsync(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  // Slaves can't be written to, no matter how far behind their own Slaves
+  // are
+  if (role_ == DBRole::SLAVE) {
+    throw ReturnCode::WRITE_TO_SLAVE;
+  }
 
-RocksDBReplicator::ReplicatedDB::ReplicatedDB(
-    const std::string& db_name,
-    std::shared_ptr<rocksdb::DB> db,
-    folly::Executor* executor,
-    const DBRole role,
-    const folly::SocketAddress& upstream_addr,
-    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool)
-    : db_name_(db_name)
-    , db_(std::move(db))
-    , executor_(executor)
-    , role_(role)
-    , upstream_addr_(upstream_addr)
-    , client_pool_(client_pool)
-    , client_()
-    , cond_var_(executor)
-    , rpc_options_()
-    , write_options_()
-    , cached_iters_()
-    , cached_iters_mutex_() {
-  if (role == DBRole::SLAVE) {
-    client_ = client_pool_->getClient(upstream_addr);
+  throttleWrite(false /* can_delay */);
+  rocksdb::SequenceNumber cur_seq_no;
+  auto status = writeToDB(options, updates, &cur_seq_no);
+  if (!status.ok()) {
+    return folly::makeFuture(ReturnCode::WRITE_ERROR);
   }
 
-  rpc_options_.setTimeout(
-      std::chrono::milliseconds(
-          FLAGS_replicator_max_server_wait_time_ms
-          + FLAGS_replicator_client_server_timeout_difference_ms));
-}
+  if (seq_no) {
+    *seq_no = cur_seq_no;
+  }
 
-void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
-  CHECK(role_ == DBRole::SLAVE);
-  ReplicateRequest req;
-  req.seq_no = db_->GetLatestSequenceNumber();
-  req.db_name = db_name_;
-  req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
-  req.max_updates = FLAGS_replicator_max_updates_per_response;
+  if (!waitForSlaves()) {
+    return folly::makeFuture(ReturnCode::OK);
+  }
 
-  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
-  auto options = rpc_options_;
-  client_->future_replicate(options, req).via(executor_)
-    .then([weak_db = std::move(weak_db)] (folly::Try<ReplicateResponse>&& t) {
-        auto db = weak_db.lock();
-        if (db == nullptr) {
-          return;
-        }
+  return max_seq_no_acked_.waitAsync(cur_seq_no, FLAGS_replicator_timeout_ms,
+                                     executor_)
+    .then([] (bool acked) {
+        return acked ? ReturnCode::OK : ReturnCode::WAIT_SLAVE_TIMEOUT;
+      });
+}
 
-        bool delay_next_pull = false;
-        if (t.hasException()) {
-          delay_next_pull = true;
-          try {
-#if __GNUC__ >= 8
-            t.exception().throw_exception();
-#else
-            t.exception().throwException();
-#endif
-          } catch (const ReplicateException& ex) {
-            LOG(ERROR) << "ReplicateException: " << static_cast<int>(ex.code)
-                       << " " << ex.msg;
-            incCounter(kReplicatorRemoteApplicationExceptions, 1, db->db_name_);
-          } catch (const std::exception& ex) {
-            LOG(ERROR) << "std::exception: " << ex.what();
-            incCounter(kReplicatorConnectionErrors, 1, db->db_name_);
-            db->client_ = db->client_pool_->getClient(db->upstream_addr_);
-          }
-        } else {
-          auto& response = t.value();
-          uint64_t write_bytes = 0;
-          const auto now = GetCurrentTimeMs();
-          for (auto& update : response.updates) {
-            if (update.timestamp != 0) {
-              uint64_t then = update.timestamp;
-              logMetric(kReplicatorLatency, then < now ? now - then : 0,
-                        db->db_name_);
-            }
+folly::Future<ReturnCode> RocksDBReplicator::ReplicatedDB::GetAsync(
+    const rocksdb::ReadOptions& options,
+    const rocksdb::Slice& key,
+    std::string* value,
+    rocksdb::Status* status,
+    rocksdb::SequenceNumber min_seq_no,
+    uint64_t timeout_ms) {
+  return WaitForSeqNo(min_seq_no, timeout_ms)
+    .then([db = db_, options, key, value, status] (bool caught_up) {
+        if (!caught_up) {
+          return ReturnCode::READ_TIMEOUT;
+        }
 
-            auto byteRange = update.raw_data.coalesce();
-            write_bytes += byteRange.size();
-            rocksdb::WriteBatch write_batch(
-                std::string(reinterpret_cast<const char*>(byteRange.data()),
-                            byteRange.size()));
-            write_batch.PutLogData(
-              rocksdb::Slice(reinterpret_cast<const char*>(&update.timestamp),
-                             sizeof(update.timestamp)));
-
-            auto status = db->db_->Write(db->write_options_, &write_batch);
-            if (!status.ok()) {
-              LOG(ERROR) << "Failed to apply updates to SLAVE " << db->db_name_
-                         << " " << status.ToString();
-              delay_next_pull = true;
-              break;
-            }
-          }
+        *status = db->Get(options, key, value);
+        return ReturnCode::OK;
+      });
+}
 
-          if (!response.updates.empty()) {
-            db->cond_var_.notifyAll();
-          }
-          incCounter(kReplicatorInBytes, write_bytes, db->db_name_);
+folly::Future<ReturnCode> RocksDBReplicator::ReplicatedDB::MultiGetAsync(
+    const rocksdb::ReadOptions& options,
+    const std::vector<rocksdb::Slice>& keys,
+    std::vector<std::string>* values,
+    std::vector<rocksdb::Status>* statuses,
+    rocksdb::SequenceNumber min_seq_no,
+    uint64_t timeout_ms) {
+  return WaitForSeqNo(min_seq_no, timeout_ms)
+    .then([db = db_, options, keys = &keys, values, statuses]
+          (bool caught_up) {
+        if (!caught_up) {
+          return ReturnCode::READ_TIMEOUT;
         }
 
-        if (delay_next_pull) {
-          auto eb = db->client_->getChannel()->getEventBase();
-          // It is very bad if we fail to rescheudle a pull request, we'd prefer
-          // crashing.
-          eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
-              eb->runAfterDelay([weak_db = std::move(weak_db)] {
-                  auto db = weak_db.lock();
-                  if (db == nullptr) {
-                    return;
-                  }
-                  db->pullFromUpstream();
-                },
-                FLAGS_replicator_pull_delay_on_error_ms);
-            });
-        } else {
-          db->pullFromUpstream();
+        *statuses = db->MultiGet(options, *keys, values);
+        return ReturnCode::OK;
+      });
+}
+
+folly::Future<ReturnCode> RocksDBReplicator::ReplicatedDB::NewIteratorAsync(
+    const rocksdb::ReadOptions& options,
+    std::unique_ptr<rocksdb::Iterator>* iter,
+    rocksdb::SequenceNumber min_seq_no,
+    uint64_t timeout_ms) {
+  return WaitForSeqNo(min_seq_no, timeout_ms)
+    .then([db = db_, options, iter] (bool caught_up) {
+        if (!caught_up) {
+          return ReturnCode::READ_TIMEOUT;
         }
+
+        iter->reset(db->NewIterator(options));
+        return ReturnCode::OK;
       });
 }
 
-void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
-    std::unique_ptr<CallbackType> callback,
-    std::unique_ptr<ReplicateRequest> request) {
-  CHECK(request->db_name == db_name_);
+folly::Future<bool> RocksDBReplicator::ReplicatedDB::WaitForSeqNo(
+    rocksdb::SequenceNumber seq_no,
+    uint64_t timeout_ms) {
+  if (db_->GetLatestSequenceNumber() >= seq_no) {
+    return folly::makeFuture(true);
+  }
 
-  auto db = shared_from_this();
-  std::weak_ptr<ReplicatedDB> weak_db = db;
-  auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
-  if (FLAGS_replicator_replication_mode == 1 ||
-      FLAGS_replicator_replication_mode == 2) {
-    // post the largest sequence number the Slave has committed
-    max_seq_no_acked_.post(seq_no);
+  if (timeout_ms == 0) {
+    incCounter(kReplicatorReadFenceTimeouts, 1, db_name_);
+    return folly::makeFuture(false);
   }
-  auto timeout = request->max_wait_ms;
+
+  auto promise = std::make_shared<folly::Promise<bool>>();
+  auto future = promise->getFuture();
+  waitForSeqNoUntil(seq_no, GetCurrentTimeMs() + timeout_ms,
+                    std::move(promise));
+  return future;
+}
+
+void RocksDBReplicator::ReplicatedDB::waitForSeqNoUntil(
+    rocksdb::SequenceNumber seq_no,
+    uint64_t deadline_ms,
+    std::shared_ptr<folly::Promise<bool>> promise) {
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  const auto now = GetCurrentTimeMs();
 
   cond_var_.runIfConditionOrWaitForNotify(
       // Operation
-      [weak_db = std::move(weak_db),
-       // TODO(bol) remove folly::makeMoveWrapper() when move to gcc 5.1
-       request = folly::makeMoveWrapper(std::move(request)),
-       callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
+      [weak_db = std::move(weak_db), seq_no, deadline_ms, promise] () mutable {
         auto db = weak_db.lock();
         if (db == nullptr) {
-          ReplicateException e;
-          e.msg = (*request)->db_name + " has been removed";
-          e.code = ErrorCode::SOURCE_NOT_FOUND;
-          (*callback).release()->exceptionInThread(std::move(e));
+          promise->setValue(false);
           return;
         }
 
-        const auto expected_seq_no = (*request)->seq_no + 1;
-        rocksdb::SequenceNumber next_seq_no = expected_seq_no;
-        auto iter = db->getCachedIter(expected_seq_no);
-        if (iter && !iter->Valid()) {
-          iter->Next();
-          if (!iter->Valid()) {
-            // this can only happen when cond_var_ timeout, or a new log file
-            // got created. Either way, it is ok (required) to create a new
-            // iterator.
-            iter.reset(nullptr);
-          }
-        }
-
-        rocksdb::Status status;
-        bool use_cached_iter = (iter != nullptr);
-        if (!use_cached_iter) {
-          auto start = GetCurrentTimeMs();
-          status = db->db_->GetUpdatesSince(expected_seq_no, &iter);
-          auto end = GetCurrentTimeMs();
-          logMetric(kReplicatorGetUpdatesSinceMs, start < end ? end - start : 0,
-                    db->db_name_);
+        if (db->db_->GetLatestSequenceNumber() >= seq_no) {
+          promise->setValue(true);
+          return;
         }
 
-        if (use_cached_iter || status.ok() || status.IsNotFound()) {
-          ReplicateResponse response;
-          uint64_t read_bytes = 0;
-          for (int32_t i = 0;
-               i < (*request)->max_updates && iter && iter->Valid();
-               ++i, iter->Next()) {
-            auto result = iter->GetBatch();
-            Update update;
-            next_seq_no += result.writeBatchPtr->Count();
-            const auto& str = result.writeBatchPtr->Data();
-            read_bytes += str.size();
-            update.raw_data = std::move(*folly::IOBuf::copyBuffer(str.data(),
-                                                                  str.size()));
-            LogExtractor extractor;
-            auto ret = result.writeBatchPtr->Iterate(&extractor);
-            if (ret.ok()) {
-              update.timestamp = extractor.ms;
-            } else {
-              update.timestamp = 0;
-              LOG(ERROR) << "Failed to extract timestamp for " << db->db_name_;
-            }
-            response.updates.emplace_back(std::move(update));
-          }
-
-          (*callback).release()->resultInThread(std::move(response));
-          if (FLAGS_replicator_replication_mode == 1) {
-            // post the largest sequence number we have written to the Slave.
-            db->max_seq_no_acked_.post(next_seq_no - 1);
-          }
-          incCounter(kReplicatorOutBytes, read_bytes, db->db_name_);
-        } else {
-          LOG(ERROR) << "Failed to pull updates from " << db->db_name_
-                     << " with error: " << status.ToString();
-          incCounter(kReplicatorGetUpdatesSinceErrors, 1, db->db_name_);
-          ReplicateException e;
-          e.msg = status.ToString();
-          e.code = ErrorCode::SOURCE_READ_ERROR;
-          (*callback).release()->exceptionInThread(std::move(e));
+        if (GetCurrentTimeMs() >= deadline_ms) {
+          incCounter(kReplicatorReadFenceTimeouts, 1, db->db_name_);
+          promise->setValue(false);
+          return;
         }
 
-        if (iter) {
-          db->putCachedIter(next_seq_no, std::move(iter));
-        }
+        // woken up by updates before seq_no, wait for the rest of them
+        db->waitForSeqNoUntil(seq_no, deadline_ms, std::move(promise));
       },
       // Predicate
-      [db = std::move(db), seq_no] {
-        return db->db_->GetLatestSequenceNumber() > seq_no;
+      [this, seq_no] {
+        return db_->GetLatestSequenceNumber() >= seq_no;
       },
-      // timeout
-      timeout);
+      // timeout, 0 would mean no timeout at all
+      std::max<uint64_t>(deadline_ms > now ? deadline_ms - now : 0, 1));
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::writeToDB(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  if (role_ == DBRole::SLAVE) {
+    throw ReturnCode::WRITE_TO_SLAVE;
+  }
+
+  incCounter(kReplicatorWriteBytes, updates->GetDataSize(), db_name_);
+
+  auto ms = GetCurrentTimeMs();
+  appendTimestamp(ms, updates);
+  auto start = GetCurrentTimeMs();
+  auto status = db_->Write(options, updates);
+  auto end = GetCurrentTimeMs();
+  logMetric(kReplicatorWriteMs, start < end ? end - start : 0, db_name_);
+  if (status.ok()) {
+    notifyNewUpdates();
+
+    // The last sequence number of our own batch, instead of the latest one of
+    // the db, which may belong to batches written concurrently after ours,
+    // and would make us wait for Slaves to get them too.
+    const auto first_seq_no = getWriteBatchSeqNo(*updates);
+    const auto count = updates->Count();
+    if (first_seq_no != 0 && count > 0) {
+      *seq_no = first_seq_no + count - 1;
+    } else {
+      // nothing to replicate in an empty batch
+      *seq_no = db_->GetLatestSequenceNumber();
+    }
+    if (options_.max_lag_ms > 0) {
+      recordWriteTime(*seq_no, ms);
+    }
+  }
+
+  return status;
+}
+
+void RocksDBReplicator::ReplicatedDB::throttleWrite(bool can_delay) {
+  const auto over = lagOverBudget();
+  if (over <= 0) {
+    return;
+  }
+
+  // The delay grows linearly from 0 to the max as the lag grows from the
+  // budget to twice of it.
+  if (!can_delay || over >= 1) {
+    incCounter(kReplicatorWritesThrottled, 1, db_name_);
+    throw ReturnCode::WRITE_THROTTLED;
+  }
+
+  const auto delay_ms =
+    static_cast<uint64_t>(over * FLAGS_replicator_throttle_max_delay_ms);
+  logMetric(kReplicatorWriteThrottleMs, delay_ms, db_name_);
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+}
+
+double RocksDBReplicator::ReplicatedDB::lagOverBudget() {
+  if (options_.max_lag_seq_no == 0 && options_.max_lag_ms == 0) {
+    return 0;
+  }
+
+  const auto fastest = fastestSlaveSeqNo();
+  if (fastest < 0) {
+    // no Slave has been heard from lately
+    return 0;
+  }
+
+  const auto slave_seq_no = static_cast<rocksdb::SequenceNumber>(fastest);
+  double over = 0;
+  const auto latest = db_->GetLatestSequenceNumber();
+  if (options_.max_lag_seq_no > 0 && latest > slave_seq_no) {
+    over = static_cast<double>(latest - slave_seq_no) /
+      options_.max_lag_seq_no - 1;
+  }
+
+  if (options_.max_lag_ms > 0) {
+    uint64_t written_ms = 0;
+    {
+      std::lock_guard<std::mutex> g(write_times_mutex_);
+      auto itor = std::upper_bound(
+        write_times_.begin(), write_times_.end(), slave_seq_no,
+        [] (rocksdb::SequenceNumber seq_no,
+            const std::pair<rocksdb::SequenceNumber, uint64_t>& sample) {
+          return seq_no < sample.first;
+        });
+      if (itor != write_times_.end()) {
+        written_ms = itor->second;
+      }
+    }
+
+    const auto now = GetCurrentTimeMs();
+    if (written_ms != 0 && written_ms < now) {
+      over = std::max(over, static_cast<double>(now - written_ms) /
+                      options_.max_lag_ms - 1);
+    }
+  }
+
+  return over;
+}
+
+void RocksDBReplicator::ReplicatedDB::recordSlaveSeqNo(
+    const folly::SocketAddress& slave,
+    rocksdb::SequenceNumber seq_no) {
+  const auto now = GetCurrentTimeMs();
+  std::lock_guard<std::mutex> g(slave_positions_mutex_);
+  // A Slave rebuilt from an older backup goes backwards, which must not be
+  // hidden by what it had before
+  auto& position = slave_positions_[slave];
+  position.seq_no = seq_no;
+  position.heard_ms = now;
+}
+
+int64_t RocksDBReplicator::ReplicatedDB::fastestSlaveSeqNo() {
+  const auto now = GetCurrentTimeMs();
+  int64_t fastest = -1;
+  std::lock_guard<std::mutex> g(slave_positions_mutex_);
+  for (auto itor = slave_positions_.begin();
+       itor != slave_positions_.end();) {
+    if (itor->second.heard_ms + FLAGS_replicator_slave_expire_ms < now) {
+      // the Slave has been removed or is down
+      itor = slave_positions_.erase(itor);
+      continue;
+    }
+
+    fastest = std::max(fastest, static_cast<int64_t>(itor->second.seq_no));
+    ++itor;
+  }
+
+  return fastest;
+}
+
+void RocksDBReplicator::ReplicatedDB::recordWriteTime(
+    rocksdb::SequenceNumber seq_no, uint64_t ms) {
+  std::lock_guard<std::mutex> g(write_times_mutex_);
+  // Concurrent writes may get here out of order. Samples are taken in the
+  // order of sequence numbers, which keeps them sorted.
+  if (!write_times_.empty() &&
+      (seq_no <= write_times_.back().first ||
+       ms < write_times_.back().second + kWriteTimeSampleIntervalMs)) {
+    return;
+  }
+  write_times_.emplace_back(seq_no, ms);
+
+  // Keep one sample older than twice the budget, which is enough to tell
+  // that a Slave behind it is over the budget.
+  const auto window_ms = 2 * options_.max_lag_ms;
+  while (write_times_.size() > 1 && write_times_[1].second + window_ms < ms) {
+    write_times_.pop_front();
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::waitForSlaves() const {
+  auto mode = replicationMode();
+  switch (mode) {
+  case 1:
+  case 2:
+    return true;
+  default:
+    CHECK(mode == 0) << "Invalid replicaton mode " << mode;
+    return false;
+  }
+}
+
+int32_t RocksDBReplicator::ReplicatedDB::replicationMode() const {
+  return options_.replication_mode < 0 ? FLAGS_replicator_replication_mode :
+    options_.replication_mode;
+}
+
+void RocksDBReplicator::ReplicatedDB::ackUpdates(
+    const folly::SocketAddress& slave,
+    rocksdb::SequenceNumber seq_no) {
+  const auto quorum = static_cast<size_t>(options_.ack_quorum);
+  if (quorum <= 1) {
+    max_seq_no_acked_.post(seq_no);
+    return;
+  }
+
+  if (slave.getPort() == 0) {
+    // Older Slaves not telling their port and failover probes can't be told
+    // apart from each other, so they don't count toward the quorum
+    return;
+  }
+
+  const auto now = GetCurrentTimeMs();
+  rocksdb::SequenceNumber quorum_seq_no;
+  {
+    std::lock_guard<std::mutex> g(slave_acks_mutex_);
+    auto& ack = slave_acks_[slave];
+    ack.heard_ms = now;
+    if (seq_no <= ack.seq_no) {
+      return;
+    }
+    ack.seq_no = seq_no;
+
+    // the quorum-th largest acked sequence number has been got by quorum
+    // Slaves. There are only a handful of Slaves, so just collect them.
+    std::vector<rocksdb::SequenceNumber> seq_nos;
+    seq_nos.reserve(slave_acks_.size());
+    for (auto itor = slave_acks_.begin(); itor != slave_acks_.end();) {
+      if (itor->second.heard_ms + FLAGS_replicator_slave_expire_ms < now) {
+        // the Slave has been removed or is down
+        itor = slave_acks_.erase(itor);
+        continue;
+      }
+
+      seq_nos.push_back(itor->second.seq_no);
+      ++itor;
+    }
+
+    if (seq_nos.size() < quorum) {
+      return;
+    }
+
+    std::nth_element(seq_nos.begin(), seq_nos.begin() + quorum - 1,
+                     seq_nos.end(),
+                     std::greater<rocksdb::SequenceNumber>());
+    quorum_seq_no = seq_nos[quorum - 1];
+  }
+
+  max_seq_no_acked_.post(quorum_seq_no);
+}
+
+RocksDBReplicator::ReplicatedDB::ReplicatedDB(
+    const std::string& db_name,
+    std::shared_ptr<rocksdb::DB> db,
+    folly::Executor* executor,
+    folly::Executor* catch_up_executor,
+    folly::Executor* apply_executor,
+    const DBRole role,
+    const folly::SocketAddress& upstream_addr,
+    common::ThriftClientPool<ReplicatorAsyncClient>* client_pool,
+    MultiPuller* multi_puller,
+    const uint16_t port,
+    const ReplicatedDBOptions& options)
+    : db_name_(db_name)
+    , db_(std::move(db))
+    , executor_(executor)
+    , catch_up_executor_(catch_up_executor)
+    , apply_executor_(apply_executor)
+    , role_(role)
+    , upstream_mutex_()
+    , upstream_addr_(upstream_addr)
+    , client_pool_(client_pool)
+    , multi_puller_(multi_puller)
+    , port_(port)
+    , options_(options)
+    , client_()
+    , cond_var_(executor)
+    , catch_up_rate_limiter_()
+    , rpc_options_()
+    , write_options_()
+    , cached_iters_()
+    , cached_iters_mutex_()
+    , recent_updates_(FLAGS_replicator_recent_updates_max_bytes)
+    , max_seq_no_acked_()
+    , slave_positions_mutex_()
+    , slave_positions_()
+    , write_times_mutex_()
+    , write_times_()
+    , slave_acks_mutex_()
+    , slave_acks_()
+    , pull_mutex_()
+    , pulls_in_flight_()
+    , pull_stride_(0)
+    , responses_out_of_order_()
+    , responses_to_apply_()
+    , next_pull_seq_no_(db_->GetLatestSequenceNumber())
+    , applying_(false)
+    , upstream_seq_no_(0)
+    , upstream_version_(0)
+    , failed_over_ms_(0)
+    , probing_peers_(false)
+    , last_applied_timestamp_ms_(0)
+    , batch_size_controller_(FLAGS_replicator_max_updates_per_response,
+                             FLAGS_replicator_max_bytes_per_response,
+                             FLAGS_replicator_catch_up_lag_ms,
+                             FLAGS_replicator_catch_up_max_scale)
+    , push_mode_(FLAGS_replicator_push_mode)
+    , compression_(CompressionType::NONE)
+    , bootstrapping_(false)
+    , checkpoint_mutex_()
+    , checkpoint_id_()
+    , checkpoint_created_ms_(0)
+    , checkpoint_files_()
+    , subscribers_mutex_()
+    , subscribers_()
+    , has_subscribers_(false) {
+  if (role == DBRole::SLAVE) {
+    client_ = client_pool_->getClient(upstream_addr);
+    if (!detail::parseCompressionType(FLAGS_replicator_compression,
+                                      &compression_)) {
+      LOG(ERROR) << "Unknown replicator_compression "
+                 << FLAGS_replicator_compression << ", use none instead";
+    }
+  }
+
+  rpc_options_.setTimeout(
+      std::chrono::milliseconds(
+          FLAGS_replicator_max_server_wait_time_ms
+          + FLAGS_replicator_client_server_timeout_difference_ms));
+  write_options_.sync = options_.sync_apply;
+}
+
+RocksDBReplicator::ReplicatedDB::~ReplicatedDB() {
+  // no need to do any synchronizations, because we are in the destructor, and
+  // thus no others are working on *this.
+  auto e = makeReplicateException(ErrorCode::SOURCE_NOT_FOUND,
+                                  db_name_ + " has been removed");
+  auto subscribers = subscribers_;
+  for (auto& subscriber : subscribers) {
+    endSubscription(std::move(subscriber), &e);
+  }
+
+  for (auto& pending : responses_to_apply_) {
+    if (pending.push_callback) {
+      auto copy = e;
+      pending.push_callback.release()->exceptionInThread(std::move(copy));
+    }
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
+  CHECK(role_ == DBRole::SLAVE);
+  if (bootstrapping_.load()) {
+    // resumed once the bootstrap is done or has failed
+    return;
+  }
+
+  if (options_.upstream_resolver && followResolvedMaster(false)) {
+    incCounter(kReplicatorUpstreamChanges, 1, db_name_);
+  }
+
+  if (push_mode_.load()) {
+    subscribeToUpstream();
+    return;
+  }
+
+  std::vector<rocksdb::SequenceNumber> starts;
+  ReplicateRequest req;
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    starts = pickPullsToSend();
+    req.max_updates = batch_size_controller_.maxUpdates();
+    if (batch_size_controller_.maxBytes() > 0) {
+      req.set_max_bytes(batch_size_controller_.maxBytes());
+    }
+  }
+
+  if (starts.empty()) {
+    return;
+  }
+
+  req.db_name = db_name_;
+  req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
+  req.set_committed_seq_no(db_->GetLatestSequenceNumber());
+  req.set_port(port_);
+  if (compression_ != CompressionType::NONE) {
+    req.set_compression(compression_);
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  for (const auto start : starts) {
+    req.seq_no = start;
+    if (multi_puller_ && pullWindowSize() == 1 &&
+        multi_puller_->pull(upstreamAddr(), weak_db, req)) {
+      continue;
+    }
+
+    auto options = rpc_options_;
+    upstreamClient()->future_replicate(options, req).via(executor_)
+      .then([weak_db, seq_no = start] (folly::Try<ReplicateResponse>&& t) {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+
+          db->handleReplicateResponse(seq_no, std::move(t));
+        });
+  }
+}
+
+std::vector<rocksdb::SequenceNumber>
+RocksDBReplicator::ReplicatedDB::pickPullsToSend() {
+  std::vector<rocksdb::SequenceNumber> starts;
+  const auto upstream_seq_no = upstream_seq_no_.load();
+  auto send = [this, &starts, upstream_seq_no] (rocksdb::SequenceNumber start) {
+    // expected to cover the same number of sequence numbers as the last
+    // response did, up to where upstream is known to be
+    auto end = start;
+    if (upstream_seq_no > start) {
+      end += std::min<uint64_t>(pull_stride_, upstream_seq_no - start);
+    }
+    pulls_in_flight_.emplace(start, end);
+    starts.push_back(start);
+  };
+
+  size_t outstanding = pulls_in_flight_.size() +
+    responses_out_of_order_.size() + responses_to_apply_.size();
+
+  // Ask for the updates right after what we have received, unless a request
+  // already does. It is not the case if we are not pulling at all, or if a
+  // response has covered less than expected, which leaves a gap in front of
+  // the later ones. Such a gap holds up all responses after it, so it is
+  // filled even if the window is full.
+  bool covered = false;
+  const auto last_received = next_pull_seq_no_;
+  const auto covering_end = pulls_in_flight_.upper_bound(last_received);
+  for (auto itor = pulls_in_flight_.begin(); itor != covering_end; ++itor) {
+    if (itor->first == last_received || itor->second > last_received) {
+      covered = true;
+      break;
+    }
+  }
+
+  if (!covered && (!responses_out_of_order_.empty() ||
+                   outstanding < pullWindowSize())) {
+    send(last_received);
+    ++outstanding;
+  }
+
+  // Ask for the ranges following what the outstanding requests are expected
+  // to cover, as long as upstream is known to have updates there.
+  while (outstanding < pullWindowSize()) {
+    auto start = last_received;
+    for (const auto& pull : pulls_in_flight_) {
+      start = std::max(start, pull.second);
+    }
+    if (!responses_out_of_order_.empty()) {
+      const auto& updates = responses_out_of_order_.rbegin()->second.updates;
+      const auto& last = updates.back().raw_data;
+      start = std::max<rocksdb::SequenceNumber>(
+        start, getWriteBatchSeqNo(last) + getWriteBatchCount(last) - 1);
+    }
+
+    if (start >= upstream_seq_no || pulls_in_flight_.count(start) > 0) {
+      break;
+    }
+
+    send(start);
+    ++outstanding;
+  }
+
+  return starts;
+}
+
+void RocksDBReplicator::ReplicatedDB::mergeReceivedResponses() {
+  while (!responses_out_of_order_.empty() &&
+         responses_out_of_order_.begin()->first <= next_pull_seq_no_) {
+    auto response = std::move(responses_out_of_order_.begin()->second);
+    responses_out_of_order_.erase(responses_out_of_order_.begin());
+
+    std::vector<Update> updates;
+    updates.swap(response.updates);
+    for (auto& update : updates) {
+      const auto first_seq_no = getWriteBatchSeqNo(update.raw_data);
+      const auto count = getWriteBatchCount(update.raw_data);
+      if (first_seq_no + count <= next_pull_seq_no_ + 1) {
+        // received already with an earlier response
+        continue;
+      }
+
+      if (first_seq_no > next_pull_seq_no_ + 1) {
+        LOG(ERROR) << "Updates for " << db_name_ << " jump from "
+                   << next_pull_seq_no_ << " to " << first_seq_no;
+        break;
+      }
+
+      if (first_seq_no <= next_pull_seq_no_) {
+        // an earlier response has ended in the middle of this batch
+        std::string rep;
+        appendIOBuf(update.raw_data, 0, &rep);
+        auto trimmed = trimWriteBatch(rocksdb::WriteBatch(std::move(rep)),
+                                      first_seq_no, next_pull_seq_no_ + 1);
+        if (trimmed == nullptr) {
+          LOG(ERROR) << "Failed to parse updates for " << db_name_;
+          break;
+        }
+        update.raw_data = wrapWriteBatch(std::move(trimmed));
+      }
+
+      next_pull_seq_no_ = first_seq_no + count - 1;
+      response.updates.emplace_back(std::move(update));
+    }
+
+    // Whatever is left after a malformed update is asked for again, as the
+    // gap after next_pull_seq_no_ gets filled.
+    if (!response.updates.empty()) {
+      responses_to_apply_.emplace_back(
+        PendingResponse{std::move(response), nullptr});
+    }
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::pullAgain(
+    rocksdb::SequenceNumber seq_no) {
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    pulls_in_flight_.erase(seq_no);
+  }
+
+  pullFromUpstream();
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReplicateResponse(
+    rocksdb::SequenceNumber seq_no,
+    folly::Try<ReplicateResponse>&& t) {
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    if (pulls_in_flight_.erase(seq_no) == 0) {
+      // We failed to apply some earlier response after this request was sent,
+      // and have restarted from the local DB. Drop it.
+      return;
+    }
+  }
+
+  if (t.hasException()) {
+    try {
+#if __GNUC__ >= 8
+      t.exception().throw_exception();
+#else
+      t.exception().throwException();
+#endif
+    } catch (const ReplicateException& ex) {
+      LOG(ERROR) << "ReplicateException: " << static_cast<int>(ex.code)
+                 << " " << ex.msg;
+      incCounter(kReplicatorRemoteApplicationExceptions, 1, db_name_);
+      if (ex.code == ErrorCode::SOURCE_WAL_PURGED &&
+          options_.on_checkpoint_downloaded) {
+        bootstrapFromUpstream();
+        return;
+      }
+    } catch (const apache::thrift::transport::TTransportException& ex) {
+      // upstream is unreachable or not responding
+      LOG(ERROR) << "TTransportException: " << ex.what();
+      incCounter(kReplicatorConnectionErrors, 1, db_name_);
+      resetUpstreamClient();
+      if (options_.upstream_resolver && failOver()) {
+        return;
+      }
+    } catch (const std::exception& ex) {
+      LOG(ERROR) << "std::exception: " << ex.what();
+      incCounter(kReplicatorConnectionErrors, 1, db_name_);
+      resetUpstreamClient();
+    }
+
+    delayNextPull();
+    return;
+  }
+
+  auto& response = t.value();
+  if (response.__isset.compressed_updates &&
+      !detail::decompressUpdates(response.compressed_updates,
+                                 &response.updates)) {
+    LOG(ERROR) << "Failed to decompress updates for " << db_name_;
+    incCounter(kReplicatorDecompressionErrors, 1, db_name_);
+    delayNextPull();
+    return;
+  }
+
+  if (response.__isset.latest_seq_no) {
+    updateUpstreamSeqNo(response.latest_seq_no);
+  }
+
+  bool apply_now = false;
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    const auto num_updates = response.updates.size();
+    int64_t num_bytes = 0;
+    uint64_t lag_ms = 0;
+    if (num_updates > 0) {
+      for (const auto& update : response.updates) {
+        num_bytes += update.raw_data.computeChainDataLength();
+      }
+
+      const uint64_t then = response.updates.back().timestamp;
+      const auto now = GetCurrentTimeMs();
+      lag_ms = (then != 0 && then < now) ? now - then : 0;
+
+      const auto& last = response.updates.back().raw_data;
+      const auto last_seq_no =
+        getWriteBatchSeqNo(last) + getWriteBatchCount(last) - 1;
+      if (last_seq_no > seq_no) {
+        pull_stride_ = last_seq_no - seq_no;
+      }
+      responses_out_of_order_[seq_no] = std::move(response);
+    }
+    batch_size_controller_.onResponse(num_updates, num_bytes, lag_ms);
+
+    mergeReceivedResponses();
+    if (!applying_ && !responses_to_apply_.empty()) {
+      applying_ = apply_now = true;
+    }
+  }
+
+  // Send the next requests before applying, so that the network round trips
+  // overlap with applying the updates we already have.
+  pullFromUpstream();
+
+  if (apply_now) {
+    scheduleApply();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::scheduleApply() {
+  // applying_ makes sure only one task applies updates of *this at a time, so
+  // they are applied in order.
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  apply_executor_->add([weak_db = std::move(weak_db)] {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        return;
+      }
+
+      db->applyPendingResponses();
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::applyPendingResponses() {
+  while (true) {
+    PendingResponse* pending;
+    {
+      std::lock_guard<std::mutex> g(pull_mutex_);
+      CHECK(applying_);
+      if (responses_to_apply_.empty()) {
+        applying_ = false;
+        return;
+      }
+
+      // references to deque elements stay valid on push_back()
+      pending = &responses_to_apply_.front();
+    }
+
+    bool ok = applyUpdates(&pending->response);
+
+    // Pushed updates are acked by the reply to the push call below
+    if (ok && pending->response.__isset.ack_requested &&
+        pending->response.ack_requested && pending->push_callback == nullptr) {
+      ackUpstream();
+    }
+
+    std::vector<std::unique_ptr<PushCallbackType>> push_callbacks;
+    {
+      std::lock_guard<std::mutex> g(pull_mutex_);
+      if (ok) {
+        push_callbacks.emplace_back(std::move(pending->push_callback));
+        responses_to_apply_.pop_front();
+      } else {
+        // Restart from whatever we have committed. Responses in flight for
+        // the old position will be dropped when they arrive.
+        for (auto& response : responses_to_apply_) {
+          push_callbacks.emplace_back(std::move(response.push_callback));
+        }
+        responses_to_apply_.clear();
+        responses_out_of_order_.clear();
+        pulls_in_flight_.clear();
+        next_pull_seq_no_ = db_->GetLatestSequenceNumber();
+        applying_ = false;
+      }
+    }
+
+    // Reply to upstream for pushed updates, which grants it a new credit
+    for (auto& push_callback : push_callbacks) {
+      if (push_callback == nullptr) {
+        continue;
+      }
+
+      if (ok) {
+        PushResponse response;
+        response.committed_seq_no = db_->GetLatestSequenceNumber();
+        push_callback.release()->resultInThread(std::move(response));
+      } else {
+        push_callback.release()->exceptionInThread(makeReplicateException(
+          ErrorCode::OTHER, "Failed to apply updates to " + db_name_));
+      }
+    }
+
+    // Pushed updates keep coming through the subscription, while pulls need
+    // to be sent again, as there is now room for more responses.
+    if (!ok) {
+      if (!push_mode_.load()) {
+        delayNextPull();
+      }
+      return;
+    }
+
+    if (!push_mode_.load()) {
+      pullFromUpstream();
+    }
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::applyUpdates(
+    ReplicateResponse* response) {
+  if (response->updates.empty()) {
+    return true;
+  }
+
+  const auto now = GetCurrentTimeMs();
+  uint64_t last_timestamp = 0;
+  for (const auto& update : response->updates) {
+    if (update.timestamp != 0) {
+      uint64_t then = update.timestamp;
+      logMetric(kReplicatorLatency, then < now ? now - then : 0, db_name_);
+      last_timestamp = then;
+    }
+  }
+
+  // Updates are expected to continue from what we have. Otherwise they
+  // would be applied at sequence numbers different from the Master's.
+  const auto expected_seq_no = db_->GetLatestSequenceNumber() + 1;
+  const auto first_seq_no =
+    getWriteBatchSeqNo(response->updates.front().raw_data);
+  if (first_seq_no != expected_seq_no) {
+    LOG(ERROR) << "Updates for " << db_name_ << " start from " << first_seq_no
+               << ", expecting " << expected_seq_no;
+    incCounter(kReplicatorOutOfOrderUpdates, 1, db_name_);
+    return false;
+  }
+
+  // Apply all updates in the response with a single write, which saves
+  // WAL appends, memtable insert rounds and fsyncs.
+  rocksdb::WriteBatch write_batch(buildWriteBatchRep(response->updates));
+  const auto write_bytes = write_batch.GetDataSize();
+  auto start = GetCurrentTimeMs();
+  auto status = db_->Write(write_options_, &write_batch);
+  auto end = GetCurrentTimeMs();
+  logMetric(kReplicatorApplyMs, start < end ? end - start : 0, db_name_);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to apply updates to SLAVE " << db_name_
+               << " " << status.ToString();
+    return false;
+  }
+
+  if (last_timestamp != 0) {
+    last_applied_timestamp_ms_.store(last_timestamp);
+  }
+  notifyNewUpdates();
+  incCounter(kReplicatorInBytes, write_bytes, db_name_);
+  return true;
+}
+
+void RocksDBReplicator::ReplicatedDB::delayNextPull() {
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = upstreamClient()->getChannel()->getEventBase();
+  // It is very bad if we fail to rescheudle a pull request, we'd prefer
+  // crashing.
+  eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
+      eb->runAfterDelay([weak_db = std::move(weak_db)] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+          db->pullFromUpstream();
+        },
+        FLAGS_replicator_pull_delay_on_error_ms);
+    });
+}
+
+folly::SocketAddress RocksDBReplicator::ReplicatedDB::upstreamAddr() const {
+  std::lock_guard<std::mutex> g(upstream_mutex_);
+  return upstream_addr_;
+}
+
+std::shared_ptr<ReplicatorAsyncClient>
+RocksDBReplicator::ReplicatedDB::upstreamClient() const {
+  std::lock_guard<std::mutex> g(upstream_mutex_);
+  return client_;
+}
+
+void RocksDBReplicator::ReplicatedDB::resetUpstreamClient() {
+  setUpstream(upstreamAddr());
+}
+
+void RocksDBReplicator::ReplicatedDB::setUpstream(
+    const folly::SocketAddress& upstream_addr) {
+  auto client = client_pool_->getClient(upstream_addr);
+  std::lock_guard<std::mutex> g(upstream_mutex_);
+  upstream_addr_ = upstream_addr;
+  client_ = std::move(client);
+}
+
+bool RocksDBReplicator::ReplicatedDB::followResolvedMaster(bool force) {
+  const auto version = options_.upstream_resolver->version();
+  const auto failed_over_ms = failed_over_ms_.load();
+  const bool retry_master = failed_over_ms != 0 &&
+    GetCurrentTimeMs() >= failed_over_ms +
+                          FLAGS_replicator_upstream_retry_master_ms;
+  if (!force && !retry_master && version == upstream_version_.load()) {
+    return false;
+  }
+
+  upstream_version_.store(version);
+  folly::SocketAddress master;
+  std::vector<folly::SocketAddress> peers;
+  if (!options_.upstream_resolver->resolve(db_name_, &master, &peers) ||
+      !master.isInitialized()) {
+    if (retry_master) {
+      // stay with the peer, and check again later
+      failed_over_ms_.store(GetCurrentTimeMs());
+    }
+    return false;
+  }
+
+  failed_over_ms_.store(0);
+  const auto current = upstreamAddr();
+  if (master == current) {
+    return false;
+  }
+
+  LOG(INFO) << "Re-point " << db_name_ << " from " << current.describe()
+            << " to Master " << master.describe();
+  setUpstream(master);
+  return true;
+}
+
+bool RocksDBReplicator::ReplicatedDB::failOver() {
+  // The Master may have moved while we were talking to the old one.
+  if (followResolvedMaster(true)) {
+    incCounter(kReplicatorUpstreamChanges, 1, db_name_);
+    pullFromUpstream();
+    return true;
+  }
+
+  folly::SocketAddress master;
+  std::vector<folly::SocketAddress> peers;
+  if (!options_.upstream_resolver->resolve(db_name_, &master, &peers)) {
+    return false;
+  }
+
+  const auto current = upstreamAddr();
+  peers.erase(std::remove(peers.begin(), peers.end(), current), peers.end());
+  // With pipelined pulls, more than one response may fail.
+  if (peers.empty() || probing_peers_.exchange(true)) {
+    return false;
+  }
+
+  // Ask every peer for what it has after us, without waiting for it, to see
+  // which one is the most caught up.
+  ReplicateRequest req;
+  req.db_name = db_name_;
+  req.seq_no = db_->GetLatestSequenceNumber();
+  req.max_wait_ms = 0;
+  req.max_updates = 1;
+  req.set_max_bytes(1);
+  apache::thrift::RpcOptions options;
+  options.setTimeout(
+    std::chrono::milliseconds(FLAGS_replicator_upstream_probe_timeout_ms));
+  std::vector<folly::Future<ReplicateResponse>> probes;
+  for (const auto& peer : peers) {
+    probes.push_back(client_pool_->getClient(peer)->future_replicate(options,
+                                                                     req));
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  folly::collectAll(probes).via(executor_)
+    .then([weak_db = std::move(weak_db), peers = std::move(peers)]
+          (folly::Try<std::vector<folly::Try<ReplicateResponse>>>&& t)
+          mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        db->handlePeerProbes(std::move(peers), std::move(t.value()));
+      });
+  return true;
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePeerProbes(
+    std::vector<folly::SocketAddress> peers,
+    std::vector<folly::Try<ReplicateResponse>>&& probes) {
+  probing_peers_.store(false);
+  // Peers which are not ahead of us have nothing to give, stay with the
+  // current upstream if none is.
+  const folly::SocketAddress* best = nullptr;
+  uint64_t best_seq_no = db_->GetLatestSequenceNumber();
+  for (size_t i = 0; i < probes.size(); ++i) {
+    if (!probes[i].hasValue() || !probes[i].value().__isset.latest_seq_no) {
+      continue;
+    }
+
+    const uint64_t seq_no = probes[i].value().latest_seq_no;
+    if (seq_no > best_seq_no) {
+      best = &peers[i];
+      best_seq_no = seq_no;
+    }
+  }
+
+  if (best == nullptr) {
+    LOG(ERROR) << "No peer of " << db_name_ << " is reachable and ahead of "
+               << "it";
+    delayNextPull();
+    return;
+  }
+
+  LOG(INFO) << "Upstream of " << db_name_ << " is unreachable, fail over to "
+            << best->describe() << " at " << best_seq_no;
+  incCounter(kReplicatorUpstreamFailovers, 1, db_name_);
+  failed_over_ms_.store(GetCurrentTimeMs());
+  setUpstream(*best);
+  pullFromUpstream();
+}
+
+void RocksDBReplicator::ReplicatedDB::updateUpstreamSeqNo(
+    rocksdb::SequenceNumber seq_no) {
+  uint64_t current = upstream_seq_no_.load();
+  while (current < seq_no &&
+         !upstream_seq_no_.compare_exchange_weak(current, seq_no)) {
+  }
+}
+
+folly::dynamic RocksDBReplicator::ReplicatedDB::getStats() {
+  const uint64_t seq_no = db_->GetLatestSequenceNumber();
+  auto stats = folly::dynamic::object
+    ("role", role_ == DBRole::MASTER ? "MASTER" : "SLAVE")
+    ("seq_no", seq_no);
+
+  if (role_ == DBRole::SLAVE) {
+    uint64_t apply_queue_depth;
+    uint64_t pending_apply_bytes = 0;
+    uint64_t pull_in_flight;
+    {
+      std::lock_guard<std::mutex> g(pull_mutex_);
+      apply_queue_depth = responses_to_apply_.size();
+      for (const auto& pending : responses_to_apply_) {
+        for (const auto& update : pending.response.updates) {
+          pending_apply_bytes += update.raw_data.computeChainDataLength();
+        }
+      }
+      pull_in_flight = pulls_in_flight_.size();
+    }
+
+    // Updates we have received are known to be upstream even before it tells
+    // us its latest sequence number.
+    updateUpstreamSeqNo(seq_no);
+    const uint64_t upstream_seq_no = upstream_seq_no_.load();
+    uint64_t lag_ms = 0;
+    const uint64_t then = last_applied_timestamp_ms_.load();
+    const auto now = GetCurrentTimeMs();
+    if (upstream_seq_no > seq_no && then != 0 && then < now) {
+      lag_ms = now - then;
+    }
+
+    stats["upstream"] = upstreamAddr().describe();
+    stats["upstream_seq_no"] = upstream_seq_no;
+    stats["lag_seq_no"] = upstream_seq_no - seq_no;
+    stats["lag_ms"] = lag_ms;
+    stats["pending_apply_bytes"] = pending_apply_bytes;
+    stats["apply_queue_depth"] = apply_queue_depth;
+    stats["pull_in_flight"] = pull_in_flight;
+    stats["push_mode"] = push_mode_.load() ? 1 : 0;
+    stats["bootstrapping"] = bootstrapping_.load() ? 1 : 0;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(cached_iters_mutex_);
+    stats["cached_iters"] = cached_iters_.size();
+  }
+
+  stats["fastest_slave_seq_no"] = fastestSlaveSeqNo();
+  auto slave_acks = folly::dynamic::object();
+  {
+    std::lock_guard<std::mutex> g(slave_acks_mutex_);
+    for (const auto& ack : slave_acks_) {
+      slave_acks[ack.first.describe()] = ack.second;
+    }
+  }
+  stats["slave_acks"] = std::move(slave_acks);
+
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    stats["subscribers"] = subscribers_.size();
+  }
+
+  return stats;
+}
+
+void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<ReplicateRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  auto db = shared_from_this();
+  std::weak_ptr<ReplicatedDB> weak_db = db;
+  auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+  auto slave = getSlaveAddress(*callback->getConnectionContext()
+                                 ->getPeerAddress(),
+                               *request);
+  ackReplicateRequest(slave, *request);
+  auto timeout = request->max_wait_ms;
+
+  // Requests far behind read cold WAL files. Serve them at a lower priority
+  // and within the catch-up rate limits, so that a Slave catching up doesn't
+  // hold up the caught-up ones.
+  const auto catch_up = isCatchUp(seq_no);
+  auto serve =
+      [weak_db = std::move(weak_db),
+       // TODO(bol) remove folly::makeMoveWrapper() when move to gcc 5.1
+       request = folly::makeMoveWrapper(std::move(request)),
+       callback = folly::makeMoveWrapper(std::move(callback)),
+       slave, catch_up] () mutable {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          (*callback).release()->exceptionInThread(makeReplicateException(
+            ErrorCode::SOURCE_NOT_FOUND,
+            (*request)->db_name + " has been removed"));
+          return;
+        }
+
+        db->serveReplicateRequest(std::move(*callback), std::move(*request),
+                                  slave, catch_up);
+      };
+
+  if (catch_up) {
+    incCounter(kReplicatorCatchUpRequests, 1, db_name_);
+    catch_up_executor_->add(std::move(serve));
+    return;
+  }
+
+  cond_var_.runIfConditionOrWaitForNotify(
+      // Operation
+      std::move(serve),
+      // Predicate
+      [db = std::move(db), seq_no] {
+        return db->hasUpdatesAfter(seq_no);
+      },
+      // timeout
+      timeout);
+}
+
+void RocksDBReplicator::ReplicatedDB::serveReplicateRequest(
+    std::unique_ptr<CallbackType> callback,
+    std::unique_ptr<ReplicateRequest> request,
+    const folly::SocketAddress& slave,
+    bool catch_up) {
+  ReplicateResponse response;
+  rocksdb::SequenceNumber next_seq_no;
+  auto status = buildReplicateResponse(*request, &response, &next_seq_no);
+  if (!status.ok()) {
+    callback.release()->exceptionInThread(toReplicateException(status));
+    return;
+  }
+
+  uint64_t delay_ms = 0;
+  if (catch_up) {
+    const auto bytes = getResponseBytes(response);
+    delay_ms = std::max(
+      catch_up_rate_limiter_.reserveMs(
+        bytes, FLAGS_replicator_catch_up_db_rate_bytes_per_sec),
+      globalCatchUpRateLimiter()->reserveMs(
+        bytes, FLAGS_replicator_catch_up_rate_bytes_per_sec));
+  }
+
+  if (delay_ms == 0) {
+    callback.release()->resultInThread(std::move(response));
+    ackReplicateResponse(slave, next_seq_no);
+    return;
+  }
+
+  logMetric(kReplicatorCatchUpThrottleMs, delay_ms, db_name_);
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+#if __GNUC__ >= 8
+  auto timer = folly::futures::sleepUnsafe(std::chrono::milliseconds(delay_ms));
+#else
+  auto timer = folly::futures::sleep(std::chrono::milliseconds(delay_ms));
+#endif
+  std::move(timer).via(catch_up_executor_).then(
+    [weak_db = std::move(weak_db),
+     callback = folly::makeMoveWrapper(std::move(callback)),
+     response = folly::makeMoveWrapper(std::move(response)),
+     slave, next_seq_no] (folly::Try<folly::Unit>&& t) mutable {
+      (*callback).release()->resultInThread(std::move(*response));
+      auto db = weak_db.lock();
+      if (db) {
+        db->ackReplicateResponse(slave, next_seq_no);
+      }
+    });
+}
+
+bool RocksDBReplicator::ReplicatedDB::isCatchUp(
+    rocksdb::SequenceNumber seq_no) const {
+  const auto min_lag = FLAGS_replicator_catch_up_min_lag_seq_no;
+  return min_lag > 0 && db_->GetLatestSequenceNumber() > seq_no + min_lag;
+}
+
+folly::SocketAddress RocksDBReplicator::ReplicatedDB::getSlaveAddress(
+    const folly::SocketAddress& peer,
+    const ReplicateRequest& request) {
+  auto slave = peer;
+  // The port of the connection is ephemeral, and would make the same Slave
+  // look like a new one every time it reconnects
+  slave.setPort(request.__isset.port ? static_cast<uint16_t>(request.port) :
+                                       0);
+
+  return slave;
+}
+
+void RocksDBReplicator::ReplicatedDB::ackReplicateRequest(
+    const folly::SocketAddress& slave,
+    const ReplicateRequest& request) {
+  const auto committed_seq_no = static_cast<rocksdb::SequenceNumber>(
+    request.__isset.committed_seq_no ? request.committed_seq_no :
+                                       request.seq_no);
+  recordSlaveSeqNo(slave, committed_seq_no);
+  const auto mode = replicationMode();
+  if (mode == 1 || mode == 2) {
+    // post the largest sequence number the Slave has committed. A Slave
+    // pipelining its requests asks for seq_no before the updates up to it
+    // have been written to it, so seq_no can't be acked in mode 1. Mode 1
+    // acks the rest in ackReplicateResponse() once they are written.
+    ackUpdates(slave, committed_seq_no);
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::ackReplicateResponse(
+    const folly::SocketAddress& slave,
+    rocksdb::SequenceNumber next_seq_no) {
+  if (replicationMode() == 1) {
+    // post the largest sequence number we have written to the Slave.
+    ackUpdates(slave, next_seq_no - 1);
+  }
+}
+
+bool RocksDBReplicator::ReplicatedDB::hasUpdatesAfter(
+    rocksdb::SequenceNumber seq_no) const {
+  return db_->GetLatestSequenceNumber() > seq_no;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::buildReplicateResponse(
+    const ReplicateRequest& request,
+    ReplicateResponse* response,
+    rocksdb::SequenceNumber* next_seq_no) {
+  const auto expected_seq_no = request.seq_no + 1;
+  auto max_bytes = request.__isset.max_bytes ? request.max_bytes : 0;
+  auto status = readUpdates(expected_seq_no, request.max_updates, max_bytes,
+                            &response->updates, next_seq_no);
+  response->set_latest_seq_no(db_->GetLatestSequenceNumber());
+  if (status.ok() && !response->updates.empty() && role_ == DBRole::MASTER &&
+      replicationMode() == 2) {
+    // writes are waiting for the Slave to commit these updates
+    response->set_ack_requested(true);
+  }
+  if (status.ok() && request.__isset.compression &&
+      compressUpdates(request.compression, &response->updates,
+                      &response->compressed_updates)) {
+    response->__isset.compressed_updates = true;
+  }
+
+  return status;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::readUpdates(
+    rocksdb::SequenceNumber seq_no,
+    int32_t max_updates,
+    int64_t max_bytes,
+    std::vector<Update>* updates,
+    rocksdb::SequenceNumber* next_seq_no) {
+  *next_seq_no = seq_no;
+  std::vector<detail::RecentUpdates::Entry> entries;
+  if (recent_updates_.read(seq_no, max_updates, max_bytes, &entries,
+                           next_seq_no)) {
+    uint64_t read_bytes = 0;
+    for (auto& entry : entries) {
+      Update update;
+      update.timestamp = entry.timestamp;
+      read_bytes += entry.raw_data.computeChainDataLength();
+      update.raw_data = std::move(entry.raw_data);
+      updates->emplace_back(std::move(update));
+    }
+
+    incCounter(kReplicatorRecentUpdatesHits, 1, db_name_);
+    incCounter(kReplicatorOutBytes, read_bytes, db_name_);
+    return rocksdb::Status::OK();
+  }
+
+  incCounter(kReplicatorRecentUpdatesMisses, 1, db_name_);
+  auto iter = getCachedIter(seq_no);
+  if (iter && !iter->Valid()) {
+    iter->Next();
+    if (!iter->Valid()) {
+      // this can only happen when cond_var_ timeout, or a new log file
+      // got created. Either way, it is ok (required) to create a new
+      // iterator.
+      iter.reset(nullptr);
+    }
+  }
+
+  rocksdb::Status status;
+  bool use_cached_iter = (iter != nullptr);
+  if (!use_cached_iter) {
+    auto start = GetCurrentTimeMs();
+    status = db_->GetUpdatesSince(seq_no, &iter);
+    auto end = GetCurrentTimeMs();
+    logMetric(kReplicatorGetUpdatesSinceMs, start < end ? end - start : 0,
+              db_name_);
+  }
+
+  if (!use_cached_iter && !status.ok() && !status.IsNotFound()) {
+    LOG(ERROR) << "Failed to pull updates from " << db_name_
+               << " with error: " << status.ToString();
+    incCounter(kReplicatorGetUpdatesSinceErrors, 1, db_name_);
+    return status;
+  }
+
+  uint64_t read_bytes = 0;
+  for (int32_t i = 0;
+       (max_updates <= 0 || i < max_updates) &&
+       (max_bytes <= 0 || read_bytes < static_cast<uint64_t>(max_bytes)) &&
+       iter && iter->Valid();
+       ++i, iter->Next()) {
+    auto result = iter->GetBatch();
+    if (i == 0 && !use_cached_iter && result.sequence > seq_no) {
+      // The WAL holding seq_no has been purged
+      LOG(ERROR) << "Updates of " << db_name_ << " from " << seq_no
+                 << " are no longer in the WAL, which starts from "
+                 << result.sequence;
+      incCounter(kReplicatorWALPurgedErrors, 1, db_name_);
+      return rocksdb::Status::Incomplete(kWALPurged);
+    }
+    if (i == 0 && result.sequence < seq_no) {
+      // GetUpdatesSince() returns the batch holding seq_no, which may start
+      // before it if the batch was merged from several upstream batches by
+      // a Slave. Records the reader already has are dropped, otherwise it
+      // would apply them again.
+      auto trimmed = trimWriteBatch(*result.writeBatchPtr, result.sequence,
+                                    seq_no);
+      if (trimmed == nullptr) {
+        LOG(ERROR) << "Failed to read updates of " << db_name_ << " from "
+                   << seq_no << " in the batch starting from "
+                   << result.sequence;
+        incCounter(kReplicatorGetUpdatesSinceErrors, 1, db_name_);
+        return rocksdb::Status::Corruption("Failed to trim the batch");
+      }
+
+      result.sequence = seq_no;
+      result.writeBatchPtr = std::move(trimmed);
+    }
+    Update update;
+    *next_seq_no += result.writeBatchPtr->Count();
+    uint64_t ms;
+    if (getWriteBatchTimestamp(*result.writeBatchPtr, &ms)) {
+      update.timestamp = ms;
+    } else {
+      update.timestamp = 0;
+      LOG(ERROR) << "Failed to extract timestamp for " << db_name_;
+    }
+    read_bytes += result.writeBatchPtr->GetDataSize();
+    auto count = result.writeBatchPtr->Count();
+    update.raw_data = wrapWriteBatch(std::move(result.writeBatchPtr));
+    recent_updates_.append(result.sequence, count, update.timestamp,
+                           update.raw_data);
+    updates->emplace_back(std::move(update));
+  }
+
+  if (iter) {
+    putCachedIter(*next_seq_no, std::move(iter));
+  }
+
+  incCounter(kReplicatorOutBytes, read_bytes, db_name_);
+  return rocksdb::Status::OK();
+}
+
+ReplicateException RocksDBReplicator::ReplicatedDB::toReplicateException(
+    const rocksdb::Status& status) {
+  if (status.IsIncomplete() && status.ToString().find(kWALPurged) !=
+      std::string::npos) {
+    return makeReplicateException(ErrorCode::SOURCE_WAL_PURGED,
+                                  status.ToString());
+  }
+
+  return makeReplicateException(ErrorCode::SOURCE_READ_ERROR,
+                                status.ToString());
+}
+
+bool RocksDBReplicator::ReplicatedDB::compressUpdates(
+    CompressionType type,
+    std::vector<Update>* updates,
+    CompressedUpdates* compressed) {
+  if (!detail::compressUpdates(type, FLAGS_replicator_compression_min_bytes,
+                               updates, compressed)) {
+    return false;
+  }
+
+  incCounter(kReplicatorOutCompressedBytes,
+             compressed->data.computeChainDataLength(), db_name_);
+  return true;
+}
+
+void RocksDBReplicator::ReplicatedDB::notifyNewUpdates() {
+  cond_var_.notifyAll();
+  if (has_subscribers_.load()) {
+    pushToSubscribers();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::subscribeToUpstream() {
+  SubscribeRequest req;
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    req.seq_no = next_pull_seq_no_;
+  }
+  req.db_name = db_name_;
+  req.port = port_;
+  req.credits = static_cast<int32_t>(pullWindowSize());
+  req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
+  if (compression_ != CompressionType::NONE) {
+    req.set_compression(compression_);
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto options = rpc_options_;
+  upstreamClient()->future_subscribe(options, req).via(executor_)
+    .then([weak_db = std::move(weak_db)]
+          (folly::Try<SubscribeResponse>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        db->handleSubscribeResponse(std::move(t));
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::handleSubscribeResponse(
+    folly::Try<SubscribeResponse>&& t) {
+  if (!t.hasException()) {
+    // the subscription has ended normally, renew it.
+    subscribeToUpstream();
+    return;
+  }
+
+  try {
+#if __GNUC__ >= 8
+    t.exception().throw_exception();
+#else
+    t.exception().throwException();
+#endif
+  } catch (const ReplicateException& ex) {
+    LOG(ERROR) << "ReplicateException: " << static_cast<int>(ex.code)
+               << " " << ex.msg;
+    incCounter(kReplicatorRemoteApplicationExceptions, 1, db_name_);
+    if (ex.code == ErrorCode::SOURCE_WAL_PURGED &&
+        options_.on_checkpoint_downloaded) {
+      bootstrapFromUpstream();
+      return;
+    }
+  } catch (const apache::thrift::TApplicationException& ex) {
+    if (ex.getType() ==
+        apache::thrift::TApplicationException::UNKNOWN_METHOD) {
+      LOG(WARNING) << "Upstream of " << db_name_ << " doesn't support push, "
+                   << "fall back to pull";
+      push_mode_.store(false);
+      pullFromUpstream();
+      return;
+    }
+
+    LOG(ERROR) << "TApplicationException: " << ex.what();
+    incCounter(kReplicatorConnectionErrors, 1, db_name_);
+    resetUpstreamClient();
+  } catch (const apache::thrift::transport::TTransportException& ex) {
+    // upstream is unreachable or not responding
+    LOG(ERROR) << "TTransportException: " << ex.what();
+    incCounter(kReplicatorConnectionErrors, 1, db_name_);
+    resetUpstreamClient();
+    if (options_.upstream_resolver && failOver()) {
+      return;
+    }
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "std::exception: " << ex.what();
+    incCounter(kReplicatorConnectionErrors, 1, db_name_);
+    resetUpstreamClient();
+  }
+
+  delayNextPull();
+}
+
+void RocksDBReplicator::ReplicatedDB::handleSubscribeRequest(
+    std::unique_ptr<SubscribeCallbackType> callback,
+    std::unique_ptr<SubscribeRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  auto subscriber = std::make_shared<Subscriber>();
+  subscriber->addr = *callback->getConnectionContext()->getPeerAddress();
+  subscriber->addr.setPort(static_cast<uint16_t>(request->port));
+  subscriber->client = client_pool_->getClient(subscriber->addr);
+  subscriber->callback = std::move(callback);
+  subscriber->seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+  subscriber->credits = std::max(request->credits, 1);
+  subscriber->reading = false;
+  subscriber->more_updates = false;
+  subscriber->ended = false;
+  subscriber->compression = request->__isset.compression ?
+    request->compression : CompressionType::NONE;
+
+  std::shared_ptr<Subscriber> replaced;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    for (auto& s : subscribers_) {
+      if (s->addr == subscriber->addr) {
+        replaced = s;
+        break;
+      }
+    }
+    subscribers_.push_back(subscriber);
+    has_subscribers_.store(true);
+  }
+
+  if (replaced) {
+    auto e = makeReplicateException(ErrorCode::OTHER,
+                                    "Replaced by a new subscription");
+    endSubscription(std::move(replaced), &e);
+  }
+
+  if (request->max_wait_ms > 0) {
+    std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+    std::weak_ptr<Subscriber> weak_subscriber = subscriber;
+    auto eb = subscriber->client->getChannel()->getEventBase();
+    eb->runInEventBaseThread([eb, weak_db = std::move(weak_db),
+                              weak_subscriber = std::move(weak_subscriber),
+                              timeout = request->max_wait_ms] {
+        eb->runAfterDelay([weak_db = std::move(weak_db),
+                           weak_subscriber = std::move(weak_subscriber)] {
+            auto db = weak_db.lock();
+            auto subscriber = weak_subscriber.lock();
+            if (db == nullptr || subscriber == nullptr) {
+              return;
+            }
+            db->endSubscription(std::move(subscriber));
+          },
+          timeout);
+      });
+  }
+
+  pushToSubscriber(std::move(subscriber));
+}
+
+void RocksDBReplicator::ReplicatedDB::pushToSubscribers() {
+  std::list<std::shared_ptr<Subscriber>> subscribers;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    subscribers = subscribers_;
+  }
+
+  for (auto& subscriber : subscribers) {
+    pushToSubscriber(std::move(subscriber));
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::pushToSubscriber(
+    std::shared_ptr<Subscriber> subscriber) {
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    if (subscriber->ended || subscriber->credits <= 0) {
+      return;
+    }
+
+    if (subscriber->reading) {
+      subscriber->more_updates = true;
+      return;
+    }
+
+    subscriber->reading = true;
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  executor_->add([weak_db = std::move(weak_db),
+                  subscriber = std::move(subscriber)] {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        return;
+      }
+
+      db->doPush(subscriber);
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::doPush(
+    std::shared_ptr<Subscriber> subscriber) {
+  while (true) {
+    rocksdb::SequenceNumber seq_no;
+    {
+      std::lock_guard<std::mutex> g(subscribers_mutex_);
+      if (subscriber->ended || subscriber->credits <= 0) {
+        subscriber->reading = false;
+        return;
+      }
+
+      subscriber->more_updates = false;
+      seq_no = subscriber->seq_no;
+    }
+
+    PushRequest request;
+    rocksdb::SequenceNumber next_seq_no;
+    auto status = readUpdates(seq_no + 1,
+                              FLAGS_replicator_max_updates_per_response,
+                              FLAGS_replicator_max_bytes_per_response,
+                              &request.updates, &next_seq_no);
+    if (!status.ok()) {
+      {
+        std::lock_guard<std::mutex> g(subscribers_mutex_);
+        subscriber->reading = false;
+      }
+      auto e = toReplicateException(status);
+      endSubscription(std::move(subscriber), &e);
+      return;
+    }
+
+    if (request.updates.empty()) {
+      std::lock_guard<std::mutex> g(subscribers_mutex_);
+      if (!subscriber->more_updates) {
+        subscriber->reading = false;
+        return;
+      }
+
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> g(subscribers_mutex_);
+      --subscriber->credits;
+      subscriber->seq_no = next_seq_no - 1;
+    }
+
+    request.seq_no = seq_no;
+    request.db_name = db_name_;
+    request.set_latest_seq_no(db_->GetLatestSequenceNumber());
+    if (compressUpdates(subscriber->compression, &request.updates,
+                        &request.compressed_updates)) {
+      request.__isset.compressed_updates = true;
+    }
+    std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+    auto options = rpc_options_;
+    subscriber->client->future_push(options, request).via(executor_)
+      .then([weak_db = std::move(weak_db), subscriber]
+            (folly::Try<PushResponse>&& t) {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+
+          db->handlePushResponse(subscriber, std::move(t));
+        });
+
+    if (replicationMode() == 1) {
+      // post the largest sequence number we have written to the Slave.
+      ackUpdates(subscriber->addr, next_seq_no - 1);
+    }
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePushResponse(
+    std::shared_ptr<Subscriber> subscriber,
+    folly::Try<PushResponse>&& t) {
+  if (t.hasException()) {
+    LOG(ERROR) << "Failed to push updates of " << db_name_ << " to "
+               << subscriber->addr.describe() << ": " << t.exception().what();
+    incCounter(kReplicatorPushErrors, 1, db_name_);
+    auto e = makeReplicateException(ErrorCode::OTHER,
+                                    "Failed to push updates");
+    endSubscription(std::move(subscriber), &e);
+    return;
+  }
+
+  recordSlaveSeqNo(
+    subscriber->addr,
+    static_cast<rocksdb::SequenceNumber>(t.value().committed_seq_no));
+  if (replicationMode() == 2) {
+    // post the largest sequence number the Slave has committed
+    ackUpdates(subscriber->addr,
+               static_cast<rocksdb::SequenceNumber>(
+                 t.value().committed_seq_no));
+  }
+
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    ++subscriber->credits;
+  }
+
+  pushToSubscriber(std::move(subscriber));
+}
+
+void RocksDBReplicator::ReplicatedDB::endSubscription(
+    std::shared_ptr<Subscriber> subscriber,
+    const ReplicateException* e) {
+  std::unique_ptr<SubscribeCallbackType> callback;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    if (subscriber->ended) {
+      return;
+    }
+
+    subscriber->ended = true;
+    callback = std::move(subscriber->callback);
+    subscribers_.remove(subscriber);
+    has_subscribers_.store(!subscribers_.empty());
+  }
+
+  if (e == nullptr) {
+    callback.release()->resultInThread(SubscribeResponse());
+  } else {
+    auto copy = *e;
+    callback.release()->exceptionInThread(std::move(copy));
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::ackUpstream() {
+  AckRequest req;
+  req.db_name = db_name_;
+  req.committed_seq_no = db_->GetLatestSequenceNumber();
+  req.port = port_;
+
+  auto options = rpc_options_;
+  upstreamClient()->future_ack(options, req).via(executor_)
+    .then([db_name = db_name_] (folly::Try<AckResponse>&& t) {
+        if (t.hasException()) {
+          // upstream learns about it from our next request anyway
+          LOG(ERROR) << "Failed to ack upstream of " << db_name << ": "
+                     << t.exception().what();
+          incCounter(kReplicatorAckErrors, 1, db_name);
+        }
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::handleAckRequest(
+    std::unique_ptr<AckCallbackType> callback,
+    std::unique_ptr<AckRequest> request) {
+  CHECK(request->db_name == db_name_);
+  auto slave = *callback->getConnectionContext()->getPeerAddress();
+  slave.setPort(static_cast<uint16_t>(request->port));
+  const auto seq_no =
+    static_cast<rocksdb::SequenceNumber>(request->committed_seq_no);
+  recordSlaveSeqNo(slave, seq_no);
+  if (replicationMode() == 2) {
+    // post the largest sequence number the Slave has committed
+    ackUpdates(slave, seq_no);
+  }
+
+  callback.release()->resultInThread(AckResponse());
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePushRequest(
+    std::unique_ptr<PushCallbackType> callback,
+    std::unique_ptr<PushRequest> request) {
+  CHECK(request->db_name == db_name_);
+  if (role_ != DBRole::SLAVE) {
+    callback.release()->exceptionInThread(makeReplicateException(
+      ErrorCode::OTHER, db_name_ + " is not a SLAVE"));
+    return;
+  }
+
+  if (request->__isset.compressed_updates &&
+      !detail::decompressUpdates(request->compressed_updates,
+                                 &request->updates)) {
+    incCounter(kReplicatorDecompressionErrors, 1, db_name_);
+    callback.release()->exceptionInThread(makeReplicateException(
+      ErrorCode::OTHER, "Failed to decompress updates for " + db_name_));
+    return;
+  }
+
+  if (request->__isset.latest_seq_no) {
+    updateUpstreamSeqNo(request->latest_seq_no);
+  }
+
+  PendingResponse pending;
+  bool unexpected = false;
+  bool apply_now = false;
+  {
+    std::lock_guard<std::mutex> g(pull_mutex_);
+    auto seq_no = static_cast<rocksdb::SequenceNumber>(request->seq_no);
+    auto next_seq_no = next_pull_seq_no_;
+    for (auto& update : request->updates) {
+      const auto count = getWriteBatchCount(update.raw_data);
+      if (seq_no + count <= next_seq_no) {
+        // We have received it already, which happens if we re-subscribed
+        // while some pushes were in flight.
+        seq_no += count;
+        continue;
+      }
+
+      if (seq_no != next_seq_no) {
+        unexpected = true;
+        break;
+      }
+
+      seq_no += count;
+      next_seq_no = seq_no;
+      pending.response.updates.emplace_back(std::move(update));
+    }
+
+    if (!unexpected && !pending.response.updates.empty()) {
+      next_pull_seq_no_ = next_seq_no;
+      pending.push_callback = std::move(callback);
+      responses_to_apply_.emplace_back(std::move(pending));
+      if (!applying_) {
+        applying_ = apply_now = true;
+      }
+    }
+  }
+
+  if (unexpected) {
+    callback.release()->exceptionInThread(makeReplicateException(
+      ErrorCode::OTHER, "Unexpected sequence number for " + db_name_));
+    return;
+  }
+
+  if (callback) {
+    // nothing new in the request
+    PushResponse response;
+    response.committed_seq_no = db_->GetLatestSequenceNumber();
+    callback.release()->resultInThread(std::move(response));
+    return;
+  }
+
+  if (apply_now) {
+    scheduleApply();
+  }
 }
 
 std::unique_ptr<rocksdb::TransactionLogIterator>
@@ -0,0 +1,333 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// A self-contained replication benchmark. It runs a Master and its Slaves in
+// one process, replicating over localhost ports, for every combination of
+// replication modes, value sizes, shard counts and writer thread counts given
+// by the flags below. Results are printed as a JSON array, one object per
+// combination, with write throughput, write latency percentiles and the
+// distribution of replication lag, i.e. how long after a write is acked on
+// the Master it is committed to a Slave.
+//
+// e.g. replication_benchmark --replication_modes=0,2 --value_sizes=100,4096
+//
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "folly/Conv.h"
+#include "folly/String.h"
+#include "folly/dynamic.h"
+#include "folly/json.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+
+using folly::SocketAddress;
+using replicator::DBRole;
+using replicator::ReplicatedDBOptions;
+using replicator::ReturnCode;
+using replicator::RocksDBReplicator;
+using rocksdb::DB;
+using rocksdb::Options;
+using rocksdb::WriteBatch;
+using rocksdb::WriteOptions;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(replication_modes, "0,1,2",
+              "Comma separated replication modes to benchmark");
+DEFINE_string(value_sizes, "100,1024", "Comma separated value sizes");
+DEFINE_string(shard_counts, "1,16", "Comma separated numbers of shards");
+DEFINE_string(write_thread_counts, "1,8",
+              "Comma separated numbers of threads issuing writes");
+DEFINE_int32(num_slaves, 1, "Number of Slaves of each shard");
+DEFINE_int32(writes_per_thread, 20000, "Number of writes issued per thread");
+DEFINE_int32(lag_sample_interval, 16,
+             "Measure replication lag for one out of this many writes");
+DEFINE_int32(lag_poll_interval_us, 100,
+             "How often Slaves are checked for sampled writes, which is the "
+             "resolution of the replication lag measured");
+DEFINE_int32(catch_up_timeout_sec, 60,
+             "How long to wait for Slaves to catch up after writes are done");
+DEFINE_string(benchmark_db_path, "/tmp/replication_benchmark",
+              "The directory to create dbs in");
+DEFINE_int32(benchmark_base_port, 9300,
+             "Replicators listen on consecutive ports starting from this one");
+
+namespace {
+
+uint64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+vector<int> parseList(const string& str) {
+  vector<string> parts;
+  folly::split(',', str, parts, true);
+  vector<int> result;
+  for (const auto& part : parts) {
+    result.push_back(folly::to<int>(part));
+  }
+  return result;
+}
+
+folly::dynamic percentiles(vector<uint64_t>* samples) {
+  if (samples->empty()) {
+    return nullptr;
+  }
+
+  std::sort(samples->begin(), samples->end());
+  auto at = [samples] (double p) {
+    auto i = static_cast<size_t>(p * samples->size());
+    return (*samples)[std::min(i, samples->size() - 1)];
+  };
+  return folly::dynamic::object
+    ("count", samples->size())
+    ("p50", at(0.5))
+    ("p99", at(0.99))
+    ("p999", at(0.999))
+    ("max", samples->back());
+}
+
+shared_ptr<DB> cleanAndOpenDB(const string& path) {
+  CHECK_EQ(system(("rm -rf " + path).c_str()), 0);
+  DB* db;
+  Options options;
+  options.create_if_missing = true;
+  CHECK(DB::Open(options, path, &db).ok());
+  return shared_ptr<DB>(db);
+}
+
+// A write sampled for measuring replication lag
+struct LagSample {
+  rocksdb::SequenceNumber seq_no;
+  uint64_t acked_us;
+};
+
+struct Shard {
+  string name;
+  shared_ptr<DB> master;
+  vector<shared_ptr<DB>> slaves;
+  // writes sampled for each Slave, in the order of their sequence numbers
+  std::mutex samples_mutex;
+  vector<std::deque<LagSample>> samples;
+};
+
+folly::dynamic runOnce(int mode, int value_size, int num_shards,
+                       int num_threads, uint16_t base_port) {
+  LOG(INFO) << "Running mode " << mode << ", value size " << value_size
+            << ", " << num_shards << " shards, " << num_threads
+            << " threads";
+  ReplicatedDBOptions db_options;
+  db_options.replication_mode = mode;
+
+  auto master = RocksDBReplicator::newInstance(base_port);
+  vector<unique_ptr<RocksDBReplicator>> slaves;
+  for (int i = 0; i < FLAGS_num_slaves; ++i) {
+    slaves.push_back(RocksDBReplicator::newInstance(base_port + 1 + i));
+  }
+
+  SocketAddress master_addr("127.0.0.1", base_port);
+  vector<unique_ptr<Shard>> shards;
+  for (int i = 0; i < num_shards; ++i) {
+    shards.emplace_back(new Shard);
+    auto& shard = *shards.back();
+    shard.name = "shard" + to_string(i);
+    auto path = FLAGS_benchmark_db_path + "/" + shard.name;
+    shard.master = cleanAndOpenDB(path + "_master");
+    CHECK(master->addDB(shard.name, shard.master, DBRole::MASTER,
+                        SocketAddress(), nullptr, db_options) ==
+          ReturnCode::OK);
+    for (int j = 0; j < FLAGS_num_slaves; ++j) {
+      shard.slaves.push_back(cleanAndOpenDB(path + "_slave" + to_string(j)));
+      CHECK(slaves[j]->addDB(shard.name, shard.slaves.back(), DBRole::SLAVE,
+                             master_addr, nullptr, db_options) ==
+            ReturnCode::OK);
+    }
+    shard.samples.resize(FLAGS_num_slaves);
+  }
+
+  std::atomic<bool> writing(true);
+  vector<uint64_t> lags_us;
+  thread lag_monitor([&shards, &writing, &lags_us] {
+      while (true) {
+        const bool done = !writing.load();
+        bool pending = false;
+        for (auto& shard : shards) {
+          for (size_t j = 0; j < shard->slaves.size(); ++j) {
+            const auto seq_no = shard->slaves[j]->GetLatestSequenceNumber();
+            const auto now = nowUs();
+            std::lock_guard<std::mutex> g(shard->samples_mutex);
+            auto& samples = shard->samples[j];
+            while (!samples.empty() && samples.front().seq_no <= seq_no) {
+              lags_us.push_back(now - samples.front().acked_us);
+              samples.pop_front();
+            }
+            pending = pending || !samples.empty();
+          }
+        }
+
+        if (done && !pending) {
+          return;
+        }
+        std::this_thread::sleep_for(
+          std::chrono::microseconds(FLAGS_lag_poll_interval_us));
+      }
+    });
+
+  const string value(value_size, 'v');
+  vector<vector<uint64_t>> latencies_us(num_threads);
+  std::atomic<uint64_t> errors(0);
+  vector<thread> threads;
+  const auto start = nowUs();
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&, thread_id = i] {
+        auto& latencies = latencies_us[thread_id];
+        latencies.reserve(FLAGS_writes_per_thread);
+        const WriteOptions options;
+        for (int n = 0; n < FLAGS_writes_per_thread; ++n) {
+          auto& shard = *shards[(thread_id + n) % shards.size()];
+          WriteBatch updates;
+          updates.Put("thread_" + to_string(thread_id) + "_key_" +
+                      to_string(n), value);
+          rocksdb::SequenceNumber seq_no;
+          const auto begin = nowUs();
+          auto code = master->write(shard.name, options, &updates, &seq_no);
+          const auto end = nowUs();
+          latencies.push_back(end - begin);
+          if (code != ReturnCode::OK) {
+            ++errors;
+            continue;
+          }
+
+          if (n % FLAGS_lag_sample_interval == 0) {
+            // writes to the same shard from other threads may be acked out
+            // of the order of their sequence numbers
+            std::lock_guard<std::mutex> g(shard.samples_mutex);
+            for (auto& samples : shard.samples) {
+              auto pos = samples.end();
+              while (pos != samples.begin() && (pos - 1)->seq_no > seq_no) {
+                --pos;
+              }
+              samples.insert(pos, LagSample{seq_no, end});
+            }
+          }
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  const auto end = nowUs();
+
+  // wait for Slaves to catch up
+  bool caught_up = false;
+  const auto deadline = end + FLAGS_catch_up_timeout_sec * 1000000ull;
+  while (!caught_up && nowUs() < deadline) {
+    caught_up = true;
+    for (const auto& shard : shards) {
+      for (const auto& slave : shard->slaves) {
+        if (slave->GetLatestSequenceNumber() <
+            shard->master->GetLatestSequenceNumber()) {
+          caught_up = false;
+        }
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (!caught_up) {
+    LOG(ERROR) << "Slaves failed to catch up in "
+               << FLAGS_catch_up_timeout_sec << " seconds";
+    for (auto& shard : shards) {
+      std::lock_guard<std::mutex> g(shard->samples_mutex);
+      for (auto& samples : shard->samples) {
+        samples.clear();
+      }
+    }
+  }
+  writing.store(false);
+  lag_monitor.join();
+
+  vector<uint64_t> all_latencies_us;
+  for (auto& latencies : latencies_us) {
+    all_latencies_us.insert(all_latencies_us.end(), latencies.begin(),
+                            latencies.end());
+  }
+  const uint64_t num_writes = all_latencies_us.size();
+  const double seconds = std::max<uint64_t>(end - start, 1) / 1000000.0;
+
+  // Slaves first, so that they don't keep pulling from a removed Master.
+  slaves.clear();
+  master.reset();
+
+  return folly::dynamic::object
+    ("replication_mode", mode)
+    ("value_size", value_size)
+    ("num_shards", num_shards)
+    ("num_write_threads", num_threads)
+    ("num_slaves", FLAGS_num_slaves)
+    ("writes", num_writes)
+    ("errors", errors.load())
+    ("seconds", seconds)
+    ("writes_per_sec", num_writes / seconds)
+    ("mb_per_sec", num_writes * value_size / seconds / 1024 / 1024)
+    ("slaves_caught_up", caught_up)
+    ("write_latency_us", percentiles(&all_latencies_us))
+    ("replication_lag_us", percentiles(&lags_us));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK_EQ(system(("mkdir -p " + FLAGS_benchmark_db_path).c_str()), 0);
+
+  auto results = folly::dynamic::array();
+  // Each run listens on its own ports, so that it doesn't wait for ports of
+  // the previous run to be released.
+  auto port = static_cast<uint16_t>(FLAGS_benchmark_base_port);
+  for (auto mode : parseList(FLAGS_replication_modes)) {
+    for (auto value_size : parseList(FLAGS_value_sizes)) {
+      for (auto num_shards : parseList(FLAGS_shard_counts)) {
+        for (auto num_threads : parseList(FLAGS_write_thread_counts)) {
+          results.push_back(runOnce(mode, value_size, num_shards, num_threads,
+                                    port));
+          port += FLAGS_num_slaves + 1;
+        }
+      }
+    }
+  }
+
+  folly::json::serialization_opts opts;
+  opts.pretty_formatting = true;
+  std::cout << folly::json::serialize(results, opts) << std::endl;
+  return 0;
+}
@@ -18,8 +18,73 @@
 
 #include "rocksdb_replicator/replicator_handler.h"
 
+#include <atomic>
+#include <vector>
+
+#include "folly/SocketAddress.h"
+
 namespace replicator {
 
+// A replicateMulti() call waiting for any of its dbs to have updates.
+struct ReplicatorHandler::MultiReplicateCall {
+  std::unique_ptr<apache::thrift::HandlerCallback<
+    std::unique_ptr<MultiReplicateResponse>>> callback;
+  std::unique_ptr<MultiReplicateRequest> request;
+  // dbs[i] serves request->requests[i]
+  std::vector<std::weak_ptr<RocksDBReplicator::ReplicatedDB>> dbs;
+  std::vector<folly::SocketAddress> slaves;
+  std::atomic<bool> replied{false};
+};
+
+void ReplicatorHandler::replyMultiReplicate(
+    std::shared_ptr<MultiReplicateCall> call) {
+  if (call->replied.exchange(true)) {
+    return;
+  }
+
+  MultiReplicateResponse response;
+  const auto& requests = call->request->requests;
+  // the dbs we have sent updates of, and the sequence numbers following them
+  std::vector<std::pair<size_t, rocksdb::SequenceNumber>> sent;
+  std::vector<std::shared_ptr<RocksDBReplicator::ReplicatedDB>> sent_dbs;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const auto& request = requests[i];
+    auto db = call->dbs[i].lock();
+    if (db == nullptr) {
+      ReplicateException e;
+      e.code = ErrorCode::SOURCE_NOT_FOUND;
+      e.msg = "could not find " + request.db_name;
+      response.errors.emplace(request.db_name, std::move(e));
+      continue;
+    }
+
+    if (!db->hasUpdatesAfter(request.seq_no)) {
+      continue;
+    }
+
+    ReplicateResponse db_response;
+    rocksdb::SequenceNumber next_seq_no;
+    auto status = db->buildReplicateResponse(request, &db_response,
+                                             &next_seq_no);
+    if (!status.ok()) {
+      response.errors.emplace(
+        request.db_name,
+        RocksDBReplicator::ReplicatedDB::toReplicateException(status));
+      continue;
+    }
+
+    response.responses.emplace(request.db_name, std::move(db_response));
+    sent.emplace_back(i, next_seq_no);
+    sent_dbs.push_back(std::move(db));
+  }
+
+  call->callback.release()->resultInThread(std::move(response));
+  for (size_t i = 0; i < sent.size(); ++i) {
+    sent_dbs[i]->ackReplicateResponse(call->slaves[sent[i].first],
+                                      sent[i].second);
+  }
+}
+
 #if __GNUC__ >= 8
 void ReplicatorHandler::async_tm_replicate(
 #else
@@ -40,4 +105,165 @@ void ReplicatorHandler::async_eb_replicate(
   db->handleReplicateRequest(std::move(callback), std::move(request));
 }
 
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_replicateMulti(
+#else
+void ReplicatorHandler::async_eb_replicateMulti(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<MultiReplicateResponse>>> callback,
+    std::unique_ptr<MultiReplicateRequest> request) {
+  auto call = std::make_shared<MultiReplicateCall>();
+  const auto& peer = *callback->getConnectionContext()->getPeerAddress();
+  std::vector<std::shared_ptr<RocksDBReplicator::ReplicatedDB>> dbs;
+  bool ready = false;
+  for (const auto& db_request : request->requests) {
+    std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+    if (db_map_->get(db_request.db_name, &db)) {
+      auto slave = RocksDBReplicator::ReplicatedDB::getSlaveAddress(
+        peer, db_request);
+      db->ackReplicateRequest(slave, db_request);
+      ready = ready || db->hasUpdatesAfter(db_request.seq_no);
+      call->slaves.push_back(std::move(slave));
+    } else {
+      ready = true;
+      call->slaves.push_back(peer);
+    }
+    call->dbs.push_back(db);
+    dbs.push_back(std::move(db));
+  }
+  call->callback = std::move(callback);
+  call->request = std::move(request);
+
+  // Wait on all dbs. Whichever of them gets updates first replies, and the
+  // tasks left on the others do nothing when they run. If we can reply now,
+  // one task forced to run right away is enough.
+  const auto timeout = call->request->max_wait_ms;
+  for (size_t i = 0; i < dbs.size(); ++i) {
+    if (dbs[i] == nullptr) {
+      continue;
+    }
+
+    auto seq_no = static_cast<rocksdb::SequenceNumber>(
+      call->request->requests[i].seq_no);
+    std::weak_ptr<RocksDBReplicator::ReplicatedDB> weak_db = dbs[i];
+    dbs[i]->cond_var_.runIfConditionOrWaitForNotify(
+      [call] { replyMultiReplicate(call); },
+      [weak_db = std::move(weak_db), seq_no, ready] {
+        auto db = weak_db.lock();
+        return ready || db == nullptr || db->hasUpdatesAfter(seq_no);
+      },
+      timeout);
+
+    if (ready) {
+      return;
+    }
+  }
+
+  if (ready || dbs.empty()) {
+    // none of the dbs exists
+    replyMultiReplicate(std::move(call));
+  }
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_getCheckpoint(
+#else
+void ReplicatorHandler::async_eb_getCheckpoint(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<GetCheckpointResponse>>> callback,
+    std::unique_ptr<GetCheckpointRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleGetCheckpointRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_readCheckpointFile(
+#else
+void ReplicatorHandler::async_eb_readCheckpointFile(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<ReadCheckpointFileResponse>>> callback,
+    std::unique_ptr<ReadCheckpointFileRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleReadCheckpointFileRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_subscribe(
+#else
+void ReplicatorHandler::async_eb_subscribe(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<SubscribeResponse>>> callback,
+    std::unique_ptr<SubscribeRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleSubscribeRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_push(
+#else
+void ReplicatorHandler::async_eb_push(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<PushResponse>>> callback,
+    std::unique_ptr<PushRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handlePushRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_ack(
+#else
+void ReplicatorHandler::async_eb_ack(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<AckResponse>>> callback,
+    std::unique_ptr<AckRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleAckRequest(std::move(callback), std::move(request));
+}
+
 }  // namespace replicator
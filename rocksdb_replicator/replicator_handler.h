@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include "rocksdb_replicator/fast_read_map.h"
@@ -42,7 +43,65 @@ class ReplicatorHandler : public ReplicatorSvIf {
         std::unique_ptr<ReplicateResponse>>> callback,
       std::unique_ptr<ReplicateRequest> request) override;
 
+#if __GNUC__ >= 8
+  void async_tm_replicateMulti(
+#else
+  void async_eb_replicateMulti(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<MultiReplicateResponse>>> callback,
+      std::unique_ptr<MultiReplicateRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_getCheckpoint(
+#else
+  void async_eb_getCheckpoint(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<GetCheckpointResponse>>> callback,
+      std::unique_ptr<GetCheckpointRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_readCheckpointFile(
+#else
+  void async_eb_readCheckpointFile(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<ReadCheckpointFileResponse>>> callback,
+      std::unique_ptr<ReadCheckpointFileRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_subscribe(
+#else
+  void async_eb_subscribe(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<SubscribeResponse>>> callback,
+      std::unique_ptr<SubscribeRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_push(
+#else
+  void async_eb_push(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<PushResponse>>> callback,
+      std::unique_ptr<PushRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_ack(
+#else
+  void async_eb_ack(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<AckResponse>>> callback,
+      std::unique_ptr<AckRequest> request) override;
+
  private:
+  struct MultiReplicateCall;
+  // Reply to call with updates of its dbs, unless it has been replied.
+  static void replyMultiReplicate(std::shared_ptr<MultiReplicateCall> call);
+
   DBMapType* db_map_;
 };
 
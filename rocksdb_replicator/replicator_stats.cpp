@@ -39,6 +39,44 @@ const std::string kReplicatorGetUpdatesSinceErrors =
 const std::string kReplicatorGetUpdatesSinceMs =
   "replicator_get_update_since_ms";
 const std::string kReplicatorWriteMs = "replicator_write_ms";
+const std::string kReplicatorApplyMs = "replicator_apply_ms";
+const std::string kReplicatorPushErrors = "replicator_push_errors";
+const std::string kReplicatorOutCompressedBytes =
+  "replicator_out_compressed_bytes";
+const std::string kReplicatorDecompressionErrors =
+  "replicator_decompression_errors";
+const std::string kReplicatorRecentUpdatesHits =
+  "replicator_recent_updates_hits";
+const std::string kReplicatorRecentUpdatesMisses =
+  "replicator_recent_updates_misses";
+const std::string kReplicatorServeQueueDepth = "replicator_serve_queue_depth";
+const std::string kReplicatorServeQueueMs = "replicator_serve_queue_ms";
+const std::string kReplicatorApplyQueueDepth = "replicator_apply_queue_depth";
+const std::string kReplicatorApplyQueueMs = "replicator_apply_queue_ms";
+const std::string kReplicatorWALPurgedErrors = "replicator_wal_purged_errors";
+const std::string kReplicatorCheckpointErrors = "replicator_checkpoint_errors";
+const std::string kReplicatorCheckpointOutBytes =
+  "replicator_checkpoint_out_bytes";
+const std::string kReplicatorCheckpointInBytes =
+  "replicator_checkpoint_in_bytes";
+const std::string kReplicatorWritesThrottled = "replicator_writes_throttled";
+const std::string kReplicatorWriteThrottleMs = "replicator_write_throttle_ms";
+const std::string kReplicatorTimestampScans = "replicator_timestamp_scans";
+const std::string kReplicatorReadFenceTimeouts =
+  "replicator_read_fence_timeouts";
+const std::string kReplicatorAckErrors = "replicator_ack_errors";
+const std::string kReplicatorCatchUpServeQueueDepth =
+  "replicator_catch_up_serve_queue_depth";
+const std::string kReplicatorCatchUpServeQueueMs =
+  "replicator_catch_up_serve_queue_ms";
+const std::string kReplicatorCatchUpRequests = "replicator_catch_up_requests";
+const std::string kReplicatorCatchUpThrottleMs =
+  "replicator_catch_up_throttle_ms";
+const std::string kReplicatorUpstreamChanges = "replicator_upstream_changes";
+const std::string kReplicatorUpstreamFailovers =
+  "replicator_upstream_failovers";
+const std::string kReplicatorOutOfOrderUpdates =
+  "replicator_out_of_order_updates";
 
 
 void logMetric(const std::string& metric_name, int64_t value,
@@ -31,6 +31,32 @@ extern const std::string kReplicatorRemoteApplicationExceptions;
 extern const std::string kReplicatorGetUpdatesSinceErrors;
 extern const std::string kReplicatorGetUpdatesSinceMs;
 extern const std::string kReplicatorWriteMs;
+extern const std::string kReplicatorApplyMs;
+extern const std::string kReplicatorPushErrors;
+extern const std::string kReplicatorOutCompressedBytes;
+extern const std::string kReplicatorDecompressionErrors;
+extern const std::string kReplicatorRecentUpdatesHits;
+extern const std::string kReplicatorRecentUpdatesMisses;
+extern const std::string kReplicatorServeQueueDepth;
+extern const std::string kReplicatorServeQueueMs;
+extern const std::string kReplicatorApplyQueueDepth;
+extern const std::string kReplicatorApplyQueueMs;
+extern const std::string kReplicatorWALPurgedErrors;
+extern const std::string kReplicatorCheckpointErrors;
+extern const std::string kReplicatorCheckpointOutBytes;
+extern const std::string kReplicatorCheckpointInBytes;
+extern const std::string kReplicatorWritesThrottled;
+extern const std::string kReplicatorWriteThrottleMs;
+extern const std::string kReplicatorTimestampScans;
+extern const std::string kReplicatorReadFenceTimeouts;
+extern const std::string kReplicatorAckErrors;
+extern const std::string kReplicatorCatchUpServeQueueDepth;
+extern const std::string kReplicatorCatchUpServeQueueMs;
+extern const std::string kReplicatorCatchUpRequests;
+extern const std::string kReplicatorCatchUpThrottleMs;
+extern const std::string kReplicatorUpstreamChanges;
+extern const std::string kReplicatorUpstreamFailovers;
+extern const std::string kReplicatorOutOfOrderUpdates;
 
 
 // add value to metric_name. If db_name is not empty, add value to the per db
@@ -20,9 +20,14 @@
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include "folly/json.h"
 #include "rocksdb_replicator/replicator_handler.h"
+#include "rocksdb_replicator/replicator_stats.h"
 #if __GNUC__ >= 8
 #include "folly/executors/CPUThreadPoolExecutor.h"
 #include "folly/executors/IOThreadPoolExecutor.h"
@@ -40,11 +45,33 @@ DEFINE_int32(num_replicator_io_threads, 8,
 DEFINE_int32(rocksdb_replicator_executor_threads, 32,
              "The number of rocksplicator executor threads.");
 
+DEFINE_int32(rocksdb_replicator_apply_threads, 16,
+             "The number of threads applying updates from upstream to Slave "
+             "dbs. They are separate from the executor threads, so that "
+             "Slaves catching up don't hold back serving downstream.");
+
+DEFINE_bool(replicator_multiplex_pull, false,
+            "If true, Slaves replicating from the same upstream pull updates "
+            "with one replicateMulti() call for many dbs, instead of one "
+            "replicate() call per db. It is only used if "
+            "replicator_pull_window_size is 1 and replicator_push_mode is "
+            "false.");
+
 namespace replicator {
 
 RocksDBReplicator::RocksDBReplicator()
-    : executor_()
+    : RocksDBReplicator(static_cast<uint16_t>(FLAGS_rocksdb_replicator_port)) {
+}
+
+RocksDBReplicator::RocksDBReplicator(uint16_t port)
+    : monitored_executor_()
+    , monitored_catch_up_executor_()
+    , monitored_apply_executor_()
+    , multi_puller_()
+    , executor_()
+    , apply_executor_()
     , client_pool_(FLAGS_num_replicator_io_threads)
+    , port_(port)
     , db_map_()
 #if __GNUC__ >= 8
     , server_()
@@ -59,14 +86,40 @@ RocksDBReplicator::RocksDBReplicator()
   executor_ = std::make_unique<wangle::CPUThreadPoolExecutor>(
 #endif
     std::max(FLAGS_rocksdb_replicator_executor_threads, 16),
+    // one for catch-up requests, and the other for everything else
+    2,
 #if __GNUC__ >= 8
     std::make_shared<folly::NamedThreadFactory>("rptor-worker-"));
 #else
     std::make_shared<wangle::NamedThreadFactory>("rptor-worker-"));
 #endif
 
+#if __GNUC__ >= 8
+  apply_executor_ = std::make_unique<folly::CPUThreadPoolExecutor>(
+    std::max(FLAGS_rocksdb_replicator_apply_threads, 1),
+    std::make_shared<folly::NamedThreadFactory>("rptor-apply-"));
+#else
+  apply_executor_ = std::make_unique<wangle::CPUThreadPoolExecutor>(
+    std::max(FLAGS_rocksdb_replicator_apply_threads, 1),
+    std::make_shared<wangle::NamedThreadFactory>("rptor-apply-"));
+#endif
+
+  monitored_executor_ = std::make_unique<detail::MonitoredExecutor>(
+    executor_.get(), kReplicatorServeQueueDepth, kReplicatorServeQueueMs);
+  monitored_catch_up_executor_ = std::make_unique<detail::MonitoredExecutor>(
+    executor_.get(), kReplicatorCatchUpServeQueueDepth,
+    kReplicatorCatchUpServeQueueMs, folly::Executor::LO_PRI);
+  monitored_apply_executor_ = std::make_unique<detail::MonitoredExecutor>(
+    apply_executor_.get(), kReplicatorApplyQueueDepth,
+    kReplicatorApplyQueueMs);
+
+  if (FLAGS_replicator_multiplex_pull) {
+    multi_puller_ = std::make_unique<MultiPuller>(monitored_executor_.get(),
+                                                  &client_pool_);
+  }
+
   server_.setInterface(std::make_unique<ReplicatorHandler>(&db_map_));
-  server_.setPort(FLAGS_rocksdb_replicator_port);
+  server_.setPort(port_);
 #if __GNUC__ >= 8
   auto io_thread_pool = std::make_shared<folly::IOThreadPoolExecutor>(
     0, std::make_shared<folly::NamedThreadFactory>("rptor-svr-io-"));
@@ -85,6 +138,11 @@ RocksDBReplicator::RocksDBReplicator()
     });
 }
 
+std::unique_ptr<RocksDBReplicator> RocksDBReplicator::newInstance(
+    uint16_t port) {
+  return std::unique_ptr<RocksDBReplicator>(new RocksDBReplicator(port));
+}
+
 RocksDBReplicator::~RocksDBReplicator() {
   db_map_.clear();
   cleaner_.stopAndWait();
@@ -96,10 +154,14 @@ ReturnCode RocksDBReplicator::addDB(const std::string& db_name,
                                     std::shared_ptr<rocksdb::DB> db,
                                     const DBRole role,
                                     const folly::SocketAddress& upstream_addr,
-                                    ReplicatedDB** replicated_db) {
+                                    ReplicatedDB** replicated_db,
+                                    const ReplicatedDBOptions& options) {
   std::shared_ptr<ReplicatedDB> new_db(
-    new ReplicatedDB(db_name, std::move(db), executor_.get(),
-                     role, upstream_addr, &client_pool_));
+    new ReplicatedDB(db_name, std::move(db), monitored_executor_.get(),
+                     monitored_catch_up_executor_.get(),
+                     monitored_apply_executor_.get(),
+                     role, upstream_addr, &client_pool_, multi_puller_.get(),
+                     port_, options));
 
   if (!db_map_.add(db_name, new_db)) {
     return ReturnCode::DB_PRE_EXIST;
@@ -156,9 +218,83 @@ ReturnCode RocksDBReplicator::write(const std::string& db_name,
   }
 }
 
+folly::Future<ReturnCode> RocksDBReplicator::writeAsync(
+    const std::string& db_name,
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  std::shared_ptr<ReplicatedDB> db;
+  if (!db_map_.get(db_name, &db)) {
+    return folly::makeFuture(ReturnCode::DB_NOT_FOUND);
+  }
+
+  try {
+    return db->WriteAsync(options, updates, seq_no);
+  } catch (const ReturnCode code) {
+    return folly::makeFuture(code);
+  }
+}
+
 std::string RocksDBReplicator::getTextStats() {
-  // TODO(bol) add stats
-  return "TBD";
+  auto dbs = db_map_.getAll();
+  std::vector<std::string> db_names;
+  db_names.reserve(dbs->size());
+  for (const auto& db : *dbs) {
+    db_names.push_back(db.first);
+  }
+  std::sort(db_names.begin(), db_names.end());
+
+  std::stringstream output;
+  for (const auto& db_name : db_names) {
+    auto stats = dbs->at(db_name)->getStats();
+    const auto tag = " db=" + db_name;
+    output << "  replicator_role" << tag << " role="
+           << stats["role"].asString();
+    if (stats.count("upstream")) {
+      output << " upstream=" << stats["upstream"].asString();
+    }
+    output << ": 1\n";
+
+    for (const auto& slave_ack : stats["slave_acks"].items()) {
+      output << "  replicator_slave_ack_seq_no" << tag << " slave="
+             << slave_ack.first.asString() << ": " << slave_ack.second.asInt()
+             << "\n";
+    }
+
+    for (const auto& stat : stats.items()) {
+      if (stat.second.isInt()) {
+        output << "  replicator_" << stat.first.asString() << tag << ": "
+               << stat.second.asInt() << "\n";
+      }
+    }
+  }
+
+  return output.str();
+}
+
+std::string RocksDBReplicator::getJsonStats() {
+  auto stats = folly::dynamic::object();
+  auto dbs = db_map_.getAll();
+  for (const auto& db : *dbs) {
+    stats[db.first] = db.second->getStats();
+  }
+
+  folly::json::serialization_opts opts;
+  opts.pretty_formatting = true;
+  opts.sort_keys = true;
+  return folly::json::serialize(stats, opts);
+}
+
+void RocksDBReplicator::addStatusEndpoints(
+    common::StatusServer::EndPointToOPMap* op_map) {
+  op_map->emplace("/replicator_stats.txt",
+                  [] (const common::StatusServer::Arguments*) {
+                    return instance()->getTextStats();
+                  });
+  op_map->emplace("/replicator_stats.json",
+                  [] (const common::StatusServer::Arguments*) {
+                    return instance()->getJsonStats();
+                  });
 }
 
 }  // namespace replicator
@@ -20,20 +20,33 @@
 
 #include <folly/io/async/EventBase.h>
 
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "common/stats/status_server.h"
 #include "common/thrift_client_pool.h"
+#include "rocksdb_replicator/batch_size_controller.h"
 #include "rocksdb_replicator/fast_read_map.h"
 #include "rocksdb_replicator/max_number_box.h"
+#include "rocksdb_replicator/monitored_executor.h"
 #include "rocksdb_replicator/non_blocking_condition_variable.h"
+#include "rocksdb_replicator/rate_limiter.h"
+#include "rocksdb_replicator/recent_updates.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
+#include "rocksdb_replicator/upstream_resolver.h"
 #include "folly/SocketAddress.h"
+#include "folly/dynamic.h"
+#include "folly/futures/Future.h"
 #include "rocksdb/db.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
 
@@ -52,16 +65,20 @@ namespace wangle {
 namespace replicator {
 
 /*
- * An extractor to extract update time from an update
+ * An extractor to extract update time from an update, which is the last 8
+ * byte LogData record of it. LogData records of other sizes are skipped, so
+ * that more replication metadata may be added in the future.
+ * ms is 0 if the update doesn't have a timestamp.
  */
 struct LogExtractor : public rocksdb::WriteBatch::Handler {
  public:
   void LogData(const rocksdb::Slice& blob) override {
-    CHECK(blob.size() == sizeof(ms));
-    memcpy(&ms, blob.data(), sizeof(ms));
+    if (blob.size() == sizeof(ms)) {
+      memcpy(&ms, blob.data(), sizeof(ms));
+    }
   }
 
-  uint64_t ms;
+  uint64_t ms = 0;
 };
 
 enum class DBRole {
@@ -77,16 +94,74 @@ enum class ReturnCode {
   WRITE_TO_SLAVE = 3,
   WRITE_ERROR = 4,
   WAIT_SLAVE_TIMEOUT = 5,
+  // Slaves have fallen too far behind, the write may be retried later.
+  WRITE_THROTTLED = 6,
+  // The db hasn't caught up with the sequence number a read asks for in
+  // time. The read may be retried later or on another replica.
+  READ_TIMEOUT = 7,
+};
+
+/*
+ * Per db options for replication.
+ */
+struct ReplicatedDBOptions {
+  // SLAVE only. If true, updates applied from upstream are synced to disk.
+  // Updates in one response are applied with a single write, so this costs
+  // one fsync per response.
+  bool sync_apply = false;
+
+  // MASTER only. The replication mode of this db, which has the same meaning
+  // as the replicator_replication_mode flag. A negative value means using the
+  // flag.
+  int32_t replication_mode = -1;
+
+  // MASTER only. In replication mode 1 and 2, the number of Slaves that need
+  // to get back to us before a write is acked.
+  int32_t ack_quorum = 1;
+
+  // MASTER only. The lag budget of the fastest Slave, in sequence numbers
+  // and in milliseconds since the oldest update it hasn't committed was
+  // written. 0 disables each of them. Once the lag exceeds the budget,
+  // Write() is delayed more and more, up to
+  // replicator_throttle_max_delay_ms at twice the budget, beyond which
+  // writes fail with WRITE_THROTTLED. WriteAsync() doesn't wait, and fails
+  // as soon as the lag exceeds the budget. Slaves not heard from within
+  // replicator_slave_expire_ms don't count, and writes are not throttled if
+  // no Slave is left.
+  uint64_t max_lag_seq_no = 0;
+  uint64_t max_lag_ms = 0;
+
+  // SLAVE only. If set, a Slave which has fallen behind the WAL of its
+  // upstream downloads a checkpoint of the upstream db, and then calls this
+  // with the db name and the local checkpoint directory. It is expected to
+  // replace the db with the checkpoint, e.g. by removing the db from the
+  // library, opening the checkpoint as the new db and adding it back. It is
+  // called without the library holding any reference to the db. The Slave
+  // doesn't pull until it returns, and resumes pulling afterwards if the db
+  // is still there.
+  // If not set, the Slave keeps retrying to pull from upstream.
+  std::function<void(const std::string& db_name,
+                     const std::string& checkpoint_dir)>
+    on_checkpoint_downloaded;
+
+  // SLAVE only. If set, the Slave replicates from the Master it resolves to
+  // instead of the upstream it is added with, and re-points itself whenever
+  // the resolver changes its mind. When the upstream is unreachable, the
+  // Slave fails over to the most caught-up peer, and goes back to the Master
+  // once it is reachable again.
+  std::shared_ptr<UpstreamResolver> upstream_resolver;
 };
 
 /*
  * All public interfaces of RocksDBReplicator are thread safe.
  */
 class RocksDBReplicator {
+  class MultiPuller;
+
  public:
   class ReplicatedDB : public std::enable_shared_from_this<ReplicatedDB> {
    public:
-    // Similar to rocksdb::DB::Write(). Only two differences:
+    // Similar to rocksdb::DB::Write(). Only four differences:
     // 1) seq_no, it will be filled with a sequence # after applying the
     // updates. This is useful to implement read-after-write consistency at
     // higher level.
@@ -95,53 +170,421 @@ class RocksDBReplicator {
     // enabled, and no slave gets back to us in time. In this case, the update
     // is guaranteed to be committed to Master. Slaves may or may not have got
     // the update.
+    // 4) WRITE_THROTTLED will be thrown if Slaves are too far behind, see
+    // ReplicatedDBOptions::max_lag_seq_no. The update is not applied.
     rocksdb::Status Write(const rocksdb::WriteOptions& options,
                           rocksdb::WriteBatch* updates,
                           rocksdb::SequenceNumber* seq_no = nullptr);
 
-    // read APIs may be added later on demand. They can be simply implmented by
-    // delegating to the internal rocksdb::DB object.
+    // Similar to Write(), but doesn't block the calling thread waiting for
+    // slaves in replication mode 1 and 2. updates are committed to the local
+    // db and seq_no is filled before it returns. The returned future is
+    // fulfilled with OK once slaves have got the updates, WAIT_SLAVE_TIMEOUT
+    // if none of them gets back to us in time, or WRITE_ERROR right away if
+    // the local write fails.
+    // WRITE_TO_SLAVE will be thrown if this is a SLAVE db, and
+    // WRITE_THROTTLED if Slaves are too far behind.
+    folly::Future<ReturnCode> WriteAsync(
+      const rocksdb::WriteOptions& options,
+      rocksdb::WriteBatch* updates,
+      rocksdb::SequenceNumber* seq_no = nullptr);
+
+    // Read APIs with a sequence number fence, for read-after-write
+    // consistency on Slaves. A read only runs once the local db has
+    // committed all updates up to min_seq_no, e.g. the seq_no a Write() to
+    // the Master has returned, so it sees them. The calling thread is not
+    // blocked waiting for that. The returned future is fulfilled with OK once
+    // the read is done, with the rocksdb::Status of the read in status(es),
+    // or with READ_TIMEOUT if the db doesn't catch up in timeout_ms. Reads
+    // run right away in the calling thread if the db has caught up already,
+    // otherwise in the executor serving the Replicator.
+    // The arguments must stay valid until the future is fulfilled.
+    folly::Future<ReturnCode> GetAsync(const rocksdb::ReadOptions& options,
+                                       const rocksdb::Slice& key,
+                                       std::string* value,
+                                       rocksdb::Status* status,
+                                       rocksdb::SequenceNumber min_seq_no,
+                                       uint64_t timeout_ms);
+    folly::Future<ReturnCode> MultiGetAsync(
+      const rocksdb::ReadOptions& options,
+      const std::vector<rocksdb::Slice>& keys,
+      std::vector<std::string>* values,
+      std::vector<rocksdb::Status>* statuses,
+      rocksdb::SequenceNumber min_seq_no,
+      uint64_t timeout_ms);
+    // iter is set to an iterator over a view of the db including all updates
+    // up to min_seq_no.
+    folly::Future<ReturnCode> NewIteratorAsync(
+      const rocksdb::ReadOptions& options,
+      std::unique_ptr<rocksdb::Iterator>* iter,
+      rocksdb::SequenceNumber min_seq_no,
+      uint64_t timeout_ms);
+
+    // The building block of the read APIs above. The returned future is
+    // fulfilled with true once the local db has committed all updates up to
+    // seq_no, or with false if it doesn't in timeout_ms.
+    folly::Future<bool> WaitForSeqNo(rocksdb::SequenceNumber seq_no,
+                                     uint64_t timeout_ms);
+
+    ~ReplicatedDB();
 
    private:
     ReplicatedDB(const std::string& db_name,
                  std::shared_ptr<rocksdb::DB> db,
                  folly::Executor* executor,
+                 folly::Executor* catch_up_executor,
+                 folly::Executor* apply_executor,
                  const DBRole role,
                  const folly::SocketAddress& upstream_addr
                  = folly::SocketAddress(),
                  common::ThriftClientPool<ReplicatorAsyncClient>* client_pool
-                 = nullptr);
-
+                 = nullptr,
+                 MultiPuller* multi_puller = nullptr,
+                 const uint16_t port = 0,
+                 const ReplicatedDBOptions& options = ReplicatedDBOptions());
+
+    // Fulfill promise with true once db_ has committed seq_no, or with false
+    // at deadline_ms.
+    void waitForSeqNoUntil(rocksdb::SequenceNumber seq_no,
+                           uint64_t deadline_ms,
+                           std::shared_ptr<folly::Promise<bool>> promise);
+    // Write updates to db_ and fill seq_no without waiting for slaves.
+    rocksdb::Status writeToDB(const rocksdb::WriteOptions& options,
+                              rocksdb::WriteBatch* updates,
+                              rocksdb::SequenceNumber* seq_no);
+    // Return true if writes need to wait for slaves' acks.
+    bool waitForSlaves() const;
+    int32_t replicationMode() const;
+    // Record that slave has got all updates up to seq_no, which are acked
+    // once ack_quorum slaves have got them. Slaves with port 0 only count if
+    // ack_quorum is 1.
+    void ackUpdates(const folly::SocketAddress& slave,
+                    rocksdb::SequenceNumber seq_no);
+
+    // Request updates from upstream, by either polling it or subscribing to
+    // it depending on push_mode_. Pull requests are only sent for ranges of
+    // sequence numbers not asked for yet, so it is fine to call it anytime.
     void pullFromUpstream();
+    // Pick where the pull requests to send next start from, and record them
+    // as outstanding. The caller needs to hold pull_mutex_.
+    std::vector<rocksdb::SequenceNumber> pickPullsToSend();
+    // Move the responses continuing from next_pull_seq_no_ to
+    // responses_to_apply_, without the updates received already. The caller
+    // needs to hold pull_mutex_.
+    void mergeReceivedResponses();
+    // Called with the response to a pull request for updates after seq_no.
+    void handleReplicateResponse(rocksdb::SequenceNumber seq_no,
+                                 folly::Try<ReplicateResponse>&& t);
+    // Give up the outstanding pull request for updates after seq_no, and send
+    // it again right away.
+    void pullAgain(rocksdb::SequenceNumber seq_no);
+    void subscribeToUpstream();
+    void handleSubscribeResponse(folly::Try<SubscribeResponse>&& t);
+    // Apply queued responses in order until the queue is drained.
+    void applyPendingResponses();
+    // Run applyPendingResponses() in apply_executor_.
+    void scheduleApply();
+    // Return false if the updates were not fully applied.
+    bool applyUpdates(ReplicateResponse* response);
+    void delayNextPull();
+    folly::SocketAddress upstreamAddr() const;
+    std::shared_ptr<ReplicatorAsyncClient> upstreamClient() const;
+    // Reconnect to upstream, e.g. after a connection error
+    void resetUpstreamClient();
+    void setUpstream(const folly::SocketAddress& upstream_addr);
+    // Re-point to the Master options_.upstream_resolver resolves to, if it
+    // has changed, or if we failed over to a peer a while ago. With force,
+    // the Master is resolved even if nothing has changed.
+    // Return true if upstream is changed.
+    bool followResolvedMaster(bool force);
+    // Called when upstream is unreachable. Re-point to the Master if it has
+    // moved, or otherwise to the most caught-up peer. Return false if there
+    // is nowhere to go, and the caller is expected to retry later.
+    bool failOver();
+    void handlePeerProbes(std::vector<folly::SocketAddress> peers,
+                          std::vector<folly::Try<ReplicateResponse>>&& probes);
+    // Delay the calling thread if the fastest Slave lags behind beyond
+    // options_.max_lag_seq_no or options_.max_lag_ms. Throw WRITE_THROTTLED
+    // if the lag is too large to wait for, or if can_delay is false.
+    void throttleWrite(bool can_delay);
+    // How much the lag of the fastest Slave exceeds the budget, relative to
+    // the budget. Not positive if it is within the budget.
+    double lagOverBudget();
+    // Slaves have committed updates up to seq_no.
+    void recordSlaveSeqNo(const folly::SocketAddress& slave,
+                          rocksdb::SequenceNumber seq_no);
+    // The largest sequence number committed by any Slave heard from within
+    // replicator_slave_expire_ms, -1 if there is none. Slaves not heard
+    // from for longer are forgotten.
+    int64_t fastestSlaveSeqNo();
+    // Record when the update of seq_no was written.
+    void recordWriteTime(rocksdb::SequenceNumber seq_no, uint64_t ms);
+    // Record the latest sequence number of upstream told by it.
+    void updateUpstreamSeqNo(rocksdb::SequenceNumber seq_no);
+    // The replication state of *this, keyed by stat names.
+    folly::dynamic getStats();
+    // Wake up pending replicate requests and subscribers after new updates
+    // are committed to db_.
+    void notifyNewUpdates();
+    // Read at most max_updates updates or about max_bytes bytes starting from
+    // seq_no into updates. 0 means no limit for both of them.
+    // next_seq_no is set to the sequence number following the last update.
+    rocksdb::Status readUpdates(rocksdb::SequenceNumber seq_no,
+                                int32_t max_updates,
+                                int64_t max_bytes,
+                                std::vector<Update>* updates,
+                                rocksdb::SequenceNumber* next_seq_no);
+    // Compress updates with type if it is worth it. Return true if updates
+    // are moved into compressed.
+    bool compressUpdates(CompressionType type,
+                         std::vector<Update>* updates,
+                         CompressedUpdates* compressed);
     using CallbackType =
       apache::thrift::HandlerCallback<std::unique_ptr<ReplicateResponse>>;
     void handleReplicateRequest(std::unique_ptr<CallbackType> callback,
                                 std::unique_ptr<ReplicateRequest> request);
+    // Build the response to request and reply with it. Replies to catch-up
+    // requests are delayed as needed to stay within the catch-up rate limits.
+    void serveReplicateRequest(std::unique_ptr<CallbackType> callback,
+                               std::unique_ptr<ReplicateRequest> request,
+                               const folly::SocketAddress& slave,
+                               bool catch_up);
+    // If a request for updates after seq_no is for catching up from far
+    // behind.
+    bool isCatchUp(rocksdb::SequenceNumber seq_no) const;
+    // The address the Slave sending request is identified by. Its port is 0
+    // if request doesn't tell it.
+    static folly::SocketAddress getSlaveAddress(
+      const folly::SocketAddress& peer,
+      const ReplicateRequest& request);
+    // Ack updates the Slave has reported to have got in request.
+    void ackReplicateRequest(const folly::SocketAddress& slave,
+                             const ReplicateRequest& request);
+    // Ack updates up to next_seq_no which have been sent to the Slave.
+    void ackReplicateResponse(const folly::SocketAddress& slave,
+                              rocksdb::SequenceNumber next_seq_no);
+    bool hasUpdatesAfter(rocksdb::SequenceNumber seq_no) const;
+    // Read updates request asks for into response. next_seq_no is set to the
+    // sequence number following the last update in it.
+    rocksdb::Status buildReplicateResponse(
+      const ReplicateRequest& request,
+      ReplicateResponse* response,
+      rocksdb::SequenceNumber* next_seq_no);
+    static ReplicateException toReplicateException(
+      const rocksdb::Status& status);
+
+    // Master side of bootstrapping Slaves from checkpoints, which are
+    // implemented in checkpoint.cpp
+    using GetCheckpointCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<GetCheckpointResponse>>;
+    void handleGetCheckpointRequest(
+      std::unique_ptr<GetCheckpointCallbackType> callback,
+      std::unique_ptr<GetCheckpointRequest> request);
+    using ReadCheckpointFileCallbackType = apache::thrift::HandlerCallback<
+      std::unique_ptr<ReadCheckpointFileResponse>>;
+    void handleReadCheckpointFileRequest(
+      std::unique_ptr<ReadCheckpointFileCallbackType> callback,
+      std::unique_ptr<ReadCheckpointFileRequest> request);
+    void readCheckpointFile(
+      std::unique_ptr<ReadCheckpointFileCallbackType> callback,
+      std::unique_ptr<ReadCheckpointFileRequest> request);
+    // Create a checkpoint unless there is one already. Fill response with it.
+    rocksdb::Status getCheckpoint(GetCheckpointResponse* response);
+    // Remove the checkpoint if it has been kept for long enough.
+    void cleanExpiredCheckpoint();
+    std::string checkpointBaseDir() const;
+
+    // Slave side of bootstrapping from a checkpoint of upstream
+    struct CheckpointDownload {
+      std::string checkpoint_id;
+      std::vector<CheckpointFile> files;
+      // the file being downloaded, and its size downloaded so far
+      size_t file_index;
+      int64_t offset;
+      std::string dir;
+      std::unique_ptr<rocksdb::WritableFile> file;
+    };
+    void bootstrapFromUpstream();
+    // Give up the current download, and pull again later.
+    void bootstrapFailed();
+    void handleGetCheckpointResponse(folly::Try<GetCheckpointResponse>&& t);
+    // Download the rest of the checkpoint, starting from the current file.
+    void downloadCheckpoint(std::shared_ptr<CheckpointDownload> download);
+    void handleReadCheckpointFileResponse(
+      std::shared_ptr<CheckpointDownload> download,
+      folly::Try<ReadCheckpointFileResponse>&& t);
+    void checkpointDownloaded(std::shared_ptr<CheckpointDownload> download);
+
+    using SubscribeCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<SubscribeResponse>>;
+    void handleSubscribeRequest(std::unique_ptr<SubscribeCallbackType> callback,
+                                std::unique_ptr<SubscribeRequest> request);
+    using PushCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<PushResponse>>;
+    void handlePushRequest(std::unique_ptr<PushCallbackType> callback,
+                           std::unique_ptr<PushRequest> request);
+    using AckCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<AckResponse>>;
+    void handleAckRequest(std::unique_ptr<AckCallbackType> callback,
+                          std::unique_ptr<AckRequest> request);
+    // Tell upstream what we have committed, if it asked for it with
+    // ReplicateResponse::ack_requested.
+    void ackUpstream();
     std::unique_ptr<rocksdb::TransactionLogIterator> getCachedIter(
         rocksdb::SequenceNumber seq_no);
     void putCachedIter(rocksdb::SequenceNumber seq_no,
                        std::unique_ptr<rocksdb::TransactionLogIterator>);
     void cleanIdleCachedIters();
 
+    // A downstream db subscribed to *this. Its fields are protected by
+    // subscribers_mutex_.
+    struct Subscriber {
+      folly::SocketAddress addr;
+      std::shared_ptr<ReplicatorAsyncClient> client;
+      // completed when the subscription ends
+      std::unique_ptr<SubscribeCallbackType> callback;
+      // the largest sequence number pushed to the subscriber
+      rocksdb::SequenceNumber seq_no;
+      // number of push() calls we may send before hearing back
+      int32_t credits;
+      // a push is being prepared
+      bool reading;
+      // new updates were committed while reading
+      bool more_updates;
+      bool ended;
+      // the codec the subscriber accepts
+      CompressionType compression;
+    };
+    void pushToSubscribers();
+    void pushToSubscriber(std::shared_ptr<Subscriber> subscriber);
+    void doPush(std::shared_ptr<Subscriber> subscriber);
+    void handlePushResponse(std::shared_ptr<Subscriber> subscriber,
+                            folly::Try<PushResponse>&& t);
+    // End the subscription with e, or normally if e is nullptr.
+    void endSubscription(std::shared_ptr<Subscriber> subscriber,
+                         const ReplicateException* e = nullptr);
+
     const std::string db_name_;
     std::shared_ptr<rocksdb::DB> db_;
+    // serves requests from downstream, and receives responses from upstream
     folly::Executor* const executor_;
+    // serves replicate requests far behind the tip of db_, at a lower
+    // priority than executor_
+    folly::Executor* const catch_up_executor_;
+    // applies updates received from upstream
+    folly::Executor* const apply_executor_;
     const DBRole role_;
-    const folly::SocketAddress upstream_addr_;
+    // upstream_addr_ and client_ change when the Slave is re-pointed to
+    // another upstream, upstream_mutex_ protects both of them.
+    mutable std::mutex upstream_mutex_;
+    folly::SocketAddress upstream_addr_;
     common::ThriftClientPool<ReplicatorAsyncClient>* const client_pool_;
+    // If not nullptr, pull requests are sent through it together with those
+    // of other dbs replicating from the same upstream.
+    MultiPuller* const multi_puller_;
+    const uint16_t port_;
+    const ReplicatedDBOptions options_;
     std::shared_ptr<ReplicatorAsyncClient> client_;
     detail::NonBlockingConditionVariable cond_var_;
+    // bandwidth of updates sent to catch-up requests of this db
+    detail::RateLimiter catch_up_rate_limiter_;
     apache::thrift::RpcOptions rpc_options_;
     rocksdb::WriteOptions write_options_;
     std::unordered_multimap<rocksdb::SequenceNumber,
       std::pair<std::unique_ptr<rocksdb::TransactionLogIterator>,
                 uint64_t>> cached_iters_;
     std::mutex cached_iters_mutex_;
+    detail::RecentUpdates recent_updates_;
     detail::MaxNumberBox max_seq_no_acked_;
+    // Where each Slave is and when we last heard from it, used for
+    // throttling writes if the fastest Slave lags too far behind.
+    struct SlavePosition {
+      // the largest sequence number the Slave has committed
+      rocksdb::SequenceNumber seq_no;
+      // when the Slave last got back to us
+      uint64_t heard_ms;
+    };
+    std::mutex slave_positions_mutex_;
+    std::unordered_map<folly::SocketAddress, SlavePosition> slave_positions_;
+    // Samples of (sequence number, ms) of writes, in the order of sequence
+    // numbers, for telling how long ago the oldest update a Slave hasn't
+    // committed was written.
+    std::mutex write_times_mutex_;
+    std::deque<std::pair<rocksdb::SequenceNumber, uint64_t>> write_times_;
+    // The largest sequence number each Slave has got back to us with, used if
+    // ack_quorum is larger than 1. Slaves not heard from within
+    // replicator_slave_expire_ms are dropped.
+    struct SlaveAck {
+      rocksdb::SequenceNumber seq_no;
+      // when the Slave last got back to us
+      uint64_t heard_ms;
+    };
+    std::mutex slave_acks_mutex_;
+    std::unordered_map<folly::SocketAddress, SlaveAck> slave_acks_;
+
+    // Slave side pull pipeline. pull_mutex_ protects all fields below.
+    // A Slave catching up keeps up to replicator_pull_window_size pull
+    // requests outstanding, each for the range of sequence numbers following
+    // the one expected of the previous request. Responses may arrive out of
+    // order, cover less or more than expected, and are applied in order.
+    // pulls_in_flight_ maps the sequence number each outstanding request
+    // starts after to the one it is expected to cover up to, and pull_stride_
+    // is how many sequence numbers the last response covered.
+    // responses_out_of_order_ holds responses by the sequence number their
+    // requests start after, which wait for an earlier range to arrive.
+    // responses_to_apply_ holds responses received in order but not yet
+    // applied, its front is the one being applied if applying_ is true.
+    // Responses pushed by upstream carry the callback to reply once they are
+    // applied.
+    // next_pull_seq_no_ is the largest sequence number received in order so
+    // far.
+    struct PendingResponse {
+      ReplicateResponse response;
+      std::unique_ptr<PushCallbackType> push_callback;
+    };
+    std::mutex pull_mutex_;
+    std::map<rocksdb::SequenceNumber, rocksdb::SequenceNumber>
+      pulls_in_flight_;
+    uint64_t pull_stride_;
+    std::map<rocksdb::SequenceNumber, ReplicateResponse>
+      responses_out_of_order_;
+    std::deque<PendingResponse> responses_to_apply_;
+    rocksdb::SequenceNumber next_pull_seq_no_;
+    bool applying_;
+    // The largest sequence number upstream is known to have
+    std::atomic<uint64_t> upstream_seq_no_;
+    // The version of options_.upstream_resolver we last followed the Master
+    // of, when we failed over to a peer, 0 if we are following the Master,
+    // and whether peers are being probed for a fail over.
+    std::atomic<uint64_t> upstream_version_;
+    std::atomic<uint64_t> failed_over_ms_;
+    std::atomic<bool> probing_peers_;
+    // When the last update applied was written to the Master
+    std::atomic<uint64_t> last_applied_timestamp_ms_;
+    detail::BatchSizeController batch_size_controller_;
+    std::atomic<bool> push_mode_;
+    // the codec we ask upstream to compress updates with
+    CompressionType compression_;
+    // true while downloading a checkpoint from upstream, and until
+    // on_checkpoint_downloaded returns. No pulls are sent meanwhile.
+    std::atomic<bool> bootstrapping_;
+
+    // The checkpoint kept for Slaves to bootstrap from. checkpoint_id_ is
+    // empty if there is none. They are protected by checkpoint_mutex_.
+    std::mutex checkpoint_mutex_;
+    std::string checkpoint_id_;
+    uint64_t checkpoint_created_ms_;
+    std::vector<CheckpointFile> checkpoint_files_;
+
+    // Master side subscribers
+    std::mutex subscribers_mutex_;
+    std::list<std::shared_ptr<Subscriber>> subscribers_;
+    std::atomic<bool> has_subscribers_;
 
     friend class ReplicatorHandler;
     friend class RocksDBReplicator;
     friend class CachedIterCleaner;
+    friend class MultiPuller;
   };
 
   static RocksDBReplicator* instance() {
@@ -149,6 +592,12 @@ class RocksDBReplicator {
     return &instance;
   }
 
+  /*
+   * Create a RocksDBReplicator serving on port, separate from instance().
+   * It allows running Masters and Slaves in one process, e.g. in benchmarks.
+   */
+  static std::unique_ptr<RocksDBReplicator> newInstance(uint16_t port);
+
   /*
    * Add a db to be replicated.
    * If the db is already managed by the library, DB_PRE_EXIST will be returned.
@@ -157,14 +606,18 @@ class RocksDBReplicator {
    * replicated db directly instead of using the write() function below. It is
    * valid until the subsequent call of removeDB with db_name.
    * If role is SLAVE, upstream_addr is where the library should pull updates
-   * from for this db.
+   * from for this db. A SLAVE db serves downstream Slaves the same way as a
+   * MASTER db does, so Slaves may be chained, e.g. one Slave per zone pulling
+   * from the Master and the others pulling from it.
+   * options are the replication options for this db.
    */
   ReturnCode addDB(const std::string& db_name,
                    std::shared_ptr<rocksdb::DB> db,
                    const DBRole role,
                    const folly::SocketAddress& upstream_addr
                    = folly::SocketAddress(),
-                   ReplicatedDB** replicated_db = nullptr);
+                   ReplicatedDB** replicated_db = nullptr,
+                   const ReplicatedDBOptions& options = ReplicatedDBOptions());
 
   /*
    * Remove a db from the library.
@@ -190,11 +643,42 @@ class RocksDBReplicator {
                    rocksdb::SequenceNumber* seq_no = nullptr);
 
   /*
-   * Get stats of the library in the same text format as the java ostrich
-   * library.
+   * Same as write(), but doesn't block the calling thread waiting for Slaves
+   * in replication mode 1 and 2. The updates are applied to the db and seq_no
+   * is filled before it returns. The returned future is fulfilled with the
+   * ReturnCode write() would return.
+   */
+  folly::Future<ReturnCode> writeAsync(const std::string& db_name,
+                                       const rocksdb::WriteOptions& options,
+                                       rocksdb::WriteBatch* updates,
+                                       rocksdb::SequenceNumber* seq_no
+                                       = nullptr);
+
+  /*
+   * Get the replication state of each db in the same text format as the
+   * counters of the java ostrich library, one stat per line tagged with the
+   * db name, e.g.
+   *   replicator_lag_seq_no db=shard1: 12
    */
   std::string getTextStats();
 
+  /*
+   * Same as getTextStats(), but as a JSON object keyed by db names.
+   */
+  std::string getJsonStats();
+
+  /*
+   * Add /replicator_stats.txt and /replicator_stats.json to op_map, serving
+   * getTextStats() and getJsonStats() of instance(). Pass op_map to
+   * common::StatusServer::StartStatusServer(), optionally with
+   * /replicator_stats.txt in its extra_stats_endpoints to have the stats
+   * listed in /stats.txt.
+   */
+  static void addStatusEndpoints(
+    common::StatusServer::EndPointToOPMap* op_map);
+
+  ~RocksDBReplicator();
+
   // no copy or move
   RocksDBReplicator(const RocksDBReplicator&) = delete;
   RocksDBReplicator& operator=(const RocksDBReplicator&) = delete;
@@ -214,17 +698,73 @@ class RocksDBReplicator {
     folly::EventBase evb_;
   };
 
+  // MultiPuller sends pull requests of all dbs replicating from the same
+  // upstream with replicateMulti() calls. Requests made while one call is
+  // being prepared are sent together with it.
+  class MultiPuller {
+   public:
+    MultiPuller(folly::Executor* executor,
+                common::ThriftClientPool<ReplicatorAsyncClient>* client_pool);
+
+    // Send request for db to upstream_addr. db->handleReplicateResponse() is
+    // called with the result.
+    // Return false if upstream_addr doesn't support replicateMulti(), in which
+    // case the caller needs to send request by itself.
+    bool pull(const folly::SocketAddress& upstream_addr,
+              std::weak_ptr<ReplicatedDB> db,
+              ReplicateRequest request);
+
+   private:
+    struct PendingRequest {
+      std::weak_ptr<ReplicatedDB> db;
+      ReplicateRequest request;
+    };
+
+    struct Upstream {
+      std::vector<PendingRequest> pending_requests;
+      // a flush() has been scheduled for pending_requests
+      bool flush_scheduled = false;
+      bool unsupported = false;
+    };
+
+    void flush(const folly::SocketAddress& upstream_addr);
+    void handleResponse(const folly::SocketAddress& upstream_addr,
+                        std::vector<PendingRequest> requests,
+                        folly::Try<MultiReplicateResponse>&& t);
+
+    folly::Executor* const executor_;
+    common::ThriftClientPool<ReplicatorAsyncClient>* const client_pool_;
+    apache::thrift::RpcOptions rpc_options_;
+    std::mutex upstreams_mutex_;
+    std::unordered_map<folly::SocketAddress, Upstream> upstreams_;
+  };
+
   RocksDBReplicator();
-  ~RocksDBReplicator();
+  explicit RocksDBReplicator(uint16_t port);
+
+  // They are declared before the executors they forward tasks to, so that
+  // they outlive tasks run when the executors are destroyed.
+  std::unique_ptr<detail::MonitoredExecutor> monitored_executor_;
+  // serves catch-up requests with executor_ at a lower priority
+  std::unique_ptr<detail::MonitoredExecutor> monitored_catch_up_executor_;
+  std::unique_ptr<detail::MonitoredExecutor> monitored_apply_executor_;
+  // Its flushes and responses run on monitored_executor_, so it needs to
+  // outlive them as well.
+  std::unique_ptr<MultiPuller> multi_puller_;
 
 #if __GNUC__ >= 8
   std::unique_ptr<folly::CPUThreadPoolExecutor> executor_;
+  std::unique_ptr<folly::CPUThreadPoolExecutor> apply_executor_;
 #else
   std::unique_ptr<wangle::CPUThreadPoolExecutor> executor_;
+  std::unique_ptr<wangle::CPUThreadPoolExecutor> apply_executor_;
 #endif
 
   common::ThriftClientPool<ReplicatorAsyncClient> client_pool_;
 
+  // the port of server_
+  const uint16_t port_;
+
   detail::FastReadMap<std::string,
     std::shared_ptr<RocksDBReplicator::ReplicatedDB>> db_map_;
 
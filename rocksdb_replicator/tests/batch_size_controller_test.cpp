@@ -0,0 +1,70 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/batch_size_controller.h"
+
+using replicator::detail::BatchSizeController;
+
+TEST(BatchSizeControllerTest, Basics) {
+  BatchSizeController controller(50, 1000, 100, 8);
+  EXPECT_EQ(controller.maxUpdates(), 50);
+  EXPECT_EQ(controller.maxBytes(), 1000);
+
+  // caught up
+  controller.onResponse(1, 10, 5);
+  EXPECT_EQ(controller.scale(), 1);
+
+  // full response
+  controller.onResponse(50, 10, 5);
+  EXPECT_EQ(controller.scale(), 2);
+  EXPECT_EQ(controller.maxUpdates(), 100);
+  EXPECT_EQ(controller.maxBytes(), 2000);
+
+  // full by bytes
+  controller.onResponse(1, 2000, 5);
+  EXPECT_EQ(controller.scale(), 4);
+
+  // lagging
+  controller.onResponse(1, 10, 101);
+  EXPECT_EQ(controller.scale(), 8);
+  controller.onResponse(1, 10, 101);
+  EXPECT_EQ(controller.scale(), 8);
+
+  // catching up
+  controller.onResponse(1, 10, 5);
+  EXPECT_EQ(controller.scale(), 4);
+  controller.onResponse(0, 0, 0);
+  controller.onResponse(0, 0, 0);
+  controller.onResponse(0, 0, 0);
+  EXPECT_EQ(controller.scale(), 1);
+  EXPECT_EQ(controller.maxUpdates(), 50);
+}
+
+TEST(BatchSizeControllerTest, NoLimit) {
+  BatchSizeController controller(0, 0, 100, 8);
+  controller.onResponse(1000, 1000000, 5);
+  EXPECT_EQ(controller.scale(), 1);
+  EXPECT_EQ(controller.maxUpdates(), 0);
+  EXPECT_EQ(controller.maxBytes(), 0);
+
+  BatchSizeController fixed(50, 0, 100, 1);
+  fixed.onResponse(50, 0, 1000);
+  EXPECT_EQ(fixed.scale(), 1);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,116 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/compression.h"
+
+using replicator::CompressedUpdates;
+using replicator::CompressionType;
+using replicator::Update;
+using replicator::detail::compressUpdates;
+using replicator::detail::decompressUpdates;
+using replicator::detail::parseCompressionType;
+using std::string;
+using std::to_string;
+using std::vector;
+
+vector<Update> makeUpdates(int n) {
+  vector<Update> updates;
+  for (int i = 0; i < n; ++i) {
+    Update update;
+    auto str = "update " + to_string(i) + string(100 * i, 'a' + i % 26);
+    update.raw_data = std::move(*folly::IOBuf::copyBuffer(str));
+    update.timestamp = i;
+    updates.emplace_back(std::move(update));
+  }
+
+  return updates;
+}
+
+string toString(const folly::IOBuf& buf) {
+  string str;
+  for (const auto& range : buf) {
+    str.append(reinterpret_cast<const char*>(range.data()), range.size());
+  }
+
+  return str;
+}
+
+TEST(CompressionTest, ParseCompressionType) {
+  CompressionType type;
+  EXPECT_TRUE(parseCompressionType("none", &type));
+  EXPECT_EQ(type, CompressionType::NONE);
+  EXPECT_TRUE(parseCompressionType("lz4", &type));
+  EXPECT_EQ(type, CompressionType::LZ4);
+  EXPECT_TRUE(parseCompressionType("zstd", &type));
+  EXPECT_EQ(type, CompressionType::ZSTD);
+  EXPECT_FALSE(parseCompressionType("snappy", &type));
+}
+
+TEST(CompressionTest, RoundTrip) {
+  for (auto type : { CompressionType::LZ4, CompressionType::ZSTD }) {
+    auto expected = makeUpdates(20);
+    auto updates = makeUpdates(20);
+    CompressedUpdates compressed;
+    EXPECT_TRUE(compressUpdates(type, 0, &updates, &compressed));
+    EXPECT_EQ(compressed.compression, type);
+    EXPECT_EQ(compressed.raw_data_sizes.size(), updates.size());
+    for (const auto& update : updates) {
+      EXPECT_EQ(update.raw_data.computeChainDataLength(), 0);
+    }
+
+    EXPECT_TRUE(decompressUpdates(compressed, &updates));
+    ASSERT_EQ(updates.size(), expected.size());
+    for (size_t i = 0; i < updates.size(); ++i) {
+      EXPECT_EQ(toString(updates[i].raw_data),
+                toString(expected[i].raw_data));
+      EXPECT_EQ(updates[i].timestamp, expected[i].timestamp);
+    }
+  }
+}
+
+TEST(CompressionTest, NotCompressed) {
+  auto updates = makeUpdates(5);
+  CompressedUpdates compressed;
+  EXPECT_FALSE(compressUpdates(CompressionType::NONE, 0, &updates,
+                               &compressed));
+  EXPECT_FALSE(compressUpdates(CompressionType::ZSTD, 1024 * 1024, &updates,
+                               &compressed));
+  vector<Update> empty;
+  EXPECT_FALSE(compressUpdates(CompressionType::ZSTD, 0, &empty, &compressed));
+  EXPECT_EQ(toString(updates[1].raw_data), "update 1" + string(100, 'b'));
+}
+
+TEST(CompressionTest, Corrupted) {
+  auto updates = makeUpdates(10);
+  CompressedUpdates compressed;
+  EXPECT_TRUE(compressUpdates(CompressionType::ZSTD, 0, &updates,
+                              &compressed));
+
+  auto wrong_size = compressed;
+  wrong_size.raw_data_sizes.pop_back();
+  EXPECT_FALSE(decompressUpdates(wrong_size, &updates));
+
+  auto garbage = compressed;
+  garbage.data = std::move(*folly::IOBuf::copyBuffer(string(64, 'x')));
+  EXPECT_FALSE(decompressUpdates(garbage, &updates));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
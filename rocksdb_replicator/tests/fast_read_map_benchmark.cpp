@@ -0,0 +1,189 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <gflags/gflags.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "folly/RWSpinLock.h"
+#include "rocksdb_replicator/fast_read_map.h"
+
+using replicator::detail::FastReadMap;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace {
+
+const int kNumKeys = 200;
+const int kNumThreads = 8;
+
+// What FastReadMap used to be: readers copy the shared_ptr to the map under a
+// read lock.
+class LockedSharedPtrMap {
+ public:
+  bool get(const string& key, shared_ptr<int>* value) {
+    shared_ptr<std::unordered_map<string, shared_ptr<int>>> local_map;
+    {
+      folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
+      local_map = map_;
+    }
+
+    auto itor = local_map->find(key);
+    if (itor == local_map->end()) {
+      return false;
+    }
+
+    *value = itor->second;
+    return true;
+  }
+
+  void add(const string& key, shared_ptr<int> value) {
+    std::lock_guard<std::mutex> g(write_lock_);
+    auto new_map =
+      std::make_shared<std::unordered_map<string, shared_ptr<int>>>(*map_);
+    new_map->emplace(key, std::move(value));
+    folly::RWSpinLock::WriteHolder write_guard(map_rwlock_);
+    map_.swap(new_map);
+  }
+
+ private:
+  shared_ptr<std::unordered_map<string, shared_ptr<int>>> map_ =
+    std::make_shared<std::unordered_map<string, shared_ptr<int>>>();
+  folly::RWSpinLock map_rwlock_;
+  std::mutex write_lock_;
+};
+
+vector<string> makeKeys() {
+  vector<string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("shard" + to_string(i));
+  }
+  return keys;
+}
+
+template <typename MapType>
+void fill(MapType* map, const vector<string>& keys) {
+  for (size_t i = 0; i < keys.size(); ++i) {
+    map->add(keys[i], std::make_shared<int>(i));
+  }
+}
+
+// Each of n_threads threads looks up n / n_threads keys.
+template <typename MapType>
+void runGets(MapType* map, const vector<string>& keys, size_t n,
+             int n_threads) {
+  vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([map, &keys, n, n_threads, t] {
+        shared_ptr<int> value;
+        for (size_t i = t; i < n; i += n_threads) {
+          folly::doNotOptimizeAway(map->get(keys[i % keys.size()], &value));
+        }
+      });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace
+
+BENCHMARK(FastReadMapGet, n) {
+  FastReadMap<string, shared_ptr<int>> map;
+  vector<string> keys;
+  BENCHMARK_SUSPEND {
+    keys = makeKeys();
+    fill(&map, keys);
+  }
+
+  runGets(&map, keys, n, 1);
+}
+
+BENCHMARK_RELATIVE(LockedSharedPtrMapGet, n) {
+  LockedSharedPtrMap map;
+  vector<string> keys;
+  BENCHMARK_SUSPEND {
+    keys = makeKeys();
+    fill(&map, keys);
+  }
+
+  runGets(&map, keys, n, 1);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(FastReadMapGetContended, n) {
+  FastReadMap<string, shared_ptr<int>> map;
+  vector<string> keys;
+  BENCHMARK_SUSPEND {
+    keys = makeKeys();
+    fill(&map, keys);
+  }
+
+  runGets(&map, keys, n, kNumThreads);
+}
+
+BENCHMARK_RELATIVE(LockedSharedPtrMapGetContended, n) {
+  LockedSharedPtrMap map;
+  vector<string> keys;
+  BENCHMARK_SUSPEND {
+    keys = makeKeys();
+    fill(&map, keys);
+  }
+
+  runGets(&map, keys, n, kNumThreads);
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(FastReadMapAddOneByOne, n) {
+  vector<string> keys;
+  BENCHMARK_SUSPEND {
+    keys = makeKeys();
+  }
+
+  while (n--) {
+    FastReadMap<string, shared_ptr<int>> map;
+    fill(&map, keys);
+  }
+}
+
+BENCHMARK_RELATIVE(FastReadMapAddAll, n) {
+  vector<std::pair<string, shared_ptr<int>>> entries;
+  BENCHMARK_SUSPEND {
+    for (const auto& key : makeKeys()) {
+      entries.emplace_back(key, std::make_shared<int>(0));
+    }
+  }
+
+  while (n--) {
+    FastReadMap<string, shared_ptr<int>> map;
+    map.addAll(entries);
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
@@ -90,12 +90,40 @@ TEST(FastReadMapTest, Basics) {
   EXPECT_FALSE(map.get("3", &value));
   EXPECT_TRUE(map.get("2", &value));
   EXPECT_EQ(value, 2);
+  auto all = map.getAll();
+  EXPECT_EQ(all->size(), 2);
   EXPECT_TRUE(map.remove("1"));
   EXPECT_TRUE(map.remove("2"));
   EXPECT_FALSE(map.remove("2"));
   EXPECT_FALSE(map.remove("3"));
   EXPECT_FALSE(map.get("1", &value));
   EXPECT_FALSE(map.get("3", &value));
+  // the snapshot is not affected by later modifications
+  EXPECT_EQ(all->size(), 2);
+  EXPECT_EQ(all->at("1"), 1);
+}
+
+TEST(FastReadMapTest, Batch) {
+  FastReadMap<string, int> map;
+
+  EXPECT_TRUE(map.add("1", 1));
+  EXPECT_EQ(map.addAll({{"1", 10}, {"2", 2}, {"3", 3}}), 2);
+  int value;
+  EXPECT_TRUE(map.get("1", &value));
+  EXPECT_EQ(value, 1);
+  EXPECT_TRUE(map.get("3", &value));
+  EXPECT_EQ(value, 3);
+  EXPECT_EQ(map.addAll({{"2", 20}}), 0);
+
+  vector<int> values;
+  EXPECT_EQ(map.removeAll({"1", "3", "4"}, &values), 2);
+  EXPECT_EQ(values, vector<int>({1, 3}));
+  EXPECT_FALSE(map.get("1", &value));
+  EXPECT_TRUE(map.get("2", &value));
+  EXPECT_EQ(map.removeAll({"1"}), 0);
+  EXPECT_EQ(map.getAll()->size(), 1);
+  map.clear();
+  EXPECT_FALSE(map.get("2", &value));
 }
 
 int main(int argc, char** argv) {
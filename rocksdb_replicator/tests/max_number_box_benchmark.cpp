@@ -0,0 +1,144 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "rocksdb_replicator/max_number_box.h"
+
+using replicator::detail::MaxNumberBox;
+using std::thread;
+using std::vector;
+
+namespace {
+
+// What MaxNumberBox used to be: post() scans all waiters.
+class LinearMaxNumberBox {
+ public:
+  void post(const uint64_t num) {
+    vector<Waiter*> waiters_to_notify;
+    vector<Waiter*> waiters_to_wait;
+    {
+      std::lock_guard<std::mutex> g(mtx_);
+      if (num <= max_number_) {
+        return;
+      }
+
+      max_number_ = num;
+      std::partition_copy(waiters_.begin(), waiters_.end(),
+                          std::back_inserter(waiters_to_notify),
+                          std::back_inserter(waiters_to_wait),
+                          [this] (Waiter* w) {
+                            return w->num_to_wait <= max_number_;
+                          });
+      waiters_.swap(waiters_to_wait);
+    }
+
+    for (auto w : waiters_to_notify) {
+      w->cv.notify_one();
+    }
+  }
+
+  bool wait(const uint64_t num, const uint64_t timeout_ms) {
+    thread_local Waiter me;
+    std::unique_lock<std::mutex> lk(mtx_);
+    if (num <= max_number_) {
+      return true;
+    }
+
+    me.num_to_wait = num;
+    waiters_.push_back(&me);
+    me.cv.wait(lk, [this, num] { return num <= max_number_; });
+    return true;
+  }
+
+ private:
+  struct Waiter {
+    uint64_t num_to_wait;
+    std::condition_variable cv;
+  };
+
+  std::mutex mtx_;
+  uint64_t max_number_ = 0;
+  vector<Waiter*> waiters_;
+};
+
+// n_waiters threads keep taking the next number and waiting for it, like
+// writers in replication mode 2 waiting for their own updates to be acked.
+// A poster acks the numbers taken one at a time, like a Slave getting back
+// to us with every update, so each post() only satisfies one of the
+// waiters, while the others keep waiting. n numbers are waited for in total.
+template <typename Box>
+void contended(size_t n, size_t n_waiters) {
+  Box box;
+  std::atomic<uint64_t> next(0);
+  vector<thread> waiters;
+  for (size_t i = 0; i < n_waiters; ++i) {
+    waiters.emplace_back([&box, &next, n] {
+        while (true) {
+          auto num = ++next;
+          if (num > n) {
+            return;
+          }
+          box.wait(num, 0);
+        }
+      });
+  }
+
+  uint64_t acked = 0;
+  while (acked < n) {
+    if (acked < next.load()) {
+      box.post(++acked);
+    }
+  }
+
+  for (auto& t : waiters) {
+    t.join();
+  }
+}
+
+void ordered(size_t n, size_t n_waiters) {
+  contended<MaxNumberBox>(n, n_waiters);
+}
+
+void linear(size_t n, size_t n_waiters) {
+  contended<LinearMaxNumberBox>(n, n_waiters);
+}
+
+}  // namespace
+
+BENCHMARK_PARAM(ordered, 1)
+BENCHMARK_RELATIVE_PARAM(linear, 1)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(ordered, 16)
+BENCHMARK_RELATIVE_PARAM(linear, 16)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(ordered, 256)
+BENCHMARK_RELATIVE_PARAM(linear, 256)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(ordered, 1024)
+BENCHMARK_RELATIVE_PARAM(linear, 1024)
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
@@ -18,17 +18,21 @@
 
 #include <atomic>
 #include <chrono>
+#include <memory>
 #include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
 #include "rocksdb_replicator/max_number_box.h"
+#include "wangle/concurrent/CPUThreadPoolExecutor.h"
 
 using replicator::detail::MaxNumberBox;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 using std::chrono::system_clock;
 
+wangle::CPUThreadPoolExecutor g_executor(4);
+
 TEST(MaxNumberBoxTest, Basics) {
   MaxNumberBox box;
   std::atomic<uint64_t> num_to_post(0);
@@ -64,6 +68,79 @@ TEST(MaxNumberBoxTest, Basics) {
   poster.join();
 }
 
+TEST(MaxNumberBoxTest, Async) {
+  auto box = std::make_unique<MaxNumberBox>();
+
+  EXPECT_TRUE(box->waitAsync(0, 10, &g_executor).get());
+  EXPECT_FALSE(box->waitAsync(1, 10, &g_executor).get());
+
+  auto f1 = box->waitAsync(5, 0, &g_executor);
+  auto f2 = box->waitAsync(10, 0, &g_executor);
+  auto f3 = box->waitAsync(20, 10, &g_executor);
+  EXPECT_FALSE(f1.isReady());
+  box->post(4);
+  EXPECT_FALSE(f1.isReady());
+  box->post(5);
+  EXPECT_TRUE(f1.isReady());
+  EXPECT_TRUE(f1.value());
+  EXPECT_FALSE(f2.isReady());
+  EXPECT_FALSE(f3.get());
+
+  box->post(10);
+  EXPECT_TRUE(f2.isReady());
+  EXPECT_TRUE(f2.value());
+
+  std::vector<folly::Future<bool>> futures;
+  for (int i = 0; i < 1000; ++i) {
+    futures.push_back(box->waitAsync(i % 2 ? 100 : 11, i % 2 ? 1 : 0,
+                                     &g_executor));
+  }
+  std::this_thread::sleep_for(milliseconds(50));
+  box->post(11);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(futures[i].isReady());
+    EXPECT_EQ(futures[i].value(), i % 2 == 0);
+  }
+
+  // pending futures are fulfilled when the box is destroyed
+  auto f4 = box->waitAsync(100, 0, &g_executor);
+  box.reset();
+  EXPECT_TRUE(f4.isReady());
+  EXPECT_FALSE(f4.value());
+}
+
+TEST(MaxNumberBoxTest, OnlySatisfiedWaitersWakeUp) {
+  MaxNumberBox box;
+  const int n_waiters = 20;
+  std::atomic<int> n_woken(0);
+  std::vector<std::thread> waiters;
+  // waiters wait for numbers out of order, some of them for the same number
+  for (int i = 0; i < n_waiters; ++i) {
+    waiters.emplace_back([&box, &n_woken, num = (i * 7) % 10 + 1] {
+        EXPECT_TRUE(box.wait(num, 0));
+        ++n_woken;
+      });
+  }
+  auto f1 = box.waitAsync(3, 0, &g_executor);
+  auto f2 = box.waitAsync(8, 0, &g_executor);
+
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(n_woken.load(), 0);
+  box.post(3);
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(n_woken.load(), 6);
+  EXPECT_TRUE(f1.isReady());
+  EXPECT_FALSE(f2.isReady());
+
+  box.post(10);
+  for (auto& t : waiters) {
+    t.join();
+  }
+  EXPECT_EQ(n_woken.load(), n_waiters);
+  EXPECT_TRUE(f2.isReady());
+  EXPECT_TRUE(f2.value());
+}
+
 TEST(MaxNumberBoxTest, Stress) {
   // reduce the number of threads to make travis happy.
   // we may need to restore the numbers if we need to stress test it.
@@ -161,3 +238,17 @@ int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
+
+TEST(MaxNumberBoxTest, SlowTimeoutCallbacks) {
+  MaxNumberBox box;
+  // a slow callback of a timed out waiter doesn't hold up other timeouts
+  auto slow = box.waitAsync(1, 10, &g_executor).then([] (bool acked) {
+      std::this_thread::sleep_for(milliseconds(1000));
+      return acked;
+    });
+  auto start = system_clock::now();
+  EXPECT_FALSE(box.waitAsync(1, 50, &g_executor).get());
+  EXPECT_LT(duration_cast<milliseconds>(system_clock::now() - start).count(),
+            500);
+  EXPECT_FALSE(slow.get());
+}
@@ -0,0 +1,226 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <gflags/gflags.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "folly/Benchmark.h"
+#include "folly/Executor.h"
+#include "folly/futures/Future.h"
+#include "rocksdb_replicator/non_blocking_condition_variable.h"
+
+using replicator::detail::NonBlockingConditionVariable;
+
+DEFINE_int32(num_waiters, 10000, "Number of waiters parked");
+DEFINE_int32(waiter_timeout_ms, 100, "Timeout of each waiter");
+
+namespace {
+
+// Run tasks right away in the calling thread, so that the benchmarks measure
+// the condition variables rather than an executor.
+class InlineExecutor : public folly::Executor {
+ public:
+  void add(folly::Func f) override {
+    f();
+  }
+};
+
+// What NonBlockingConditionVariable used to be: waiters are added to the list
+// under a mutex, and each of them schedules its own timer.
+class MutexConditionVariable {
+ public:
+  explicit MutexConditionVariable(folly::Executor* executor)
+      : executor_(executor) {
+  }
+
+  template <typename Func, typename Predicate>
+  void runIfConditionOrWaitForNotify(Func f, Predicate p, uint64_t timeout_ms) {
+    if (p()) {
+      executor_->add(std::move(f));
+      return;
+    }
+
+    auto task = std::make_shared<Task>(std::move(f));
+    {
+      std::lock_guard<std::mutex> g(tasks_mutex_);
+      task->next = std::move(tasks_);
+      tasks_ = task;
+    }
+
+    if (p() && task->should_i_run()) {
+      executor_->add(std::move(task->func));
+      return;
+    }
+
+    if (timeout_ms > 0) {
+      std::weak_ptr<Task> weak_task(task);
+#if __GNUC__ >= 8
+      auto future =
+        folly::futures::sleepUnsafe(std::chrono::milliseconds(timeout_ms));
+#else
+      auto future = folly::futures::sleep(std::chrono::milliseconds(timeout_ms));
+#endif
+      std::move(future).then([weak_task = std::move(weak_task),
+                              executor = executor_]
+                             (folly::Try<folly::Unit>&& t) {
+          auto task = weak_task.lock();
+          if (task && task->should_i_run()) {
+            executor->add(std::move(task->func));
+          }
+        });
+    }
+  }
+
+  void notifyAll() {
+    std::shared_ptr<Task> tasks;
+    {
+      std::lock_guard<std::mutex> g(tasks_mutex_);
+      tasks_.swap(tasks);
+    }
+
+    while (tasks) {
+      if (tasks->should_i_run()) {
+        executor_->add(std::move(tasks->func));
+      }
+      tasks = std::move(tasks->next);
+    }
+  }
+
+ private:
+  struct Task {
+    template <typename Func>
+    explicit Task(Func&& f) : func(std::move(f)), next(), has_done(false) {}
+
+    bool should_i_run() {
+      return !has_done.exchange(true);
+    }
+
+    std::function<void()> func;
+    std::shared_ptr<Task> next;
+    std::atomic<bool> has_done;
+  };
+
+  std::shared_ptr<Task> tasks_;
+  std::mutex tasks_mutex_;
+  folly::Executor* const executor_;
+};
+
+InlineExecutor g_executor;
+
+// A waiter like a long-polling replicate request, which waits again once it
+// is woken up, as long as parking is true.
+template <typename CondVar>
+void park(CondVar* cond_var, const std::atomic<bool>* parking) {
+  cond_var->runIfConditionOrWaitForNotify(
+    [cond_var, parking] {
+      if (parking->load()) {
+        park(cond_var, parking);
+      }
+    },
+    [] { return false; },
+    FLAGS_waiter_timeout_ms);
+}
+
+template <typename CondVar>
+void notifyWithoutWaiters(size_t n) {
+  CondVar cond_var(&g_executor);
+  while (n--) {
+    cond_var.notifyAll();
+  }
+}
+
+template <typename CondVar>
+void parkAndNotify(size_t n) {
+  CondVar cond_var(&g_executor);
+  std::atomic<int> counter(0);
+  while (n--) {
+    for (int i = 0; i < FLAGS_num_waiters; ++i) {
+      cond_var.runIfConditionOrWaitForNotify(
+        [&counter] { ++counter; },
+        [] { return false; },
+        FLAGS_waiter_timeout_ms);
+    }
+    cond_var.notifyAll();
+  }
+  folly::doNotOptimizeAway(counter.load());
+}
+
+template <typename CondVar>
+void notifyParkedWaiters(size_t n) {
+  std::unique_ptr<CondVar> cond_var;
+  std::atomic<bool> parking(true);
+  BENCHMARK_SUSPEND {
+    cond_var.reset(new CondVar(&g_executor));
+    for (int i = 0; i < FLAGS_num_waiters; ++i) {
+      park(cond_var.get(), &parking);
+    }
+  }
+
+  while (n--) {
+    cond_var->notifyAll();
+  }
+
+  BENCHMARK_SUSPEND {
+    // let the waiters time out before destroying cond_var, so that none of
+    // them is running while it is destroyed
+    parking.store(false);
+    std::this_thread::sleep_for(
+      std::chrono::milliseconds(2 * FLAGS_waiter_timeout_ms));
+    cond_var.reset();
+  }
+}
+
+}  // namespace
+
+// Writers notify after every update, mostly with nobody waiting.
+BENCHMARK(NotifyWithoutWaiters, n) {
+  notifyWithoutWaiters<NonBlockingConditionVariable>(n);
+}
+
+BENCHMARK_RELATIVE(MutexNotifyWithoutWaiters, n) {
+  notifyWithoutWaiters<MutexConditionVariable>(n);
+}
+
+BENCHMARK_DRAW_LINE();
+
+// Park num_waiters waiters with timeouts, and wake them all up.
+BENCHMARK(ParkAndNotify, n) {
+  parkAndNotify<NonBlockingConditionVariable>(n);
+}
+
+BENCHMARK_RELATIVE(MutexParkAndNotify, n) {
+  parkAndNotify<MutexConditionVariable>(n);
+}
+
+BENCHMARK_DRAW_LINE();
+
+// Each notification wakes up num_waiters waiters, each of which waits again.
+BENCHMARK(NotifyParkedWaiters, n) {
+  notifyParkedWaiters<NonBlockingConditionVariable>(n);
+}
+
+BENCHMARK_RELATIVE(MutexNotifyParkedWaiters, n) {
+  notifyParkedWaiters<MutexConditionVariable>(n);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
@@ -0,0 +1,53 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/rate_limiter.h"
+
+using replicator::detail::RateLimiter;
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+
+TEST(RateLimiterTest, Basics) {
+  RateLimiter limiter;
+  // 1000 bytes per second
+  EXPECT_EQ(limiter.reserveMs(500, 1000), 0);
+  auto delay = limiter.reserveMs(500, 1000);
+  EXPECT_GE(delay, 450);
+  EXPECT_LE(delay, 500);
+  delay = limiter.reserveMs(1000, 1000);
+  EXPECT_GE(delay, 950);
+  EXPECT_LE(delay, 1000);
+
+  // no limit
+  EXPECT_EQ(limiter.reserveMs(1000000, 0), 0);
+}
+
+TEST(RateLimiterTest, IdleBandwidthIsNotSaved) {
+  RateLimiter limiter;
+  EXPECT_EQ(limiter.reserveMs(100, 1000), 0);
+  sleep_for(milliseconds(300));
+  EXPECT_EQ(limiter.reserveMs(100, 1000), 0);
+  auto delay = limiter.reserveMs(100, 1000);
+  EXPECT_GE(delay, 50);
+  EXPECT_LE(delay, 100);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,104 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/recent_updates.h"
+
+using folly::IOBuf;
+using replicator::detail::RecentUpdates;
+using std::string;
+using std::vector;
+
+namespace {
+
+IOBuf makeBuf(const string& str) {
+  return IOBuf(IOBuf::COPY_BUFFER, str.data(), str.size());
+}
+
+string toString(const IOBuf& buf) {
+  return buf.cloneAsValue().moveToFbString().toStdString();
+}
+
+}  // namespace
+
+TEST(RecentUpdatesTest, Basics) {
+  RecentUpdates recent_updates(100);
+  vector<RecentUpdates::Entry> entries;
+  uint64_t next_seq_no = 0;
+  EXPECT_FALSE(recent_updates.read(1, 0, 0, &entries, &next_seq_no));
+
+  // updates of 10 bytes covering sequence numbers [1, 21)
+  for (int i = 0; i < 10; ++i) {
+    recent_updates.append(i * 2 + 1, 2, i, makeBuf(string(10, 'a' + i)));
+  }
+  // not following the last one
+  recent_updates.append(5, 2, 100, makeBuf("x"));
+  recent_updates.append(21, 0, 100, makeBuf("x"));
+
+  EXPECT_FALSE(recent_updates.read(2, 0, 0, &entries, &next_seq_no));
+  EXPECT_FALSE(recent_updates.read(21, 0, 0, &entries, &next_seq_no));
+  EXPECT_TRUE(entries.empty());
+
+  EXPECT_TRUE(recent_updates.read(1, 0, 0, &entries, &next_seq_no));
+  EXPECT_EQ(entries.size(), 10);
+  EXPECT_EQ(next_seq_no, 21);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(entries[i].seq_no, i * 2 + 1);
+    EXPECT_EQ(entries[i].count, 2);
+    EXPECT_EQ(entries[i].timestamp, i);
+    EXPECT_EQ(toString(entries[i].raw_data), string(10, 'a' + i));
+  }
+
+  // limits
+  entries.clear();
+  EXPECT_TRUE(recent_updates.read(5, 3, 0, &entries, &next_seq_no));
+  EXPECT_EQ(entries.size(), 3);
+  EXPECT_EQ(next_seq_no, 11);
+  entries.clear();
+  EXPECT_TRUE(recent_updates.read(5, 0, 15, &entries, &next_seq_no));
+  EXPECT_EQ(entries.size(), 2);
+  EXPECT_EQ(next_seq_no, 9);
+
+  // the oldest ones are dropped
+  recent_updates.append(21, 1, 10, makeBuf(string(30, 'z')));
+  entries.clear();
+  EXPECT_FALSE(recent_updates.read(5, 0, 0, &entries, &next_seq_no));
+  EXPECT_TRUE(recent_updates.read(7, 0, 0, &entries, &next_seq_no));
+  EXPECT_EQ(entries.size(), 8);
+  EXPECT_EQ(next_seq_no, 22);
+
+  // a gap drops all of them
+  recent_updates.append(30, 1, 11, makeBuf("y"));
+  entries.clear();
+  EXPECT_FALSE(recent_updates.read(21, 0, 0, &entries, &next_seq_no));
+  EXPECT_TRUE(recent_updates.read(30, 0, 0, &entries, &next_seq_no));
+  EXPECT_EQ(entries.size(), 1);
+  EXPECT_EQ(next_seq_no, 31);
+}
+
+TEST(RecentUpdatesTest, Disabled) {
+  RecentUpdates recent_updates(0);
+  recent_updates.append(1, 1, 0, makeBuf("a"));
+  vector<RecentUpdates::Entry> entries;
+  uint64_t next_seq_no = 0;
+  EXPECT_FALSE(recent_updates.read(1, 0, 0, &entries, &next_seq_no));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
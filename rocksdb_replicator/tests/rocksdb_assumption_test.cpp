@@ -17,6 +17,7 @@
 //
 
 #include <algorithm>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <string>
@@ -358,6 +359,74 @@ void ReplicateDB(const unique_ptr<DB>& master, unique_ptr<DB>* slave,
   }
 }
 
+// RocksDB stamps a batch with the sequence number of its first record when
+// writing it, even if it is written in a group with batches of other threads.
+TEST(RocksDBAssumptionTest, WriteBatchSequenceNumber) {
+  auto db = CleanAndOpenDB("/tmp/test_write_batch_sequence_number_db");
+  const int n_threads = 8;
+  const int n_batches_per_thread = 1000;
+  vector<vector<SequenceNumber>> first_seq_nos(n_threads);
+  vector<thread> threads;
+  for (int i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&db, &first_seq_nos, i] {
+        for (int j = 0; j < n_batches_per_thread; ++j) {
+          WriteBatch batch;
+          batch.Put("key" + to_string(i), "value" + to_string(j));
+          batch.Delete("key" + to_string(j));
+          batch.PutLogData("log data");
+          EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &batch).ok());
+
+          // the first 8 bytes of a batch is its sequence number in little
+          // endian
+          SequenceNumber seq_no;
+          memcpy(&seq_no, batch.Data().data(), sizeof(seq_no));
+          first_seq_nos[i].push_back(seq_no);
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // each batch takes 2 sequence numbers, no two batches overlap
+  vector<SequenceNumber> all;
+  for (const auto& seq_nos : first_seq_nos) {
+    all.insert(all.end(), seq_nos.begin(), seq_nos.end());
+  }
+  std::sort(all.begin(), all.end());
+  for (size_t i = 0; i < all.size(); ++i) {
+    EXPECT_EQ(all[i], 2 * i + 1);
+  }
+  EXPECT_EQ(db->GetLatestSequenceNumber(), all.size() * 2);
+}
+
+TEST(RocksDBAssumptionTest, TrailingLogDataLayout) {
+  auto db = CleanAndOpenDB("/tmp/test_trailing_log_data_layout_db");
+
+  // an 8 byte LogData appended last is always the last 10 bytes of the rep,
+  // no matter what comes before it, and it stays so in the WAL
+  WriteBatch batch;
+  batch.Put("key", string(1000, 'v'));
+  batch.PutLogData("log data");
+  batch.Delete("key");
+  const uint64_t ms = 0x0102030405060708;
+  batch.PutLogData(Slice(reinterpret_cast<const char*>(&ms), sizeof(ms)));
+  EXPECT_TRUE(db->Write(rocksdb::WriteOptions(), &batch).ok());
+
+  unique_ptr<TransactionLogIterator> iter;
+  EXPECT_TRUE(db->GetUpdatesSince(1, &iter).ok());
+  EXPECT_TRUE(iter->Valid());
+  const auto& rep = iter->GetBatch().writeBatchPtr->Data();
+  EXPECT_GE(rep.size(), 2 + sizeof(ms));
+  const auto tail = rep.data() + rep.size() - 2 - sizeof(ms);
+  EXPECT_EQ(static_cast<uint8_t>(tail[0]), 0x3);
+  EXPECT_EQ(static_cast<uint8_t>(tail[1]), sizeof(ms));
+  uint64_t read_ms;
+  memcpy(&read_ms, tail + 2, sizeof(read_ms));
+  EXPECT_EQ(read_ms, ms);
+}
+
 TEST(RocksDBAssumptionTest, GetUpdatesSince) {
   const string master_path = "/tmp/test_get_updates_since_master_db";
   const string slave1_path = "/tmp/test_get_updates_since_slave_db1";
@@ -16,9 +16,12 @@
 // @author bol (bol@pinterest.com)
 //
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "folly/json.h"
 #include "gtest/gtest.h"
 
 // we need this hack to use RocksDBReplicator::RocksDBReplicator(), which is
@@ -44,7 +47,14 @@ using std::to_string;
 using std::unique_ptr;
 using std::vector;
 
+DECLARE_int32(replicator_max_updates_per_response);
 DECLARE_int32(replicator_pull_delay_on_error_ms);
+DECLARE_int32(replicator_pull_window_size);
+DECLARE_bool(replicator_push_mode);
+DECLARE_int32(replicator_replication_mode);
+DECLARE_uint64(replicator_slave_expire_ms);
+DECLARE_uint64(replicator_timeout_ms);
+DECLARE_bool(replicator_multiplex_pull);
 DECLARE_int32(rocksdb_replicator_port);
 
 shared_ptr<DB> cleanAndOpenDB(const string& path) {
@@ -100,6 +110,26 @@ TEST(RocksDBReplicatorTest, Basics) {
             ReturnCode::DB_NOT_FOUND);
 }
 
+// Count the timestamps in the WAL of db
+uint32_t countTimestamps(shared_ptr<DB> db) {
+  struct Counter : public rocksdb::WriteBatch::Handler {
+    void LogData(const rocksdb::Slice& blob) override {
+      EXPECT_EQ(blob.size(), sizeof(uint64_t));
+      ++n;
+    }
+
+    uint32_t n = 0;
+  } counter;
+
+  unique_ptr<rocksdb::TransactionLogIterator> iter;
+  EXPECT_TRUE(db->GetUpdatesSince(1, &iter).ok());
+  for (; iter->Valid(); iter->Next()) {
+    EXPECT_TRUE(iter->GetBatch().writeBatchPtr->Iterate(&counter).ok());
+  }
+
+  return counter.n;
+}
+
 struct Host {
   explicit Host(int16_t port) {
     FLAGS_rocksdb_replicator_port = port;
@@ -173,6 +203,709 @@ TEST(RocksDBReplicatorTest, 1_master_1_slave) {
   EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
 }
 
+TEST(RocksDBReplicatorTest, 1_master_1_slave_pipelined_pull) {
+  FLAGS_replicator_pull_window_size = 4;
+  FLAGS_replicator_max_updates_per_response = 3;
+  int16_t master_port = 9100;
+  int16_t slave_port = 9101;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 1000;
+  auto write = [&master, &options] (uint32_t i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    updates.Put(str + "key2", str + "value2");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  };
+
+  // the Slave catches up on the first half with several requests
+  // outstanding, and then keeps up with the second half
+  for (uint32_t i = 0; i < n_keys / 2; ++i) {
+    write(i);
+  }
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+  for (uint32_t i = n_keys / 2; i < n_keys; ++i) {
+    write(i);
+  }
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+
+    status = db_slave->Get(read_options, str + "key2", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value2");
+  }
+
+  FLAGS_replicator_pull_window_size = 1;
+  FLAGS_replicator_max_updates_per_response = 50;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_2_slaves_push) {
+  FLAGS_replicator_push_mode = true;
+  FLAGS_replicator_pull_window_size = 2;
+  int16_t master_port = 9102;
+  int16_t slave_port_1 = 9103;
+  int16_t slave_port_2 = 9104;
+  Host master(master_port);
+  Host slave_1(slave_port_1);
+  Host slave_2(slave_port_2);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave_1 = cleanAndOpenDB("/tmp/db_slave_1");
+  auto db_slave_2 = cleanAndOpenDB("/tmp/db_slave_2");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave_1.replicator_->addDB("shard1", db_slave_1, DBRole::SLAVE,
+                                       addr_master),
+            ReturnCode::OK);
+  // slave_2 is fed by slave_1
+  SocketAddress addr_slave_1("127.0.0.1", slave_port_1);
+  EXPECT_EQ(slave_2.replicator_->addDB("shard1", db_slave_2, DBRole::SLAVE,
+                                       addr_slave_1),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 500;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave_1->GetLatestSequenceNumber() < n_keys ||
+         db_slave_2->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave_1->GetLatestSequenceNumber(), n_keys);
+  EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), n_keys);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave_1->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+
+    status = db_slave_2->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  FLAGS_replicator_push_mode = false;
+  FLAGS_replicator_pull_window_size = 1;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_group_commit) {
+  int16_t master_port = 9105;
+  int16_t slave_port = 9106;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  // write some keys before adding the slave, so that it gets many updates in
+  // one response
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    updates.Delete(str + "deleted_key");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  SocketAddress addr_master("127.0.0.1", master_port);
+  replicator::ReplicatedDBOptions db_options;
+  db_options.sync_apply = true;
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, nullptr, db_options),
+            ReturnCode::OK);
+
+  while (db_slave->GetLatestSequenceNumber() < n_keys * 2) {
+    sleep_for(milliseconds(100));
+  }
+
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  // the timestamp of the last update is kept in the slave's WAL
+  unique_ptr<rocksdb::TransactionLogIterator> iter;
+  EXPECT_TRUE(db_slave->GetUpdatesSince(n_keys * 2, &iter).ok());
+  EXPECT_TRUE(iter->Valid());
+  replicator::LogExtractor extractor;
+  EXPECT_TRUE(iter->GetBatch().writeBatchPtr->Iterate(&extractor).ok());
+  EXPECT_GT(extractor.ms, 0);
+
+  // the slave has caught up
+  auto text_stats = slave.replicator_->getTextStats();
+  EXPECT_NE(text_stats.find("  replicator_lag_seq_no db=shard1: 0\n"),
+            string::npos);
+  EXPECT_NE(text_stats.find("role=SLAVE upstream=127.0.0.1:9105"),
+            string::npos);
+  auto json_stats = folly::parseJson(slave.replicator_->getJsonStats());
+  EXPECT_EQ(json_stats["shard1"]["upstream_seq_no"].asInt(), n_keys * 2);
+  EXPECT_EQ(json_stats["shard1"]["seq_no"].asInt(), n_keys * 2);
+  json_stats = folly::parseJson(master.replicator_->getJsonStats());
+  EXPECT_EQ(json_stats["shard1"]["role"].asString(), "MASTER");
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_async_write) {
+  FLAGS_replicator_replication_mode = 2;
+  int16_t master_port = 9107;
+  int16_t slave_port = 9108;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  // all writes are in flight at the same time on a single thread
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  vector<folly::Future<ReturnCode>> futures;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    rocksdb::SequenceNumber seq_no;
+    futures.push_back(master.replicator_->writeAsync("shard1", options,
+                                                     &updates, &seq_no));
+    EXPECT_EQ(seq_no, i + 1);
+  }
+
+  for (auto& f : futures) {
+    EXPECT_EQ(f.get(), ReturnCode::OK);
+  }
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys);
+
+  EXPECT_EQ(master.replicator_->writeAsync("shard2", options, nullptr).get(),
+            ReturnCode::DB_NOT_FOUND);
+
+  // no slave acks the write without a slave
+  FLAGS_replicator_timeout_ms = 100;
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  WriteBatch updates;
+  updates.Put("key", "value");
+  EXPECT_EQ(master.replicator_->writeAsync("shard1", options, &updates).get(),
+            ReturnCode::WAIT_SLAVE_TIMEOUT);
+
+  FLAGS_replicator_timeout_ms = 5 * 1000;
+  FLAGS_replicator_replication_mode = 0;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_2_slaves_quorum) {
+  FLAGS_replicator_timeout_ms = 100;
+  int16_t master_port = 9109;
+  int16_t slave_port_1 = 9110;
+  int16_t slave_port_2 = 9111;
+  Host master(master_port);
+  Host slave_1(slave_port_1);
+  Host slave_2(slave_port_2);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave_1 = cleanAndOpenDB("/tmp/db_slave_1");
+  auto db_slave_2 = cleanAndOpenDB("/tmp/db_slave_2");
+
+  // the flag is left as async mode, the db waits for both Slaves to commit
+  replicator::ReplicatedDBOptions db_options;
+  db_options.replication_mode = 2;
+  db_options.ack_quorum = 2;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), nullptr, db_options),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave_1.replicator_->addDB("shard1", db_slave_1, DBRole::SLAVE,
+                                       addr_master),
+            ReturnCode::OK);
+
+  // only one Slave has got the update
+  WriteOptions options;
+  WriteBatch updates;
+  updates.Put("key", "value");
+  EXPECT_EQ(master.replicator_->writeAsync("shard1", options, &updates).get(),
+            ReturnCode::WAIT_SLAVE_TIMEOUT);
+
+  FLAGS_replicator_timeout_ms = 5 * 1000;
+  EXPECT_EQ(slave_2.replicator_->addDB("shard1", db_slave_2, DBRole::SLAVE,
+                                       addr_master),
+            ReturnCode::OK);
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+    EXPECT_EQ(db_slave_1->GetLatestSequenceNumber(), i + 2);
+    EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), i + 2);
+  }
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_multiplexed_pull) {
+  FLAGS_replicator_multiplex_pull = true;
+  int16_t master_port = 9112;
+  int16_t slave_port = 9113;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  const int n_shards = 4;
+  vector<shared_ptr<DB>> db_masters;
+  vector<shared_ptr<DB>> db_slaves;
+  SocketAddress addr_master("127.0.0.1", master_port);
+  for (int i = 0; i < n_shards; ++i) {
+    auto shard = "shard" + to_string(i);
+    db_masters.push_back(cleanAndOpenDB("/tmp/db_master_" + to_string(i)));
+    db_slaves.push_back(cleanAndOpenDB("/tmp/db_slave_" + to_string(i)));
+    EXPECT_EQ(master.replicator_->addDB(shard, db_masters.back(),
+                                        DBRole::MASTER),
+              ReturnCode::OK);
+    EXPECT_EQ(slave.replicator_->addDB(shard, db_slaves.back(), DBRole::SLAVE,
+                                       addr_master),
+              ReturnCode::OK);
+  }
+  // a db missing on the Master doesn't affect others
+  auto db_orphan = cleanAndOpenDB("/tmp/db_orphan");
+  EXPECT_EQ(slave.replicator_->addDB("orphan", db_orphan, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  // only write to some of the shards
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    auto shard = "shard" + to_string(i % (n_shards - 1));
+    EXPECT_EQ(master.replicator_->write(shard, options, &updates),
+              ReturnCode::OK);
+  }
+
+  for (int i = 0; i < n_shards; ++i) {
+    while (db_slaves[i]->GetLatestSequenceNumber() <
+           db_masters[i]->GetLatestSequenceNumber()) {
+      sleep_for(milliseconds(100));
+    }
+  }
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slaves[i % (n_shards - 1)]->Get(read_options,
+                                                     str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+  EXPECT_EQ(db_slaves[n_shards - 1]->GetLatestSequenceNumber(), 0);
+
+  FLAGS_replicator_multiplex_pull = false;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_bootstrap_from_checkpoint) {
+  FLAGS_replicator_pull_delay_on_error_ms = 100;
+  int16_t master_port = 9114;
+  int16_t slave_port = 9115;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+  EXPECT_EQ(system("rm -rf /tmp/db_slave_bootstrap"), 0);
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  // purge the WAL holding the updates written so far
+  EXPECT_TRUE(db_master->Flush(rocksdb::FlushOptions()).ok());
+  WriteBatch updates;
+  updates.Put("last_key", "last_value");
+  EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+            ReturnCode::OK);
+  while (true) {
+    rocksdb::VectorLogPtr files;
+    EXPECT_TRUE(db_master->GetSortedWalFiles(files).ok());
+    if (!files.empty() && files.front()->StartSequence() > 1) {
+      break;
+    }
+    sleep_for(milliseconds(100));
+  }
+
+  std::atomic<bool> downloaded(false);
+  string checkpoint_dir;
+  replicator::ReplicatedDBOptions db_options;
+  db_options.on_checkpoint_downloaded =
+    [&downloaded, &checkpoint_dir] (const string& db_name,
+                                    const string& dir) {
+      EXPECT_EQ(db_name, "shard1");
+      checkpoint_dir = dir;
+      downloaded.store(true);
+    };
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, nullptr, db_options),
+            ReturnCode::OK);
+  while (!downloaded.load()) {
+    sleep_for(milliseconds(100));
+  }
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(db_slave->GetLatestSequenceNumber(), 0);
+
+  EXPECT_EQ(checkpoint_dir, "/tmp/db_slave_bootstrap");
+  DB* db;
+  EXPECT_TRUE(DB::Open(Options(), checkpoint_dir, &db).ok());
+  shared_ptr<DB> db_bootstrapped(db);
+  EXPECT_EQ(db_bootstrapped->GetLatestSequenceNumber(), n_keys + 1);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_bootstrapped->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  FLAGS_replicator_pull_delay_on_error_ms = 5 * 1000;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_throttled) {
+  int16_t master_port = 9116;
+  int16_t slave_port = 9117;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+  replicator::ReplicatedDBOptions db_options;
+  db_options.max_lag_seq_no = 10;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), nullptr, db_options),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  WriteBatch updates;
+  updates.Put("key", "value");
+  EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+            ReturnCode::OK);
+  while (folly::parseJson(master.replicator_->getJsonStats())
+         ["shard1"]["fastest_slave_seq_no"].asInt() < 1) {
+    sleep_for(milliseconds(100));
+  }
+
+  // the Slave stops replicating, and the Master keeps writing
+  EXPECT_EQ(slave.replicator_->removeDB("shard1"), ReturnCode::OK);
+  ReturnCode code = ReturnCode::OK;
+  for (int i = 0; i < 100 && code == ReturnCode::OK; ++i) {
+    code = master.replicator_->write("shard1", options, &updates);
+  }
+
+  // writes are delayed once the lag exceeds 10, and rejected at 20
+  EXPECT_EQ(code, ReturnCode::WRITE_THROTTLED);
+  EXPECT_EQ(db_master->GetLatestSequenceNumber(), 21);
+  EXPECT_EQ(master.replicator_->writeAsync("shard1", options, &updates).get(),
+            ReturnCode::WRITE_THROTTLED);
+  EXPECT_EQ(db_master->GetLatestSequenceNumber(), 21);
+
+  // the Slave is forgotten once it hasn't got back to us for a while, after
+  // which writes are not throttled anymore
+  auto old_expire_ms = FLAGS_replicator_slave_expire_ms;
+  FLAGS_replicator_slave_expire_ms = 1000;
+  sleep_for(milliseconds(1500));
+  EXPECT_EQ(folly::parseJson(master.replicator_->getJsonStats())
+            ["shard1"]["fastest_slave_seq_no"].asInt(), -1);
+  EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+            ReturnCode::OK);
+  EXPECT_EQ(db_master->GetLatestSequenceNumber(), 22);
+  FLAGS_replicator_slave_expire_ms = old_expire_ms;
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_fenced_read) {
+  int16_t master_port = 9118;
+  int16_t slave_port = 9119;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  RocksDBReplicator::ReplicatedDB* replicated_db_slave;
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master, &replicated_db_slave),
+            ReturnCode::OK);
+
+  ReadOptions read_options;
+  string value;
+  Status status;
+  // nothing has been written yet, the fence is met right away
+  EXPECT_EQ(replicated_db_slave->GetAsync(read_options, "key0", &value,
+                                          &status, 0, 0).get(),
+            ReturnCode::OK);
+  EXPECT_TRUE(status.IsNotFound());
+
+  // a read fenced beyond what the Master has times out
+  EXPECT_EQ(replicated_db_slave->GetAsync(read_options, "key0", &value,
+                                          &status, 1, 100).get(),
+            ReturnCode::READ_TIMEOUT);
+
+  // a read fenced by a write issued after it sees the write
+  auto future = replicated_db_slave->GetAsync(read_options, "key0", &value,
+                                              &status, 1, 10 * 1000);
+  WriteOptions options;
+  rocksdb::SequenceNumber seq_no;
+  WriteBatch updates;
+  updates.Put("key0", "value0");
+  EXPECT_EQ(master.replicator_->write("shard1", options, &updates, &seq_no),
+            ReturnCode::OK);
+  EXPECT_EQ(seq_no, 1);
+  EXPECT_EQ(future.get(), ReturnCode::OK);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(value, "value0");
+
+  // reads fenced by the last of many writes see all of them
+  const uint32_t n_keys = 100;
+  for (uint32_t i = 1; i < n_keys; ++i) {
+    WriteBatch batch;
+    auto str = to_string(i);
+    batch.Put("key" + str, "value" + str);
+    EXPECT_EQ(master.replicator_->write("shard1", options, &batch, &seq_no),
+              ReturnCode::OK);
+  }
+
+  vector<string> keys;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    keys.push_back("key" + to_string(i));
+  }
+  vector<rocksdb::Slice> key_slices(keys.begin(), keys.end());
+  vector<string> values;
+  vector<Status> statuses;
+  EXPECT_EQ(replicated_db_slave->MultiGetAsync(read_options, key_slices,
+                                               &values, &statuses, seq_no,
+                                               10 * 1000).get(),
+            ReturnCode::OK);
+  EXPECT_EQ(statuses.size(), n_keys);
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    EXPECT_TRUE(statuses[i].ok());
+    EXPECT_EQ(values[i], "value" + to_string(i));
+  }
+
+  unique_ptr<rocksdb::Iterator> iter;
+  EXPECT_EQ(replicated_db_slave->NewIteratorAsync(read_options, &iter, seq_no,
+                                                  10 * 1000).get(),
+            ReturnCode::OK);
+  uint32_t n = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    ++n;
+  }
+  EXPECT_EQ(n, n_keys);
+}
+
+TEST(RocksDBReplicatorTest, 1_master_1_slave_explicit_ack) {
+  // The Slave's next pull request is already in flight while it applies
+  // updates, so it can't tell the Master what it has committed. Writes
+  // would time out without the explicit ack.
+  FLAGS_replicator_pull_window_size = 2;
+  FLAGS_replicator_timeout_ms = 1000;
+  int16_t master_port = 9120;
+  int16_t slave_port = 9121;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+  replicator::ReplicatedDBOptions db_options;
+  db_options.replication_mode = 2;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER,
+                                      SocketAddress(), nullptr, db_options),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, DBRole::SLAVE,
+                                     addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 20;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+    EXPECT_EQ(db_slave->GetLatestSequenceNumber(), i + 1);
+  }
+
+  FLAGS_replicator_timeout_ms = 5 * 1000;
+  FLAGS_replicator_pull_window_size = 1;
+}
+
+// Resolves every db to the same Master and peers, which tests change at will
+class FakeUpstreamResolver : public replicator::UpstreamResolver {
+ public:
+  uint64_t version() override {
+    return version_.load();
+  }
+
+  bool resolve(const string& db_name, SocketAddress* master,
+               vector<SocketAddress>* peers) override {
+    std::lock_guard<std::mutex> g(mutex_);
+    *master = master_;
+    *peers = peers_;
+    return true;
+  }
+
+  void set(const SocketAddress& master, const vector<SocketAddress>& peers) {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      master_ = master;
+      peers_ = peers;
+    }
+    ++version_;
+  }
+
+ private:
+  std::atomic<uint64_t> version_{0};
+  std::mutex mutex_;
+  SocketAddress master_;
+  vector<SocketAddress> peers_;
+};
+
+TEST(RocksDBReplicatorTest, 1_master_2_slaves_failover) {
+  FLAGS_replicator_pull_delay_on_error_ms = 100;
+  int16_t master_port = 9122;
+  int16_t slave_port_1 = 9123;
+  int16_t slave_port_2 = 9124;
+  unique_ptr<Host> master(new Host(master_port));
+  Host slave_1(slave_port_1);
+  Host slave_2(slave_port_2);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave_1 = cleanAndOpenDB("/tmp/db_slave_1");
+  auto db_slave_2 = cleanAndOpenDB("/tmp/db_slave_2");
+  EXPECT_EQ(master->replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  SocketAddress addr_slave_1("127.0.0.1", slave_port_1);
+  EXPECT_EQ(slave_1.replicator_->addDB("shard1", db_slave_1, DBRole::SLAVE,
+                                       addr_master),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 100;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master->replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave_1->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  // The Master is gone, but the layout still says it is the Master. Slave 2
+  // fails over to Slave 1.
+  master.reset();
+  auto resolver = std::make_shared<FakeUpstreamResolver>();
+  resolver->set(addr_master, {addr_slave_1});
+  replicator::ReplicatedDBOptions db_options;
+  db_options.upstream_resolver = resolver;
+  EXPECT_EQ(slave_2.replicator_->addDB("shard1", db_slave_2, DBRole::SLAVE,
+                                       addr_master, nullptr, db_options),
+            ReturnCode::OK);
+  while (db_slave_2->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  // Slave 1 is promoted, Slave 2 follows it as its new Master.
+  EXPECT_EQ(slave_1.replicator_->removeDB("shard1"), ReturnCode::OK);
+  EXPECT_EQ(slave_1.replicator_->addDB("shard1", db_slave_1, DBRole::MASTER),
+            ReturnCode::OK);
+  resolver->set(addr_slave_1, {});
+  for (uint32_t i = n_keys; i < 2 * n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(slave_1.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  while (db_slave_2->GetLatestSequenceNumber() < 2 * n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < 2 * n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave_2->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  FLAGS_replicator_pull_delay_on_error_ms = 5 * 1000;
+}
+
 TEST(RocksDBReplicatorTest, 1_master_2_slaves_tree) {
   int16_t master_port = 9094;
   int16_t slave_port_1 = 9095;
@@ -292,6 +1025,11 @@ TEST(RocksDBReplicatorTest, 1_master_2_slaves_chain) {
   EXPECT_EQ(db_slave_1->GetLatestSequenceNumber(), n_keys);
   EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), n_keys);
 
+  // every hop keeps exactly one timestamp for each write to the master
+  EXPECT_EQ(countTimestamps(db_master), n_keys);
+  EXPECT_EQ(countTimestamps(db_slave_1), n_keys);
+  EXPECT_EQ(countTimestamps(db_slave_2), n_keys);
+
   // remove the middle node, and write some more keys to the master
   EXPECT_EQ(slave_1.replicator_->removeDB("shard1"), ReturnCode::OK);
   for (uint32_t i = 0; i < n_keys; ++i) {
@@ -333,6 +1071,76 @@ TEST(RocksDBReplicatorTest, 1_master_2_slaves_chain) {
   EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), 2 * n_keys);
 }
 
+TEST(RocksDBReplicatorTest, 1_master_2_slaves_chain_mid_batch) {
+  int16_t master_port = 9125;
+  int16_t slave_port_1 = 9126;
+  int16_t slave_port_2 = 9127;
+  Host master(master_port);
+  Host slave_1(slave_port_1);
+  Host slave_2(slave_port_2);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave_1 = cleanAndOpenDB("/tmp/db_slave_1");
+  auto db_slave_2 = cleanAndOpenDB("/tmp/db_slave_2");
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, DBRole::MASTER),
+            ReturnCode::OK);
+
+  WriteOptions options;
+  uint32_t n_keys = 20;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    EXPECT_EQ(master.replicator_->write("shard1", options, &updates),
+              ReturnCode::OK);
+  }
+
+  // Slave 1 gets all writes in one response, and applies them as one batch.
+  SocketAddress addr_master("127.0.0.1", master_port);
+  SocketAddress addr_slave_1("127.0.0.1", slave_port_1);
+  EXPECT_EQ(slave_1.replicator_->addDB("shard1", db_slave_1, DBRole::SLAVE,
+                                       addr_master),
+            ReturnCode::OK);
+  while (db_slave_1->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  // Slave 2 has got some of the writes from the Master, and is re-pointed to
+  // Slave 1 in the middle of its batch.
+  uint32_t n_got = 7;
+  for (uint32_t i = 0; i < n_got; ++i) {
+    auto str = to_string(i);
+    EXPECT_TRUE(db_slave_2->Put(options, str + "key", str + "value").ok());
+  }
+  unique_ptr<rocksdb::TransactionLogIterator> iter;
+  EXPECT_TRUE(db_slave_1->GetUpdatesSince(n_got + 1, &iter).ok());
+  EXPECT_TRUE(iter->Valid());
+  EXPECT_LT(iter->GetBatch().sequence, n_got + 1);
+
+  auto resolver = std::make_shared<FakeUpstreamResolver>();
+  resolver->set(addr_slave_1, {});
+  replicator::ReplicatedDBOptions db_options;
+  db_options.upstream_resolver = resolver;
+  EXPECT_EQ(slave_2.replicator_->addDB("shard1", db_slave_2, DBRole::SLAVE,
+                                       addr_master, nullptr, db_options),
+            ReturnCode::OK);
+  while (db_slave_2->GetLatestSequenceNumber() < n_keys) {
+    sleep_for(milliseconds(100));
+  }
+
+  // nothing is applied twice
+  sleep_for(milliseconds(500));
+  EXPECT_EQ(db_slave_2->GetLatestSequenceNumber(), n_keys);
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < n_keys; ++i) {
+    auto str = to_string(i);
+    string value;
+    auto status = db_slave_2->Get(read_options, str + "key", &value);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(value, str + "value");
+  }
+}
+
 TEST(RocksDBReplicatorTest, Stress) {
   int16_t port_1 = 8081;
   int16_t port_2 = 8082;
@@ -0,0 +1,93 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+using replicator::detail::TimerWheel;
+using std::atomic;
+using std::chrono::milliseconds;
+using std::make_shared;
+using std::shared_ptr;
+using std::this_thread::sleep_for;
+using std::thread;
+using std::vector;
+
+TEST(TimerWheelTest, Basics) {
+  // a full turn of the wheel takes 80 ms
+  TimerWheel wheel(10, 8);
+  auto owner = make_shared<int>(0);
+  atomic<int> counter(0);
+  auto func = [&counter] {
+    ++counter;
+  };
+
+  wheel.schedule(50, owner, func);
+  sleep_for(milliseconds(20));
+  EXPECT_EQ(counter, 0);
+  sleep_for(milliseconds(100));
+  EXPECT_EQ(counter, 1);
+
+  // longer than a turn of the wheel
+  wheel.schedule(200, owner, func);
+  sleep_for(milliseconds(150));
+  EXPECT_EQ(counter, 1);
+  sleep_for(milliseconds(150));
+  EXPECT_EQ(counter, 2);
+
+  // timers of gone owners don't fire
+  auto other_owner = make_shared<int>(0);
+  wheel.schedule(50, other_owner, func);
+  other_owner.reset();
+  sleep_for(milliseconds(150));
+  EXPECT_EQ(counter, 2);
+
+  // timers not fired yet are dropped by the destructor
+  wheel.schedule(10 * 1000, owner, func);
+}
+
+TEST(TimerWheelTest, Stress) {
+  TimerWheel wheel(1, 64);
+  auto owner = make_shared<int>(0);
+  atomic<int> counter(0);
+  const int n_threads = 8;
+  const int n_timers_per_thread = 10000;
+
+  vector<thread> threads;
+  for (int i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&wheel, &owner, &counter] {
+        for (int j = 0; j < n_timers_per_thread; ++j) {
+          wheel.schedule(j % 200, owner, [&counter] { ++counter; });
+        }
+      });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  sleep_for(milliseconds(1000));
+  EXPECT_EQ(counter, n_threads * n_timers_per_thread);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,6 +18,12 @@
 
 namespace cpp2 replicator
 
+enum CompressionType {
+  NONE = 0,
+  LZ4 = 1,
+  ZSTD = 2,
+}
+
 struct ReplicateRequest {
   # The largest sequence number currently in the local DB. Request for updates
   # of sequence (seq_no + 1) and larger
@@ -36,6 +42,25 @@ struct ReplicateRequest {
   # uppper limit set by client side.
   # A value of 0 means no limit
   4: required i32 max_updates,
+
+  # The largest sequence number the client has committed to its local DB.
+  # A client pipelining its requests may ask for updates beyond what it has
+  # applied, in which case seq_no runs ahead of this field.
+  # If it is not set, seq_no is used as the committed sequence number.
+  5: optional i64 committed_seq_no,
+
+  # If set, the server may compress updates in the response with this codec.
+  6: optional CompressionType compression,
+
+  # The server stops adding updates to the response once their total size
+  # reaches max_bytes. At least one update is returned if there is any.
+  # A value of 0 or not setting it means no limit
+  7: optional i64 max_bytes,
+
+  # The port of the Replicator server on the client side. Together with the
+  # client's IP address, it tells Slaves apart when the server waits for acks
+  # from more than one of them.
+  8: optional i32 port,
 }
 
 typedef binary (cpp.type = "folly::IOBuf") IOBuf
@@ -50,16 +75,41 @@ struct Update {
   2: required i64 timestamp,
 }
 
+# raw_data of a list of updates concatenated and compressed together
+struct CompressedUpdates {
+  1: required CompressionType compression,
+
+  2: required IOBuf data,
+
+  # The size of raw_data of each update before compression
+  3: required list<i32> raw_data_sizes,
+}
+
 struct ReplicateResponse {
   # updates is an ordered continuous range of updates starting from the seq_no
   # specified in ReplicateRequest.
   1: required list<Update> updates,
+
+  # If set, raw_data of all updates are empty, and are stored here instead.
+  2: optional CompressedUpdates compressed_updates,
+
+  # The largest sequence number in the server side db when the response was
+  # built, which tells the client how far behind it is.
+  3: optional i64 latest_seq_no,
+
+  # Set if the server acks writes only once clients have committed them, i.e.
+  # replication mode 2. The client then calls ack() as soon as it has
+  # committed the updates, instead of leaving it to its next request.
+  4: optional bool ack_requested,
 }
 
 enum ErrorCode {
   OTHER = 0,
   SOURCE_NOT_FOUND = 1, # could not find the upstream db
   SOURCE_READ_ERROR = 2,
+  # the updates asked for are no longer in the WAL of the upstream db. The
+  # client needs to bootstrap from a checkpoint of it.
+  SOURCE_WAL_PURGED = 3,
 }
 
 exception ReplicateException {
@@ -67,7 +117,148 @@ exception ReplicateException {
   2: required ErrorCode code,
 }
 
+# Requests for many dbs on the same server, which are served with one call.
+struct MultiReplicateRequest {
+  # At most one request for each db. Their max_wait_ms are ignored.
+  1: required list<ReplicateRequest> requests,
+
+  # The server replies as soon as any of the dbs has data available.
+  # Otherwise, it will wait for this amount of time before replying with an
+  # empty response.
+  2: required i32 max_wait_ms,
+}
+
+struct MultiReplicateResponse {
+  # Responses keyed by db_name. dbs without any update are left out.
+  1: required map<binary, ReplicateResponse> responses,
+
+  # Errors keyed by db_name, for dbs failed to be served.
+  2: required map<binary, ReplicateException> errors,
+}
+
+struct GetCheckpointRequest {
+  1: required binary db_name,
+}
+
+struct CheckpointFile {
+  # file name relative to the checkpoint directory
+  1: required string name,
+
+  2: required i64 size,
+}
+
+struct GetCheckpointResponse {
+  # Identifies the checkpoint in readCheckpointFile() calls. A server keeps a
+  # checkpoint for a while after creating it, and returns the same one to
+  # clients asking in the meantime.
+  1: required string checkpoint_id,
+
+  2: required list<CheckpointFile> files,
+}
+
+struct ReadCheckpointFileRequest {
+  1: required binary db_name,
+
+  2: required string checkpoint_id,
+
+  3: required string file_name,
+
+  # Read from this offset of the file, so that a client may resume from where
+  # it stopped.
+  4: required i64 offset,
+
+  5: required i32 max_bytes,
+}
+
+struct ReadCheckpointFileResponse {
+  # Empty if offset is at the end of the file
+  1: required IOBuf data,
+}
+
+struct AckRequest {
+  1: required binary db_name,
+
+  # The largest sequence number the client has committed to its local DB.
+  2: required i64 committed_seq_no,
+
+  # Same as ReplicateRequest.port
+  3: required i32 port,
+}
+
+struct AckResponse {
+}
+
+# A client may subscribe to a db instead of polling it with replicate(). The
+# server then pushes updates to the Replicator server on the client side with
+# push() as soon as they are available, until the subscription ends.
+struct SubscribeRequest {
+  # The largest sequence number the client has received. Updates of sequence
+  # (seq_no + 1) and larger will be pushed
+  1: required i64 seq_no,
+
+  # The name of the db subscribing to
+  2: required binary db_name,
+
+  # The port of the Replicator server on the client side, updates are pushed
+  # to it.
+  3: required i32 port,
+
+  # Max number of push() calls the server may have outstanding to the client.
+  # The client grants a new credit every time it replies to a push() call.
+  4: required i32 credits,
+
+  # The subscription ends after this amount of time, and the server replies
+  # with an empty response. The client is expected to subscribe again.
+  5: required i32 max_wait_ms,
+
+  # If set, the server may compress pushed updates with this codec.
+  6: optional CompressionType compression,
+}
+
+struct SubscribeResponse {
+}
+
+struct PushRequest {
+  # updates is an ordered continuous range of updates starting from
+  # (seq_no + 1)
+  1: required i64 seq_no,
+
+  # The name of the db the updates are for
+  2: required binary db_name,
+
+  3: required list<Update> updates,
+
+  # If set, raw_data of all updates are empty, and are stored here instead.
+  4: optional CompressedUpdates compressed_updates,
+
+  # Same as ReplicateResponse.latest_seq_no
+  5: optional i64 latest_seq_no,
+}
+
+struct PushResponse {
+  # The largest sequence number the client has committed to its local DB.
+  1: required i64 committed_seq_no,
+}
+
 service Replicator {
   ReplicateResponse replicate(1:ReplicateRequest request)
       throws (1:ReplicateException e)
+
+  MultiReplicateResponse replicateMulti(1:MultiReplicateRequest request)
+
+  GetCheckpointResponse getCheckpoint(1:GetCheckpointRequest request)
+      throws (1:ReplicateException e)
+
+  ReadCheckpointFileResponse readCheckpointFile(
+      1:ReadCheckpointFileRequest request)
+      throws (1:ReplicateException e)
+
+  SubscribeResponse subscribe(1:SubscribeRequest request)
+      throws (1:ReplicateException e)
+
+  PushResponse push(1:PushRequest request)
+      throws (1:ReplicateException e)
+
+  AckResponse ack(1:AckRequest request)
+      throws (1:ReplicateException e)
 }
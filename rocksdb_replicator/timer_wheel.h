@@ -0,0 +1,156 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace replicator { namespace detail {
+
+/*
+ * A hashed timer wheel for a large number of short lived timeouts, most of
+ * which are expected to be made moot before they expire, e.g. those of
+ * long-polling requests.
+ *
+ * A timer is put into the slot of the tick it expires at, modulo the number
+ * of slots, with a CAS on the head of the slot. A single thread advances the
+ * wheel one tick at a time, and fires the expired timers of the slot of that
+ * tick. So scheduling a timer is O(1) without any lock or allocation other
+ * than the timer itself, and a timer fires at most one tick late, unless the
+ * scheduling thread is preempted for long enough for the wheel to pass the
+ * slot, in which case it fires one turn of the wheel late.
+ *
+ * Timers are owned by an object through a weak_ptr. Timers whose owner is
+ * gone are dropped without firing the next time their slot is visited, even
+ * if they haven't expired.
+ */
+class TimerWheel {
+ public:
+  TimerWheel(uint64_t tick_ms, size_t n_slots)
+      : tick_ms_(std::max<uint64_t>(tick_ms, 1))
+      , n_slots_(std::max<size_t>(n_slots, 1))
+      , slots_(new std::atomic<Timer*>[n_slots_])
+      , current_tick_(0)
+      , stopping_(false)
+      , thread_() {
+    for (size_t i = 0; i < n_slots_; ++i) {
+      slots_[i].store(nullptr);
+    }
+
+    thread_ = std::thread([this] { run(); });
+  }
+
+  // The wheel shared by everyone in the process. It is never destroyed, so
+  // that it outlives all static objects scheduling timers on it.
+  static TimerWheel* get() {
+    static auto wheel = new TimerWheel(10, 1024);
+    return wheel;
+  }
+
+  // no copy or move
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Run f() in the thread of the wheel about timeout_ms later, unless owner
+  // is gone by then. f() is expected to be light weight, e.g. handing a task
+  // to an executor.
+  void schedule(uint64_t timeout_ms,
+                std::weak_ptr<void> owner,
+                std::function<void()> f) {
+    const auto ticks =
+      std::max<uint64_t>((timeout_ms + tick_ms_ - 1) / tick_ms_, 1);
+    auto timer = new Timer{current_tick_.load() + ticks, std::move(owner),
+                           std::move(f), nullptr};
+    push(timer);
+  }
+
+  // Timers not fired yet are dropped.
+  ~TimerWheel() {
+    stopping_.store(true);
+    thread_.join();
+    for (size_t i = 0; i < n_slots_; ++i) {
+      auto timer = slots_[i].load();
+      while (timer) {
+        auto next = timer->next;
+        delete timer;
+        timer = next;
+      }
+    }
+  }
+
+ private:
+  struct Timer {
+    uint64_t expire_tick;
+    std::weak_ptr<void> owner;
+    std::function<void()> func;
+    Timer* next;
+  };
+
+  void push(Timer* timer) {
+    auto& head = slots_[timer->expire_tick % n_slots_];
+    timer->next = head.load();
+    while (!head.compare_exchange_weak(timer->next, timer)) {
+    }
+  }
+
+  void run() {
+    const auto start = std::chrono::steady_clock::now();
+    while (!stopping_.load()) {
+      const auto tick = current_tick_.load();
+      const auto due = start + std::chrono::milliseconds(tick * tick_ms_);
+      if (std::chrono::steady_clock::now() < due) {
+        std::this_thread::sleep_until(due);
+        continue;
+      }
+
+      // Take the whole slot, and put back the timers due in later turns.
+      // Timers scheduled meanwhile expire after tick, so they are left
+      // alone until the next turn.
+      auto timer = slots_[tick % n_slots_].exchange(nullptr);
+      current_tick_.store(tick + 1);
+      while (timer) {
+        auto next = timer->next;
+        if (timer->owner.expired()) {
+          delete timer;
+        } else if (timer->expire_tick <= tick) {
+          if (auto owner = timer->owner.lock()) {
+            timer->func();
+          }
+          delete timer;
+        } else {
+          push(timer);
+        }
+        timer = next;
+      }
+    }
+  }
+
+  const uint64_t tick_ms_;
+  const size_t n_slots_;
+  std::unique_ptr<std::atomic<Timer*>[]> slots_;
+  // the tick to fire next
+  std::atomic<uint64_t> current_tick_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+};
+
+}  // namespace detail
+}  // namespace replicator
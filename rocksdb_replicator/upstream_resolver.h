@@ -0,0 +1,52 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "folly/SocketAddress.h"
+
+namespace replicator {
+
+/*
+ * Tells Slaves where to replicate from, so that they follow their Master as
+ * it moves, and fail over to a peer when it is unreachable, without waiting
+ * to be told, see ReplicatedDBOptions::upstream_resolver.
+ *
+ * Implementations must be thread safe. version() is called before every pull
+ * request, so it needs to be cheap.
+ */
+class UpstreamResolver {
+ public:
+  virtual ~UpstreamResolver() {}
+
+  // Changes whenever what resolve() returns may have changed, e.g. a new
+  // shard config has been loaded.
+  virtual uint64_t version() = 0;
+
+  /*
+   * Fill master with the Replicator address of the Master of db_name, and
+   * peers with those of its other replicas, excluding the local one.
+   * master is left uninitialized if db_name has no Master right now.
+   * Return false if db_name is unknown.
+   */
+  virtual bool resolve(const std::string& db_name,
+                       folly::SocketAddress* master,
+                       std::vector<folly::SocketAddress>* peers) = 0;
+};
+
+}  // namespace replicator